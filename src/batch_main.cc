@@ -0,0 +1,301 @@
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batch_pipeline.h"
+#include "opencv4/opencv2/opencv.hpp"
+#include "pnm_stream.h"
+#include "tiled_relevel.h"
+
+// Headless batch processing: relevels every image in a directory (or matching
+// a glob) at one scale, using all cores. Unlike `main`, this never touches Qt,
+// so it runs fine on machines without a display.
+
+namespace {
+
+const char kUsage[] =
+    "Usage: batch [flags] <input_dir_or_glob> <output_dir>\n"
+    "\n"
+    "  --scale=N      Relevel at pyramid scale N (clamped to what each image\n"
+    "                 supports).\n"
+    "  --scale=max-N  N steps more local than the coarsest scale; the same as\n"
+    "                 moving the editor's slider N notches. This adapts to\n"
+    "                 each image's size.\n"
+    "  --scale=auto, --scale=auto:F\n"
+    "                 Pick a scale for each image from its pyramid: the most\n"
+    "                 local one where neighbourhoods still span, on average,\n"
+    "                 F of the image's range in every channel (default: 0.5).\n"
+    "                 Higher F means less local. Not with --memory_budget_mb.\n"
+    "  --threads=N    Total worker threads, split evenly between the stages\n"
+    "                 below (default: one per core).\n"
+    "  --decode_threads=N, --preprocess_threads=N, --relevel_threads=N,\n"
+    "  --encode_threads=N\n"
+    "                 Threads for one stage of the pipeline, overriding\n"
+    "                 --threads.\n"
+    "  --queue_depth=N\n"
+    "                 Images allowed to wait between each pair of stages\n"
+    "                 (default: 4). Bounds memory use.\n"
+    "  --engine=pyramid, --engine=window\n"
+    "                 Where the local min/max come from: the min/max pyramid\n"
+    "                 (default, fastest), or true sliding windows, which\n"
+    "                 avoid the pyramid's blocky regions at some cost in\n"
+    "                 speed. Not with --memory_budget_mb.\n"
+    "  --contact_sheet=N\n"
+    "                 Also write <name>_scales.<ext> next to each output: a\n"
+    "                 sheet of N-pixel-wide thumbnails at every scale, for\n"
+    "                 choosing one. Reuses the pyramid, so it's cheap. Not\n"
+    "                 with --memory_budget_mb.\n"
+    "  --pyramid_stats\n"
+    "                 Also print where the pyramid code spent its time and\n"
+    "                 memory, totalled over all images.\n"
+    "  --memory_budget_mb=N\n"
+    "                 Process one image at a time, streaming it through in\n"
+    "                 strips so that memory use stays under N MB however big\n"
+    "                 the image is. For huge mosaics; inputs must be binary\n"
+    "                 PPM or PGM, and outputs are written the same way.\n";
+
+bool ParseInt(const std::string &text, int *value) {
+  if (text.empty() || !std::all_of(text.begin(), text.end(), ::isdigit))
+    return false;
+  // All digits, so only the range can be wrong.
+  errno = 0;
+  const long parsed = std::strtol(text.c_str(), nullptr, 10);
+  if (errno == ERANGE || parsed > INT_MAX)
+    return false;
+  *value = static_cast<int>(parsed);
+  return true;
+}
+
+// If `arg` is --<name>=<value>, sets *value and returns true.
+bool MatchFlag(const std::string &arg, const std::string &name,
+               std::string *value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+bool IsDirectory(const std::string &path) {
+  struct stat info;
+  return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+}
+
+bool HasImageExtension(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string extension = path.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  for (const char *known : {"jpg", "jpeg", "png", "tif", "tiff", "bmp", "webp",
+                            "ppm", "pgm"}) {
+    if (extension == known)
+      return true;
+  }
+  return false;
+}
+
+bool IsPnm(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  if (dot == std::string::npos)
+    return false;
+  std::string extension = path.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  return extension == "ppm" || extension == "pgm";
+}
+
+// The --memory_budget_mb path: one image at a time, each streamed from disk
+// to disk. Returns the number of failures.
+int RunTiled(const std::vector<std::string> &inputs,
+             const BatchPipeline::Options &options, size_t memory_budget) {
+  int failed = 0;
+  for (const std::string &input : inputs) {
+    const std::string output_path =
+        options.output_dir + "/" + input.substr(input.rfind('/') + 1);
+
+    std::string error;
+    PnmReader reader;
+    PnmWriter writer;
+    if (!IsPnm(input) || !reader.Open(input)) {
+      error = "streaming needs a binary PPM or PGM input";
+    } else if (!writer.Open(output_path, reader.size(), reader.type())) {
+      error = "couldn't write " + output_path;
+    } else {
+      int min_scale, max_scale;
+      MinMaxPyramid::ScaleRange(reader.size(), &min_scale, &max_scale);
+      const int scale = options.scale.Resolve(min_scale, max_scale);
+      if (TiledRelevel(&reader, scale, memory_budget, &writer, &error) &&
+          !writer.Close())
+        error = "couldn't write " + output_path;
+      // Don't leave a truncated output next to the good ones.
+      if (!error.empty()) {
+        writer.Close();
+        std::remove(output_path.c_str());
+      }
+    }
+
+    if (!error.empty()) {
+      std::cerr << input << ": " << error << "\n";
+      failed++;
+    }
+  }
+  return failed;
+}
+
+void PrintStats(const std::vector<BatchPipeline::StageStats> &stats) {
+  std::fprintf(stderr, "%-11s %7s %6s %9s %9s %9s %10s\n", "stage", "threads",
+               "images", "busy(s)", "starved", "blocked", "max queue");
+  for (const BatchPipeline::StageStats &stage : stats) {
+    std::fprintf(stderr, "%-11s %7d %6zu %9.2f %9.2f %9.2f %10zu\n",
+                 stage.name.c_str(), stage.threads, stage.items,
+                 stage.busy_seconds, stage.starved_seconds,
+                 stage.blocked_seconds, stage.queue_high_water);
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  BatchPipeline::Options options;
+  bool have_scale = false;
+  int total_threads = std::max(1u, std::thread::hardware_concurrency());
+  // Per-stage overrides; zero means "use a share of --threads".
+  int stage_threads[4] = {0, 0, 0, 0};
+  int memory_budget_mb = 0;
+  const char *const stage_flags[4] = {"decode_threads", "preprocess_threads",
+                                      "relevel_threads", "encode_threads"};
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    std::string value;
+    bool ok = true;
+    if (MatchFlag(arg, "scale", &value)) {
+      ok = have_scale = ScaleRule::Parse(value, &options.scale);
+    } else if (MatchFlag(arg, "threads", &value)) {
+      ok = ParseInt(value, &total_threads) && total_threads > 0;
+    } else if (MatchFlag(arg, "queue_depth", &value)) {
+      int depth;
+      ok = ParseInt(value, &depth) && depth > 0;
+      options.queue_depth = depth;
+    } else if (MatchFlag(arg, "engine", &value)) {
+      ok = value == "pyramid" || value == "window";
+      options.engine = value == "window"
+                           ? MinMaxPyramid::Engine::kSlidingWindow
+                           : MinMaxPyramid::Engine::kPyramid;
+    } else if (MatchFlag(arg, "contact_sheet", &value)) {
+      ok = ParseInt(value, &options.contact_sheet_width) &&
+           options.contact_sheet_width > 0;
+    } else if (arg == "--pyramid_stats") {
+      options.pyramid_stats = true;
+    } else if (MatchFlag(arg, "memory_budget_mb", &value)) {
+      ok = ParseInt(value, &memory_budget_mb) && memory_budget_mb > 0;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      ok = false;
+      for (int stage = 0; stage < 4; stage++) {
+        if (MatchFlag(arg, stage_flags[stage], &value))
+          ok = ParseInt(value, &stage_threads[stage]) &&
+               stage_threads[stage] > 0;
+      }
+    } else {
+      positional.push_back(arg);
+    }
+    if (!ok) {
+      std::cerr << "Bad flag: " << arg << "\n\n" << kUsage;
+      return 1;
+    }
+  }
+  if (positional.size() != 2 || !have_scale) {
+    std::cerr << kUsage;
+    return 1;
+  }
+  if (memory_budget_mb > 0 &&
+      options.engine == MinMaxPyramid::Engine::kSlidingWindow) {
+    // Streaming only ever builds the one pyramid level it needs.
+    std::cerr << "--engine=window doesn't work with --memory_budget_mb\n";
+    return 1;
+  }
+  if (memory_budget_mb > 0 && options.contact_sheet_width > 0) {
+    // Nor does it have the other scales to make thumbnails from.
+    std::cerr << "--contact_sheet doesn't work with --memory_budget_mb\n";
+    return 1;
+  }
+
+  // A directory means every image directly inside it; anything else is handed
+  // to cv::glob as a pattern.
+  const std::string &input_spec = positional[0];
+  std::vector<cv::String> matches;
+  cv::glob(IsDirectory(input_spec) ? input_spec + "/*" : input_spec, matches,
+           false);
+  std::vector<std::string> inputs;
+  for (const cv::String &match : matches) {
+    if (HasImageExtension(match))
+      inputs.push_back(match);
+  }
+  if (inputs.empty()) {
+    std::cerr << "No images found for " << input_spec << "\n";
+    return 1;
+  }
+
+  options.output_dir = positional[1];
+  if (!IsDirectory(options.output_dir) &&
+      mkdir(options.output_dir.c_str(), 0755) != 0) {
+    std::cerr << "Couldn't create output directory " << options.output_dir
+              << "\n";
+    return 1;
+  }
+
+  if (memory_budget_mb > 0) {
+    if (options.scale.automatic) {
+      // Streaming never has the whole pyramid to look at.
+      std::cerr << "--scale=auto doesn't work with --memory_budget_mb\n";
+      return 1;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const int failed =
+        RunTiled(inputs, options, static_cast<size_t>(memory_budget_mb) << 20);
+    const double seconds = std::chrono::duration<double>(
+                               std::chrono::steady_clock::now() - start)
+                               .count();
+    std::cerr << "Processed " << inputs.size() - failed << " images";
+    if (failed > 0)
+      std::cerr << " (" << failed << " failed)";
+    std::cerr << " in " << seconds << "s\n";
+    return failed > 0 ? 1 : 0;
+  }
+
+  // The stages all take roughly similar time, so by default they share the
+  // threads evenly; the stats printed at the end show where to rebalance.
+  const int share = std::max(1, (total_threads + 3) / 4);
+  int *threads[4] = {&options.decode_threads, &options.preprocess_threads,
+                     &options.relevel_threads, &options.encode_threads};
+  for (int stage = 0; stage < 4; stage++)
+    *threads[stage] = stage_threads[stage] > 0 ? stage_threads[stage] : share;
+
+  BatchPipeline pipeline(options);
+  const BatchPipeline::Result result = pipeline.Run(inputs);
+  for (const std::string &error : result.errors)
+    std::cerr << error << "\n";
+
+  PrintStats(pipeline.Stats());
+  if (options.pyramid_stats)
+    std::cerr << "Pyramids: " << result.pyramid_stats.Summary() << "\n";
+  std::cerr << "Processed " << result.succeeded << " images";
+  if (!result.errors.empty())
+    std::cerr << " (" << result.errors.size() << " failed)";
+  std::cerr << " in " << result.seconds << "s: "
+            << result.succeeded / std::max(result.seconds, 1e-9)
+            << " images/s\n";
+  return result.errors.empty() ? 0 : 1;
+}
@@ -0,0 +1,336 @@
+#include "batch_pipeline.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <thread>
+#include <utility>
+
+#include "contact_sheet.h"
+#include "opencv4/opencv2/opencv.hpp"
+#include "output_format.h"
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+int64_t Nanoseconds(Clock::duration duration) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(duration)
+      .count();
+}
+
+std::string BaseName(const std::string &path) {
+  const size_t slash = path.rfind('/');
+  return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+// "dir/a.jpg" becomes "dir/a<suffix>.jpg".
+std::string AddSuffix(const std::string &path, const std::string &suffix) {
+  const size_t dot = path.rfind('.');
+  const size_t slash = path.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return path + suffix;
+  return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+// Every stage needs at least one thread, and every queue room for at least
+// one job, or the pipeline never finishes. Sizing the pools relies on these
+// being the counts actually in use.
+BatchPipeline::Options Clamped(BatchPipeline::Options options) {
+  options.decode_threads = std::max(options.decode_threads, 1);
+  options.preprocess_threads = std::max(options.preprocess_threads, 1);
+  options.relevel_threads = std::max(options.relevel_threads, 1);
+  options.encode_threads = std::max(options.encode_threads, 1);
+  options.queue_depth = std::max<size_t>(options.queue_depth, 1);
+  return options;
+}
+
+} // namespace
+
+bool ScaleRule::Parse(const std::string &text, ScaleRule *rule) {
+  const std::string auto_prefix = "auto";
+  if (text.compare(0, auto_prefix.size(), auto_prefix) == 0) {
+    float min_range = MinMaxPyramid::kDefaultMinRange;
+    if (text.size() > auto_prefix.size()) {
+      if (text[auto_prefix.size()] != ':')
+        return false;
+      const std::string number = text.substr(auto_prefix.size() + 1);
+      char *end;
+      min_range = std::strtof(number.c_str(), &end);
+      if (number.empty() || *end != '\0' || !(min_range >= 0) ||
+          min_range > 1)
+        return false;
+    }
+    rule->automatic = true;
+    rule->min_range = min_range;
+    return true;
+  }
+
+  const std::string max_prefix = "max-";
+  const bool from_max = text.compare(0, max_prefix.size(), max_prefix) == 0;
+  const std::string number = from_max ? text.substr(max_prefix.size()) : text;
+  if (number.empty() || !std::all_of(number.begin(), number.end(), ::isdigit))
+    return false;
+  // All digits, so only the range can be wrong.
+  errno = 0;
+  const long value = std::strtol(number.c_str(), nullptr, 10);
+  if (errno == ERANGE || value > INT_MAX)
+    return false;
+  rule->from_max = from_max;
+  rule->value = static_cast<int>(value);
+  rule->automatic = false;
+  return true;
+}
+
+// One image on its way through the pipeline.
+struct BatchPipeline::Job {
+  std::string input;
+  cv::Mat image;
+  std::unique_ptr<MinMaxPyramid> pyramid;
+  cv::Mat output;
+  // Only with Options::contact_sheet_width.
+  cv::Mat contact_sheet;
+};
+
+BatchPipeline::BatchPipeline(const Options &options)
+    : options_(Clamped(options)) {}
+
+BatchPipeline::~BatchPipeline() = default;
+
+BatchPipeline::Result
+BatchPipeline::Run(const std::vector<std::string> &inputs) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    inputs_.reset(new BoundedQueue<std::string>(inputs.size()));
+    decoded_.reset(new BoundedQueue<Job>(options_.queue_depth));
+    preprocessed_.reset(new BoundedQueue<Job>(options_.queue_depth));
+    releveled_.reset(new BoundedQueue<Job>(options_.queue_depth));
+
+    // Enough that PreProcess never has to wait for one: every PreProcess
+    // thread, every job queued for Relevel, and every Relevel thread.
+    const size_t num_pyramids = options_.preprocess_threads +
+                                options_.queue_depth + options_.relevel_threads;
+    pyramids_.reset(
+        new BoundedQueue<std::unique_ptr<MinMaxPyramid>>(num_pyramids));
+    MinMaxPyramid::Options pyramid_options;
+    pyramid_options.collect_stats = options_.pyramid_stats;
+    pyramid_options.engine = options_.engine;
+    for (size_t i = 0; i < num_pyramids; i++) {
+      pyramids_->Push(
+          std::unique_ptr<MinMaxPyramid>(new MinMaxPyramid(pyramid_options)));
+    }
+    // The same for Relevel: every Relevel thread, every job queued for
+    // Encode, and every Encode thread. They start out empty; Relevel sizes
+    // them to each image as it goes.
+    const size_t num_outputs = options_.relevel_threads +
+                               options_.queue_depth + options_.encode_threads;
+    outputs_.reset(new BoundedQueue<cv::Mat>(num_outputs));
+    for (size_t i = 0; i < num_outputs; i++)
+      outputs_->Push(cv::Mat());
+
+    for (Counters &counters : counters_) {
+      counters.items = 0;
+      counters.busy_ns = 0;
+      counters.starved_ns = 0;
+      counters.blocked_ns = 0;
+    }
+    succeeded_ = 0;
+    errors_.clear();
+  }
+  for (const std::string &input : inputs)
+    inputs_->Push(input);
+  inputs_->Close();
+
+  const auto start = Clock::now();
+  std::vector<std::thread> threads;
+  auto launch = [&](int count, auto body) {
+    for (int i = 0; i < count; i++)
+      threads.emplace_back(body);
+  };
+  // Each stage closes its output queue once its last thread is done, which in
+  // turn lets the next stage finish.
+  std::atomic<int> decoding{options_.decode_threads};
+  std::atomic<int> preprocessing{options_.preprocess_threads};
+  std::atomic<int> releveling{options_.relevel_threads};
+  launch(options_.decode_threads, [&] {
+    RunStage(kDecode, inputs_.get(), decoded_.get(),
+             [this](std::string *input, Job *job) {
+               return Decode(input, job);
+             });
+    if (--decoding == 0)
+      decoded_->Close();
+  });
+  launch(options_.preprocess_threads, [&] {
+    RunStage(kPreProcess, decoded_.get(), preprocessed_.get(),
+             [this](Job *job, Job *out) { return PreProcess(job, out); });
+    if (--preprocessing == 0)
+      preprocessed_->Close();
+  });
+  launch(options_.relevel_threads, [&] {
+    RunStage(kRelevel, preprocessed_.get(), releveled_.get(),
+             [this](Job *job, Job *out) { return Relevel(job, out); });
+    if (--releveling == 0)
+      releveled_->Close();
+  });
+  launch(options_.encode_threads, [&] {
+    RunStage(kEncode, releveled_.get(), nullptr,
+             [this](Job *job, Job *out) { return Encode(job, out); });
+  });
+  for (std::thread &thread : threads)
+    thread.join();
+
+  Result result;
+  result.seconds = std::chrono::duration<double>(Clock::now() - start).count();
+  result.succeeded = succeeded_;
+  if (options_.pyramid_stats) {
+    // Every pyramid is back in the pool by now.
+    pyramids_->Close();
+    std::unique_ptr<MinMaxPyramid> pyramid;
+    while (pyramids_->Pop(&pyramid))
+      result.pyramid_stats.Add(pyramid->GetStats());
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  result.errors = errors_;
+  return result;
+}
+
+// Pulls items from `in` until it's closed and empty, runs them through `fn`,
+// and pushes whatever succeeds to `out` (if there is one).
+template <typename In, typename Fn>
+void BatchPipeline::RunStage(Stage stage, BoundedQueue<In> *in,
+                             BoundedQueue<Job> *out, Fn fn) {
+  Counters &counters = counters_[stage];
+  In item;
+  while (true) {
+    const auto waiting = Clock::now();
+    if (!in->Pop(&item))
+      return;
+    const auto working = Clock::now();
+    counters.starved_ns += Nanoseconds(working - waiting);
+
+    Job result;
+    const bool ok = fn(&item, &result);
+    const auto done = Clock::now();
+    counters.busy_ns += Nanoseconds(done - working);
+    counters.items++;
+
+    if (ok && out != nullptr) {
+      out->Push(std::move(result));
+      counters.blocked_ns += Nanoseconds(Clock::now() - done);
+    }
+  }
+}
+
+bool BatchPipeline::Decode(std::string *input, Job *job) {
+  job->input = std::move(*input);
+  // Keep 16-bit and float images as they are, rather than letting OpenCV
+  // squash them to 8 bits; the output is written back at the same depth.
+  job->image = cv::imread(job->input, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+  if (job->image.empty()) {
+    Fail(*job, "couldn't read");
+    return false;
+  }
+  // Signed or double-precision TIFFs, say, which PreProcess would assert on.
+  if (!MinMaxPyramid::SupportsDepth(job->image.depth())) {
+    Fail(*job, "unsupported pixel depth");
+    return false;
+  }
+  return true;
+}
+
+bool BatchPipeline::PreProcess(Job *job, Job *out) {
+  *out = std::move(*job);
+  pyramids_->Pop(&out->pyramid);
+  out->pyramid->PreProcess(out->image);
+  // The pyramid has its own reference; no need for the job to keep one too.
+  out->image.release();
+  return true;
+}
+
+bool BatchPipeline::Relevel(Job *job, Job *out) {
+  *out = std::move(*job);
+  outputs_->Pop(&out->output);
+  const MinMaxPyramid &pyramid = *out->pyramid;
+  pyramid.Relevel(options_.scale.Resolve(pyramid), &out->output);
+  if (options_.contact_sheet_width > 0) {
+    // Thumbnails keep the image's shape; RelevelPreview would otherwise
+    // stretch it to fill whatever size it's asked for.
+    const cv::Size image_size = pyramid.ImageSize();
+    const int width = options_.contact_sheet_width;
+    const cv::Size target(
+        width, std::max(1, static_cast<int>(static_cast<int64_t>(width) *
+                                            image_size.height /
+                                            image_size.width)));
+    std::vector<std::string> labels;
+    for (int scale = pyramid.MinScale(); scale <= pyramid.MaxScale(); scale++)
+      labels.push_back("scale " + std::to_string(scale));
+    out->contact_sheet =
+        ContactSheet(pyramid.RelevelStrip(target), labels,
+                     std::max(1, options_.contact_sheet_columns));
+  }
+  pyramids_->Push(std::move(out->pyramid));
+  return true;
+}
+
+bool BatchPipeline::Encode(Job *job, Job *) {
+  const std::string output_path =
+      options_.output_dir + "/" + BaseName(job->input);
+  const bool written =
+      cv::imwrite(output_path, ConvertForFormat(job->output, output_path));
+  // Done with it either way.
+  outputs_->Push(std::move(job->output));
+  if (!written) {
+    Fail(*job, "couldn't write " + output_path);
+    return false;
+  }
+  if (!job->contact_sheet.empty()) {
+    const std::string sheet_path = AddSuffix(output_path, "_scales");
+    if (!cv::imwrite(sheet_path,
+                     ConvertForFormat(job->contact_sheet, sheet_path))) {
+      Fail(*job, "couldn't write " + sheet_path);
+      return false;
+    }
+  }
+  succeeded_++;
+  return true;
+}
+
+void BatchPipeline::Fail(const Job &job, const std::string &error) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  errors_.push_back(job.input + ": " + error);
+}
+
+std::vector<BatchPipeline::StageStats> BatchPipeline::Stats() const {
+  static const char *const kNames[kNumStages] = {"decode", "preprocess",
+                                                 "relevel", "encode"};
+  const int threads[kNumStages] = {
+      options_.decode_threads, options_.preprocess_threads,
+      options_.relevel_threads, options_.encode_threads};
+
+  std::vector<StageStats> stats(kNumStages);
+  for (int i = 0; i < kNumStages; i++) {
+    StageStats &stage = stats[i];
+    stage.name = kNames[i];
+    stage.threads = threads[i];
+    stage.items = counters_[i].items;
+    stage.busy_seconds = counters_[i].busy_ns * 1e-9;
+    stage.starved_seconds = counters_[i].starved_ns * 1e-9;
+    stage.blocked_seconds = counters_[i].blocked_ns * 1e-9;
+  }
+
+  auto add_queue = [](const auto &queue, StageStats *stage) {
+    if (queue == nullptr)
+      return;
+    stage->queue_depth = queue->size();
+    stage->queue_high_water = queue->high_water();
+  };
+  std::lock_guard<std::mutex> lock(mutex_);
+  add_queue(inputs_, &stats[kDecode]);
+  add_queue(decoded_, &stats[kPreProcess]);
+  add_queue(preprocessed_, &stats[kRelevel]);
+  add_queue(releveled_, &stats[kEncode]);
+  return stats;
+}
@@ -0,0 +1,165 @@
+#ifndef BATCH_PIPELINE_
+#define BATCH_PIPELINE_
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "bounded_queue.h"
+#include "min_max_pyramid.h"
+
+// Which scale to relevel each image at.
+struct ScaleRule {
+  // If set, `value` counts down from the image's MaxScale(), the same way the
+  // editor's slider does; otherwise it's an absolute scale.
+  bool from_max = false;
+  int value = 0;
+  // If set, each image gets the scale MinMaxPyramid::EstimateScale picks for
+  // it, given min_range, and the fields above don't matter.
+  bool automatic = false;
+  float min_range = MinMaxPyramid::kDefaultMinRange;
+
+  // Clamped to what the image supports. Automatic rules need the image's
+  // pyramid, so only the second form works for them.
+  int Resolve(int min_scale, int max_scale) const {
+    CV_Assert(!automatic);
+    const int scale = from_max ? max_scale - value : value;
+    return std::min(std::max(scale, min_scale), max_scale);
+  }
+  int Resolve(const MinMaxPyramid &pyramid) const {
+    if (automatic)
+      return pyramid.EstimateScale(min_range);
+    return Resolve(pyramid.MinScale(), pyramid.MaxScale());
+  }
+
+  // Parses a command-line scale: "N" for an absolute scale, "max-N" for N
+  // steps down from the max, or "auto" or "auto:F" for an automatic one with
+  // the default min_range or a min_range of F.
+  static bool Parse(const std::string &text, ScaleRule *rule);
+};
+
+// Relevels a list of image files into an output directory, as a pipeline of
+// stages connected by bounded queues:
+//
+//   decode -> PreProcess -> Relevel -> encode + write
+//
+// Decoding and encoding take about as long as the pyramid math, so rather than
+// having each thread do one image start to finish (and leave cores idle while
+// they're stuck in a codec), every stage gets its own threads. The queues
+// between stages provide backpressure: if decode gets ahead, it blocks rather
+// than filling memory with decoded images.
+class BatchPipeline {
+public:
+  struct Options {
+    std::string output_dir;
+    ScaleRule scale;
+
+    int decode_threads = 1;
+    int preprocess_threads = 1;
+    int relevel_threads = 1;
+    int encode_threads = 1;
+
+    // Capacity of each queue between stages. Together with the thread counts,
+    // this bounds how many images are in flight at once. Zero counts, here or
+    // for threads, are taken as one.
+    size_t queue_depth = 4;
+
+    // Collect MinMaxPyramid::Stats, totalled over all the pyramids into
+    // Result::pyramid_stats.
+    bool pyramid_stats = false;
+    // Where the local min/max come from; see MinMaxPyramid::Engine.
+    MinMaxPyramid::Engine engine = MinMaxPyramid::Engine::kPyramid;
+
+    // If positive, also write a contact sheet for each image: thumbnails this
+    // many pixels wide at every scale, labelled, from the same pyramid as the
+    // main output. It goes next to the output, as <name>_scales.<ext>.
+    int contact_sheet_width = 0;
+    int contact_sheet_columns = 4;
+  };
+
+  // Counters for one stage, for finding the bottleneck: a stage that's busy
+  // all the time while the others wait on it is the one to give more threads.
+  struct StageStats {
+    std::string name;
+    int threads = 0;
+    // Images this stage has finished with, including failures.
+    size_t items = 0;
+    // Summed over the stage's threads.
+    double busy_seconds = 0;
+    // Time spent waiting for input; i.e. the stage before is too slow.
+    double starved_seconds = 0;
+    // Time spent waiting for room in the next queue; i.e. the stage after is
+    // too slow.
+    double blocked_seconds = 0;
+    // Current and largest-ever depth of the stage's input queue. For decode,
+    // that's the list of files still to go.
+    size_t queue_depth = 0;
+    size_t queue_high_water = 0;
+  };
+
+  struct Result {
+    int succeeded = 0;
+    // One line per image that failed, saying why.
+    std::vector<std::string> errors;
+    double seconds = 0;
+    // Only if Options::pyramid_stats was set.
+    MinMaxPyramid::Stats pyramid_stats;
+  };
+
+  explicit BatchPipeline(const Options &options);
+  ~BatchPipeline();
+
+  // Processes all the inputs, blocking until done. Outputs keep their input's
+  // file name.
+  Result Run(const std::vector<std::string> &inputs);
+
+  // Snapshot of the per-stage counters, in pipeline order. Safe to call from
+  // another thread while Run() is going.
+  std::vector<StageStats> Stats() const;
+
+private:
+  struct Job;
+  struct Counters {
+    std::atomic<size_t> items{0};
+    std::atomic<int64_t> busy_ns{0};
+    std::atomic<int64_t> starved_ns{0};
+    std::atomic<int64_t> blocked_ns{0};
+  };
+  enum Stage { kDecode, kPreProcess, kRelevel, kEncode, kNumStages };
+
+  bool Decode(std::string *input, Job *job);
+  bool PreProcess(Job *job, Job *out);
+  bool Relevel(Job *job, Job *out);
+  bool Encode(Job *job, Job *out);
+  void Fail(const Job &job, const std::string &error);
+
+  template <typename In, typename Fn>
+  void RunStage(Stage stage, BoundedQueue<In> *in, BoundedQueue<Job> *out,
+                Fn fn);
+
+  const Options options_;
+  Counters counters_[kNumStages];
+
+  // Everything below exists only for the duration of Run().
+  mutable std::mutex mutex_;
+  std::unique_ptr<BoundedQueue<std::string>> inputs_;
+  std::unique_ptr<BoundedQueue<Job>> decoded_;
+  std::unique_ptr<BoundedQueue<Job>> preprocessed_;
+  std::unique_ptr<BoundedQueue<Job>> releveled_;
+  // Pyramids are expensive to set up and hold on to a copy of their image, so
+  // there's a fixed set of them that jobs borrow between PreProcess and
+  // Relevel.
+  std::unique_ptr<BoundedQueue<std::unique_ptr<MinMaxPyramid>>> pyramids_;
+  // Likewise for the releveled images, which are as big as the originals and
+  // go back in the pool once Encode has written them, so that Relevel writes
+  // into an old one rather than allocating a new one for every image.
+  std::unique_ptr<BoundedQueue<cv::Mat>> outputs_;
+  std::atomic<int> succeeded_{0};
+  std::vector<std::string> errors_;
+};
+
+#endif // BATCH_PIPELINE_
@@ -0,0 +1,212 @@
+#include "batch_pipeline.h"
+
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+// Somewhere to put files; Bazel gives each test its own.
+std::string TempDir(const std::string &name) {
+  const char *root = getenv("TEST_TMPDIR");
+  const std::string dir = std::string(root ? root : "/tmp") + "/" + name;
+  mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+// Writes `count` noise images of assorted sizes, returning their paths.
+// PPM, so that what we read back is exactly what we wrote.
+std::vector<std::string> WriteInputs(const std::string &dir, int count,
+                                     std::vector<cv::Mat> *images) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < count; i++) {
+    cv::Mat image(40 + 7 * i, 60 + 5 * i, CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+    paths.push_back(dir + "/image" + std::to_string(i) + ".ppm");
+    EXPECT_TRUE(cv::imwrite(paths.back(), image));
+    images->push_back(image);
+  }
+  return paths;
+}
+
+} // namespace
+
+TEST(ScaleRule, CountsDownFromMaxAndClamps) {
+  cv::Mat image(64, 64, CV_8UC3, cv::Scalar::all(100));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(image);
+
+  EXPECT_EQ(pyramid.MaxScale() - 1, (ScaleRule{true, 1}).Resolve(pyramid));
+  EXPECT_EQ(pyramid.MinScale(), (ScaleRule{true, 100}).Resolve(pyramid));
+  EXPECT_EQ(pyramid.MaxScale(), (ScaleRule{false, 100}).Resolve(pyramid));
+}
+
+TEST(ScaleRule, Parses) {
+  ScaleRule rule;
+  ASSERT_TRUE(ScaleRule::Parse("max-3", &rule));
+  EXPECT_TRUE(rule.from_max);
+  EXPECT_EQ(3, rule.value);
+  ASSERT_TRUE(ScaleRule::Parse("7", &rule));
+  EXPECT_FALSE(rule.from_max);
+  EXPECT_EQ(7, rule.value);
+  EXPECT_FALSE(ScaleRule::Parse("max-", &rule));
+  EXPECT_FALSE(ScaleRule::Parse("-2", &rule));
+  // Too big for an int, which is an error rather than a crash.
+  EXPECT_FALSE(ScaleRule::Parse("99999999999", &rule));
+  EXPECT_FALSE(ScaleRule::Parse("max-99999999999", &rule));
+
+  ASSERT_TRUE(ScaleRule::Parse("auto", &rule));
+  EXPECT_TRUE(rule.automatic);
+  EXPECT_EQ(MinMaxPyramid::kDefaultMinRange, rule.min_range);
+  ASSERT_TRUE(ScaleRule::Parse("auto:0.25", &rule));
+  EXPECT_TRUE(rule.automatic);
+  EXPECT_EQ(0.25f, rule.min_range);
+  ASSERT_TRUE(ScaleRule::Parse("3", &rule));
+  EXPECT_FALSE(rule.automatic);
+  EXPECT_FALSE(ScaleRule::Parse("auto:", &rule));
+  EXPECT_FALSE(ScaleRule::Parse("auto:2", &rule));
+  EXPECT_FALSE(ScaleRule::Parse("automatic", &rule));
+}
+
+TEST(ScaleRule, AutomaticAsksThePyramid) {
+  cv::Mat image(100, 140, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::blur(image, image, cv::Size(15, 15));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(image);
+
+  ScaleRule rule;
+  rule.automatic = true;
+  for (float min_range : {0.2f, 0.6f, 0.9f}) {
+    rule.min_range = min_range;
+    EXPECT_EQ(pyramid.EstimateScale(min_range), rule.Resolve(pyramid));
+  }
+}
+
+TEST(BatchPipeline, MatchesSequentialRelevel) {
+  std::vector<cv::Mat> images;
+  const std::vector<std::string> inputs =
+      WriteInputs(TempDir("pipeline_in"), 9, &images);
+
+  BatchPipeline::Options options;
+  options.output_dir = TempDir("pipeline_out");
+  options.scale = ScaleRule{true, 1};
+  options.decode_threads = 2;
+  options.preprocess_threads = 3;
+  options.relevel_threads = 2;
+  options.encode_threads = 2;
+  options.queue_depth = 1;
+  BatchPipeline pipeline(options);
+  const BatchPipeline::Result result = pipeline.Run(inputs);
+  EXPECT_EQ(9, result.succeeded);
+  EXPECT_THAT(result.errors, ::testing::IsEmpty());
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    MinMaxPyramid pyramid;
+    pyramid.PreProcess(images[i]);
+    const cv::Mat expected = pyramid.Relevel(options.scale.Resolve(pyramid));
+    const cv::Mat actual = cv::imread(options.output_dir + "/image" +
+                                      std::to_string(i) + ".ppm");
+    ASSERT_EQ(expected.size(), actual.size());
+    EXPECT_EQ(0, cv::norm(expected, actual, cv::NORM_INF)) << inputs[i];
+  }
+
+  // Every stage saw every image, and the queues never went past their limit.
+  for (const BatchPipeline::StageStats &stage : pipeline.Stats()) {
+    EXPECT_EQ(9u, stage.items) << stage.name;
+    EXPECT_EQ(0u, stage.queue_depth) << stage.name;
+    if (stage.name != "decode") {
+      EXPECT_LE(stage.queue_high_water, 1u) << stage.name;
+    }
+  }
+}
+
+TEST(BatchPipeline, TakesZeroCountsAsOne) {
+  std::vector<cv::Mat> images;
+  const std::vector<std::string> inputs =
+      WriteInputs(TempDir("pipeline_zero_in"), 5, &images);
+
+  BatchPipeline::Options options;
+  options.output_dir = TempDir("pipeline_zero_out");
+  options.decode_threads = 0;
+  options.preprocess_threads = 0;
+  options.relevel_threads = 0;
+  options.encode_threads = 0;
+  options.queue_depth = 0;
+  BatchPipeline pipeline(options);
+  const BatchPipeline::Result result = pipeline.Run(inputs);
+  EXPECT_EQ(5, result.succeeded);
+  EXPECT_THAT(result.errors, ::testing::IsEmpty());
+  for (const BatchPipeline::StageStats &stage : pipeline.Stats()) {
+    EXPECT_EQ(1, stage.threads) << stage.name;
+    EXPECT_EQ(5u, stage.items) << stage.name;
+  }
+}
+
+TEST(BatchPipeline, ReportsUnreadableInputs) {
+  std::vector<cv::Mat> images;
+  std::vector<std::string> inputs =
+      WriteInputs(TempDir("pipeline_missing_in"), 2, &images);
+  inputs.push_back("/nonexistent/image.ppm");
+
+  BatchPipeline::Options options;
+  options.output_dir = TempDir("pipeline_missing_out");
+  BatchPipeline pipeline(options);
+  const BatchPipeline::Result result = pipeline.Run(inputs);
+  EXPECT_EQ(2, result.succeeded);
+  EXPECT_THAT(result.errors,
+              ::testing::ElementsAre(::testing::HasSubstr("/nonexistent/")));
+}
+
+TEST(BatchPipeline, ReportsUnsupportedDepths) {
+  std::vector<cv::Mat> images;
+  const std::string dir = TempDir("pipeline_depth_in");
+  std::vector<std::string> inputs = WriteInputs(dir, 2, &images);
+  // Decodes fine, but isn't a depth PreProcess takes.
+  cv::Mat doubles(30, 40, CV_64FC3);
+  cv::randu(doubles, cv::Scalar::all(0), cv::Scalar::all(1));
+  inputs.push_back(dir + "/doubles.tiff");
+  ASSERT_TRUE(cv::imwrite(inputs.back(), doubles));
+
+  BatchPipeline::Options options;
+  options.output_dir = TempDir("pipeline_depth_out");
+  BatchPipeline pipeline(options);
+  const BatchPipeline::Result result = pipeline.Run(inputs);
+  EXPECT_EQ(2, result.succeeded);
+  EXPECT_THAT(result.errors, ::testing::ElementsAre(::testing::AllOf(
+                                 ::testing::HasSubstr("doubles.tiff"),
+                                 ::testing::HasSubstr("depth"))));
+}
+
+TEST(BatchPipeline, WritesContactSheets) {
+  std::vector<cv::Mat> images;
+  const std::vector<std::string> inputs =
+      WriteInputs(TempDir("pipeline_sheet_in"), 2, &images);
+
+  BatchPipeline::Options options;
+  options.output_dir = TempDir("pipeline_sheet_out");
+  options.scale = ScaleRule{true, 0};
+  options.contact_sheet_width = 20;
+  options.contact_sheet_columns = 2;
+  BatchPipeline pipeline(options);
+  EXPECT_EQ(2, pipeline.Run(inputs).succeeded);
+
+  for (size_t i = 0; i < inputs.size(); i++) {
+    MinMaxPyramid pyramid;
+    pyramid.PreProcess(images[i]);
+    const int scales = pyramid.MaxScale() - pyramid.MinScale() + 1;
+    // Thumbnails keep the image's aspect ratio, with 4 pixel gaps.
+    const int height = 20 * images[i].rows / images[i].cols;
+    const cv::Mat sheet = cv::imread(options.output_dir + "/image" +
+                                     std::to_string(i) + "_scales.ppm");
+    ASSERT_FALSE(sheet.empty()) << inputs[i];
+    EXPECT_EQ(cv::Size(4 + 2 * 24, 4 + (scales + 1) / 2 * (height + 4)),
+              sheet.size());
+  }
+}
@@ -0,0 +1,102 @@
+#ifndef BOUNDED_QUEUE_
+#define BOUNDED_QUEUE_
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// A blocking FIFO with a fixed capacity, for handing work from one set of
+// threads to another. Producers block while it's full, which is what stops a
+// fast stage from running arbitrarily far ahead of a slow one (and holding on
+// to all the memory that implies).
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity)
+      : capacity_(std::max<size_t>(capacity, 1)) {}
+
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // Blocks until there's room. Returns false, dropping the item, if the queue
+  // has been closed.
+  bool Push(T item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_.wait(lock,
+                     [this] { return closed_ || items_.size() < capacity_; });
+      if (closed_)
+        return false;
+      items_.push_back(std::move(item));
+      high_water_ = std::max(high_water_, items_.size());
+    }
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Like Push, but returns false straight away, dropping the item, if there's
+  // no room, for producers that mustn't block.
+  bool TryPush(T item) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (closed_ || items_.size() >= capacity_)
+        return false;
+      items_.push_back(std::move(item));
+      high_water_ = std::max(high_water_, items_.size());
+    }
+    not_empty_.notify_one();
+    return true;
+  }
+
+  // Blocks until there's an item to take. Returns false once the queue is
+  // closed and everything in it has been taken.
+  bool Pop(T *item) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+      if (items_.empty())
+        return false;
+      *item = std::move(items_.front());
+      items_.pop_front();
+    }
+    not_full_.notify_one();
+    return true;
+  }
+
+  // Signals that nothing more will be pushed. Consumers drain what's left;
+  // blocked producers give up.
+  void Close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      closed_ = true;
+    }
+    not_full_.notify_all();
+    not_empty_.notify_all();
+  }
+
+  size_t capacity() const { return capacity_; }
+
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return items_.size();
+  }
+
+  // The most items that have ever been in the queue at once.
+  size_t high_water() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return high_water_;
+  }
+
+private:
+  const size_t capacity_;
+  mutable std::mutex mutex_;
+  std::condition_variable not_full_;
+  std::condition_variable not_empty_;
+  std::deque<T> items_;
+  size_t high_water_ = 0;
+  bool closed_ = false;
+};
+
+#endif // BOUNDED_QUEUE_
@@ -0,0 +1,79 @@
+#include "bounded_queue.h"
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+TEST(BoundedQueue, IsFifo) {
+  BoundedQueue<int> queue(3);
+  for (int i = 0; i < 3; i++)
+    ASSERT_TRUE(queue.Push(i));
+  queue.Close();
+
+  std::vector<int> popped;
+  int value;
+  while (queue.Pop(&value))
+    popped.push_back(value);
+  EXPECT_THAT(popped, ::testing::ElementsAre(0, 1, 2));
+  EXPECT_EQ(3u, queue.high_water());
+}
+
+TEST(BoundedQueue, PushBlocksWhileFull) {
+  BoundedQueue<int> queue(1);
+  ASSERT_TRUE(queue.Push(1));
+  std::atomic<bool> pushed{false};
+  std::thread producer([&] {
+    queue.Push(2);
+    pushed = true;
+  });
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  EXPECT_FALSE(pushed);
+  int value;
+  ASSERT_TRUE(queue.Pop(&value));
+  EXPECT_EQ(1, value);
+  producer.join();
+  EXPECT_TRUE(pushed);
+  EXPECT_EQ(1u, queue.high_water());
+}
+
+TEST(BoundedQueue, TryPushGivesUpWhenFull) {
+  BoundedQueue<int> queue(1);
+  EXPECT_TRUE(queue.TryPush(1));
+  EXPECT_FALSE(queue.TryPush(2));
+  int value;
+  ASSERT_TRUE(queue.Pop(&value));
+  EXPECT_EQ(1, value);
+  EXPECT_TRUE(queue.TryPush(3));
+  queue.Close();
+  EXPECT_FALSE(queue.TryPush(4));
+}
+
+TEST(BoundedQueue, CloseWakesEveryone) {
+  BoundedQueue<int> full(1);
+  ASSERT_TRUE(full.Push(1));
+  BoundedQueue<int> empty(1);
+
+  bool push_result = true;
+  bool pop_result = true;
+  std::thread producer([&] { push_result = full.Push(2); });
+  std::thread consumer([&] {
+    int value;
+    pop_result = empty.Pop(&value);
+  });
+  full.Close();
+  empty.Close();
+  producer.join();
+  consumer.join();
+  EXPECT_FALSE(push_result);
+  EXPECT_FALSE(pop_result);
+
+  // What was already in there can still be drained.
+  int value;
+  EXPECT_TRUE(full.Pop(&value));
+  EXPECT_FALSE(full.Pop(&value));
+}
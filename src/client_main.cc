@@ -0,0 +1,85 @@
+#include <unistd.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "pyramid_server.h"
+
+// Sends relevel requests to a running `server`, for use from scripts.
+
+namespace {
+
+const char kUsage[] =
+    "Usage: client [--socket=PATH] <input> <scale> <output> "
+    "[<scale> <output> ...]\n"
+    "       client [--socket=PATH] < requests\n"
+    "\n"
+    "Asks the server to relevel <input> at each <scale> (N, max-N, auto or\n"
+    "auto:F, as for `batch --scale`) into the <output> after it. Without\n"
+    "arguments, sends each line of stdin as a request instead: the same\n"
+    "fields, separated by tabs, with absolute paths. Prints the server's\n"
+    "reply to each request, and fails if any of them did.\n"
+    "\n"
+    "  --socket=PATH  Where the server listens (default: as for `server`).\n";
+
+// The server has a working directory of its own, so paths have to be
+// absolute by the time they get there.
+std::string AbsolutePath(const std::string &path) {
+  if (!path.empty() && path[0] == '/')
+    return path;
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)) == nullptr)
+    return path;
+  return std::string(cwd) + "/" + path;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  std::string socket_path = DefaultServerSocketPath();
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    const std::string socket_prefix = "--socket=";
+    if (arg.compare(0, socket_prefix.size(), socket_prefix) == 0) {
+      socket_path = arg.substr(socket_prefix.size());
+    } else if (arg.compare(0, 2, "--") == 0) {
+      std::cerr << "Bad flag: " << arg << "\n\n" << kUsage;
+      return 1;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+
+  std::vector<std::string> requests;
+  if (positional.empty()) {
+    std::string line;
+    while (std::getline(std::cin, line)) {
+      if (!line.empty())
+        requests.push_back(line);
+    }
+  } else {
+    if (positional.size() < 3 || positional.size() % 2 != 1) {
+      std::cerr << kUsage;
+      return 1;
+    }
+    std::string request = AbsolutePath(positional[0]);
+    for (size_t i = 1; i < positional.size(); i += 2)
+      request += "\t" + positional[i] + "\t" + AbsolutePath(positional[i + 1]);
+    requests.push_back(request);
+  }
+
+  std::vector<std::string> replies;
+  std::string error;
+  const bool sent =
+      SendServerRequests(socket_path, requests, &replies, &error);
+  bool all_ok = sent;
+  for (const std::string &reply : replies) {
+    std::cout << reply << "\n";
+    all_ok = all_ok && reply.compare(0, 3, "ok ") == 0;
+  }
+  if (!sent)
+    std::cerr << error << "\n";
+  return all_ok ? 0 : 1;
+}
@@ -0,0 +1,64 @@
+#include "coalescing_worker.h"
+
+#include <algorithm>
+#include <utility>
+
+CoalescingWorker::CoalescingWorker() : thread_([this] { Run(); }) {}
+
+CoalescingWorker::~CoalescingWorker() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    shutting_down_ = true;
+    pending_.clear();
+  }
+  work_available_.notify_all();
+  thread_.join();
+}
+
+void CoalescingWorker::Submit(const std::string &key, Job job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    const uint64_t generation = ++latest_[key];
+    pending_.erase(std::remove_if(pending_.begin(), pending_.end(),
+                                  [&key](const Pending &pending) {
+                                    return pending.key == key;
+                                  }),
+                   pending_.end());
+    pending_.push_back(Pending{key, generation, std::move(job)});
+  }
+  work_available_.notify_one();
+}
+
+void CoalescingWorker::WaitForIdle() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  idle_.wait(lock, [this] { return pending_.empty() && !running_job_; });
+}
+
+bool CoalescingWorker::IsLatest(const std::string &key, uint64_t generation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return latest_[key] == generation;
+}
+
+void CoalescingWorker::Run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    work_available_.wait(
+        lock, [this] { return shutting_down_ || !pending_.empty(); });
+    if (shutting_down_)
+      return;
+
+    Pending next = std::move(pending_.front());
+    pending_.pop_front();
+    running_job_ = true;
+    lock.unlock();
+
+    const std::string key = next.key;
+    const uint64_t generation = next.generation;
+    next.job([this, key, generation] { return !IsLatest(key, generation); });
+
+    lock.lock();
+    running_job_ = false;
+    if (pending_.empty())
+      idle_.notify_all();
+  }
+}
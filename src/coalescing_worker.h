@@ -0,0 +1,63 @@
+#ifndef COALESCING_WORKER_
+#define COALESCING_WORKER_
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Runs jobs one at a time on a background thread, with "latest value wins"
+// semantics: jobs are submitted under a key, and submitting a new job drops any
+// job with the same key that hasn't started yet. Jobs otherwise run in the
+// order they were submitted.
+//
+// This is what the UI wants for anything driven by a slider: while one render
+// is running, any number of intermediate slider positions collapse into just
+// the most recent one.
+class CoalescingWorker {
+public:
+  // Returns true once a newer job has been submitted under the same key. Long
+  // jobs can poll this to give up early, and anything that posts results back
+  // should check it right before doing so.
+  using IsStale = std::function<bool()>;
+  using Job = std::function<void(const IsStale &is_stale)>;
+
+  CoalescingWorker();
+  // Drops any pending jobs and waits for the running one (if any) to finish.
+  ~CoalescingWorker();
+
+  CoalescingWorker(const CoalescingWorker &) = delete;
+  CoalescingWorker &operator=(const CoalescingWorker &) = delete;
+
+  void Submit(const std::string &key, Job job);
+
+  // Blocks until there's nothing pending or running. Mostly for tests.
+  void WaitForIdle();
+
+private:
+  struct Pending {
+    std::string key;
+    uint64_t generation;
+    Job job;
+  };
+
+  void Run();
+  bool IsLatest(const std::string &key, uint64_t generation);
+
+  std::mutex mutex_;
+  std::condition_variable work_available_;
+  std::condition_variable idle_;
+  std::deque<Pending> pending_;
+  // Generation of the most recently submitted job for each key.
+  std::map<std::string, uint64_t> latest_;
+  bool running_job_ = false;
+  bool shutting_down_ = false;
+
+  // Last, so that everything above exists for the thread's whole lifetime.
+  std::thread thread_;
+};
+#endif // COALESCING_WORKER_
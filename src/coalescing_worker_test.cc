@@ -0,0 +1,98 @@
+#include "coalescing_worker.h"
+
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+TEST(CoalescingWorker, RunsJobsInOrder) {
+  CoalescingWorker worker;
+  std::vector<int> ran;
+  for (int i = 0; i < 3; i++) {
+    worker.Submit("job" + std::to_string(i),
+                  [&ran, i](const CoalescingWorker::IsStale &) {
+                    ran.push_back(i);
+                  });
+  }
+  worker.WaitForIdle();
+  EXPECT_THAT(ran, ::testing::ElementsAre(0, 1, 2));
+}
+
+TEST(CoalescingWorker, LatestPendingJobWins) {
+  CoalescingWorker worker;
+
+  // Park the worker thread so that everything else queues up behind it.
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  worker.Submit("blocker", [released](const CoalescingWorker::IsStale &) {
+    released.wait();
+  });
+
+  std::vector<int> ran;
+  for (int i = 0; i < 5; i++) {
+    worker.Submit("render", [&ran, i](const CoalescingWorker::IsStale &) {
+      ran.push_back(i);
+    });
+  }
+  worker.Submit("load", [&ran](const CoalescingWorker::IsStale &) {
+    ran.push_back(100);
+  });
+  release.set_value();
+  worker.WaitForIdle();
+
+  EXPECT_THAT(ran, ::testing::ElementsAre(4, 100));
+}
+
+TEST(CoalescingWorker, RunningJobSeesItIsStale) {
+  CoalescingWorker worker;
+  std::promise<void> started;
+  std::promise<void> superseded;
+  std::shared_future<void> superseded_future = superseded.get_future().share();
+  std::atomic<bool> was_stale_before{true};
+  std::atomic<bool> was_stale_after{false};
+
+  worker.Submit("render", [&, superseded_future](
+                              const CoalescingWorker::IsStale &is_stale) {
+    was_stale_before = is_stale();
+    started.set_value();
+    superseded_future.wait();
+    was_stale_after = is_stale();
+  });
+  started.get_future().wait();
+  worker.Submit("render", [](const CoalescingWorker::IsStale &) {});
+  superseded.set_value();
+  worker.WaitForIdle();
+
+  EXPECT_FALSE(was_stale_before);
+  EXPECT_TRUE(was_stale_after);
+}
+
+TEST(CoalescingWorker, DestructorDropsPendingJobs) {
+  std::atomic<int> ran{0};
+  std::promise<void> started;
+  std::promise<void> release;
+  std::shared_future<void> released = release.get_future().share();
+  std::thread releaser;
+  {
+    CoalescingWorker worker;
+    worker.Submit("blocker", [&, released](const CoalescingWorker::IsStale &) {
+      started.set_value();
+      released.wait();
+    });
+    started.get_future().wait();
+    worker.Submit("other",
+                  [&ran](const CoalescingWorker::IsStale &) { ran++; });
+
+    // Only let the blocker finish once the destructor has had a chance to
+    // clear the queue.
+    releaser = std::thread([&release] {
+      std::this_thread::sleep_for(std::chrono::milliseconds(20));
+      release.set_value();
+    });
+  }
+  releaser.join();
+  EXPECT_EQ(0, ran);
+}
@@ -0,0 +1,47 @@
+#include "contact_sheet.h"
+
+#include <algorithm>
+
+cv::Mat ContactSheet(const std::vector<cv::Mat> &tiles,
+                     const std::vector<std::string> &labels, int columns,
+                     int gap) {
+  if (tiles.empty())
+    return cv::Mat();
+  CV_Assert(columns > 0 && gap >= 0);
+  cv::Size cell(0, 0);
+  for (const cv::Mat &tile : tiles) {
+    CV_Assert(tile.type() == tiles[0].type());
+    cell.width = std::max(cell.width, tile.cols);
+    cell.height = std::max(cell.height, tile.rows);
+  }
+  const int count = static_cast<int>(tiles.size());
+  columns = std::min(columns, count);
+  const int rows = (count + columns - 1) / columns;
+  cv::Mat sheet(gap + rows * (cell.height + gap),
+                gap + columns * (cell.width + gap), tiles[0].type(),
+                cv::Scalar::all(0));
+
+  // White on a black outline, so labels show up on any background, at a size
+  // that suits the cell rather than the (possibly huge) sheet.
+  const int depth = sheet.depth();
+  const double top =
+      depth == CV_16U ? 65535 : depth == CV_32F || depth == CV_64F ? 1 : 255;
+  const double font_scale = std::max(0.4, cell.height / 240.0);
+  const int thickness = std::max(1, static_cast<int>(font_scale + 0.5));
+  const int margin = std::max(2, cell.height / 40);
+
+  for (int i = 0; i < count; i++) {
+    const cv::Point corner(gap + (i % columns) * (cell.width + gap),
+                           gap + (i / columns) * (cell.height + gap));
+    tiles[i].copyTo(sheet(cv::Rect(corner, tiles[i].size())));
+    if (i >= static_cast<int>(labels.size()) || labels[i].empty())
+      continue;
+    const cv::Point origin(corner.x + margin,
+                           corner.y + tiles[i].rows - margin);
+    cv::putText(sheet, labels[i], origin, cv::FONT_HERSHEY_SIMPLEX,
+                font_scale, cv::Scalar::all(0), thickness + 2, cv::LINE_AA);
+    cv::putText(sheet, labels[i], origin, cv::FONT_HERSHEY_SIMPLEX,
+                font_scale, cv::Scalar::all(top), thickness, cv::LINE_AA);
+  }
+  return sheet;
+}
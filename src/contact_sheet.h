@@ -0,0 +1,20 @@
+#ifndef CONTACT_SHEET_
+#define CONTACT_SHEET_
+
+#include <string>
+#include <vector>
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// Lays `tiles` out in a grid, `columns` across, left to right and then top to
+// bottom, with `gap` pixels of black around each. Each tile gets its entry in
+// `labels` (if any) written in its bottom left corner. Cells are the size of
+// the biggest tile, and smaller ones sit in their top left corner.
+//
+// Tiles must all be the same type, which the sheet is too. This is meant for
+// the thumbnails from MinMaxPyramid::RelevelStrip, labelled with their scales.
+cv::Mat ContactSheet(const std::vector<cv::Mat> &tiles,
+                     const std::vector<std::string> &labels, int columns,
+                     int gap = 4);
+
+#endif // CONTACT_SHEET_
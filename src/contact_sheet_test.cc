@@ -0,0 +1,39 @@
+#include "contact_sheet.h"
+
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+TEST(ContactSheet, LaysTilesOutInRows) {
+  std::vector<cv::Mat> tiles;
+  for (int i = 0; i < 5; i++)
+    tiles.push_back(cv::Mat(20, 30, CV_8UC3, cv::Scalar::all(10 * (i + 1))));
+  // The last one's smaller, as a preview of an odd-sized image can be.
+  tiles[4] = cv::Mat(19, 30, CV_8UC3, cv::Scalar::all(50));
+
+  const cv::Mat sheet = ContactSheet(tiles, {}, 2, 3);
+  ASSERT_EQ(CV_8UC3, sheet.type());
+  // Two across and three down, with gaps around and between.
+  EXPECT_EQ(cv::Size(3 + 2 * 33, 3 + 3 * 23), sheet.size());
+  for (int i = 0; i < 5; i++) {
+    SCOPED_TRACE(testing::Message() << "tile " << i);
+    const cv::Rect where(3 + (i % 2) * 33, 3 + (i / 2) * 23, 30,
+                         tiles[i].rows);
+    EXPECT_EQ(0, cv::norm(sheet(where), tiles[i], cv::NORM_INF));
+  }
+  // Gaps, the empty cell and the short tile's leftover row are all black.
+  EXPECT_EQ(cv::Vec3b(0, 0, 0), sheet.at<cv::Vec3b>(0, 0));
+  EXPECT_EQ(cv::Vec3b(0, 0, 0), sheet.at<cv::Vec3b>(3 + 2 * 23 + 19, 3));
+  EXPECT_EQ(cv::Vec3b(0, 0, 0), sheet.at<cv::Vec3b>(3 + 2 * 23, 3 + 33));
+}
+
+TEST(ContactSheet, FewerTilesThanColumnsMakeOneRow) {
+  const std::vector<cv::Mat> tiles(3, cv::Mat(10, 10, CV_16UC1,
+                                              cv::Scalar::all(1000)));
+  const cv::Mat sheet = ContactSheet(tiles, {"0", "1", "2"}, 8, 0);
+  EXPECT_EQ(CV_16UC1, sheet.type());
+  EXPECT_EQ(cv::Size(30, 10), sheet.size());
+  EXPECT_TRUE(ContactSheet({}, {}, 4).empty());
+}
@@ -1,45 +1,72 @@
 #include "editor.h"
 
+#include <QtCore/QCoreApplication>
+#include <QtCore/QDir>
+#include <QtCore/QFileInfo>
+#include <QtCore/QSignalBlocker>
 #include <QtCore/QStandardPaths>
 #include <QtGui/QGuiApplication>
 #include <QtGui/QImageReader>
+#include <QtGui/QIcon>
 #include <QtGui/QImageWriter>
+#include <QtGui/QPixmap>
 #include <QtGui/QScreen>
 #include <QtWidgets/QFileDialog>
 #include <QtWidgets/QHBoxLayout>
 #include <QtWidgets/QMenu>
 #include <QtWidgets/QMenuBar>
 #include <QtWidgets/QMessageBox>
+#include <QtWidgets/QScrollBar>
 #include <QtWidgets/QSlider>
 #include <QtWidgets/QStatusBar>
 #include <QtWidgets/QVBoxLayout>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <thread>
 
 #include "opencv4/opencv2/opencv.hpp"
+#include "coalescing_worker.h"
+#include "image_view.h"
 #include "min_max_pyramid.h"
+#include "output_format.h"
+#include "parallel_for.h"
+#include "pyramid_cache.h"
+#include "shared_image.h"
 
 Editor::Editor(MinMaxPyramid *pyramid, QWidget *parent)
-    : QMainWindow(parent), pyramid_(pyramid), image_label_(new QLabel),
-      scroll_area_(new QScrollArea) {
+    : QMainWindow(parent), pyramid_(pyramid), image_view_(new ImageView),
+      scroll_area_(new QScrollArea), worker_(new CoalescingWorker),
+      refine_worker_(new CoalescingWorker),
+      cache_worker_(new CoalescingWorker) {
+  MinMaxPyramid::Options draft_options;
+  draft_options.threads = std::max(1u, std::thread::hardware_concurrency());
+  draft_pyramid_.reset(new MinMaxPyramid(draft_options));
   setWindowTitle("UnderSee");
 
-  image_label_->setBackgroundRole(QPalette::Base);
-  image_label_->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
-  image_label_->setScaledContents(true);
+  image_view_->setBackgroundRole(QPalette::Base);
+  image_view_->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
 
   scroll_area_->setBackgroundRole(QPalette::Dark);
-  // Causes the scroll area to take up the full window, rather than displaying
-  // scroll bars. TODO: toggle this later?
+  // Fits the image to the window until the user zooms in; see setZoom.
   scroll_area_->setWidgetResizable(true);
-  // Hide the scroll area until an image is loaded (mostly hides the
-  // non-functional scroll bar)
-  scroll_area_->setVisible(false);
-  setCentralWidget(scroll_area_);
+  scroll_area_->setWidget(image_view_);
 
   createActions();
+  // Hide everything until an image is loaded.
+  centralWidget()->setVisible(false);
 
   resize(QGuiApplication::primaryScreen()->availableSize() * 3 / 5);
 }
 
+Editor::~Editor() {
+  // Stop the workers explicitly, rather than relying on member order: jobs
+  // can still be using pyramid_ and posting back to us. Decoding goes first,
+  // since it hands its results on to worker_.
+  refine_worker_.reset();
+  worker_.reset();
+}
+
 // Stolen boilerplate from QT tutorial
 static void initializeImageFileDialog(QFileDialog &dialog,
                                       QFileDialog::AcceptMode acceptMode) {
@@ -76,56 +103,561 @@ void Editor::save() {
   QFileDialog dialog(this, tr("Save File As"));
   initializeImageFileDialog(dialog, QFileDialog::AcceptSave);
 
-  while (dialog.exec() == QDialog::Accepted &&
-         !saveFile(dialog.selectedFiles().constFirst())) {
-  }
+  if (dialog.exec() == QDialog::Accepted)
+    saveFile(dialog.selectedFiles().constFirst());
 }
 
-bool Editor::loadFile(const QString &fileName) {
-  cv::Mat image = cv::imread(fileName.toStdString());
-  // Note: Qt 5.14 has Format_BGR888 which would let us skip this conversion
-  if (image.empty()) {
+bool Editor::loadFile(const QString &fileName, cv::Mat decoded) {
+  if (!QFileInfo(fileName).isReadable()) {
     QMessageBox::information(
         this, QGuiApplication::applicationDisplayName(),
         tr("Cannot load %1").arg(QDir::toNativeSeparators(fileName)));
     return false;
   }
 
+  statusBar()->showMessage(
+      tr("Loading \"%1\"...").arg(QDir::toNativeSeparators(fileName)));
+  // The pyramid is about to change underneath any render still in flight, so
+  // make sure its result gets dropped, and don't start any new ones.
+  render_generation_++;
+  render_epoch_++;
+  render_cache_.Clear();
+  locality_slider_->setEnabled(false);
+  zoom_in_action_->setEnabled(false);
+  zoom_out_action_->setEnabled(false);
+  zoom_fit_action_->setEnabled(false);
+
+  const int generation = ++load_generation_;
+  const cv::Size preview_size = previewSize();
+  const int thumbnail_width =
+      static_cast<int>(std::lround(kThumbnailWidth * devicePixelRatioF()));
+  const std::string cache_path = pyramidCachePath(fileName);
+  // Whatever the previous file's full-resolution decode was up to, it's no
+  // longer wanted.
+  refine_worker_->Submit("decode", [](const CoalescingWorker::IsStale &) {});
+  worker_->Submit("load", [this, generation, fileName, decoded, preview_size,
+                           thumbnail_width, cache_path](
+                              const CoalescingWorker::IsStale &is_stale) {
+    const std::string source = fileName.toStdString();
+    loaded_generation_ = generation;
+    drafting_ = false;
+    // Images we've opened before can skip straight to having a pyramid.
+    PyramidCacheKey key;
+    const bool cacheable =
+        !cache_path.empty() && PyramidCacheKey::ForFile(source, &key);
+    const bool cache_hit = cacheable && pyramid_->LoadCache(cache_path, key);
+    // A draft is no use if the full image is already here.
+    if (!cache_hit && decoded.empty() && !is_stale() &&
+        loadDraft(generation, fileName, preview_size)) {
+      // The user can already work with the draft; the real thing gets
+      // decoded and pre-processed on refine_worker_'s thread, so that
+      // renders of the draft don't have to wait for it, and then swapped in
+      // by refineFile.
+      const std::string refine_cache_path = cacheable ? cache_path : "";
+      auto decode = [this, generation, source, thumbnail_width,
+                     refine_cache_path,
+                     key](const CoalescingWorker::IsStale &is_stale) {
+        const cv::Mat image =
+            cv::imread(source, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+        if (is_stale())
+          return;
+        // The pyramid and the strip are built here too, so that worker_
+        // only has to swap them in. An empty image means the decode failed;
+        // other depths are treated the same, since PreProcess would assert
+        // on them.
+        PyramidData data;
+        std::vector<cv::Mat> strip;
+        if (!image.empty() && MinMaxPyramid::SupportsDepth(image.depth())) {
+          MinMaxPyramid::Options options;
+          options.threads = std::max(1u, std::thread::hardware_concurrency());
+          MinMaxPyramid refined(options);
+          refined.PreProcess(image);
+          if (is_stale())
+            return;
+          strip = relevelStrip(refined, thumbnail_width);
+          refined.CacheData(&data);
+        }
+        worker_->Submit("refine", [this, generation, data, strip,
+                                   refine_cache_path,
+                                   key](const CoalescingWorker::IsStale &) {
+          refineFile(generation, data, strip, refine_cache_path, key);
+        });
+      };
+      refine_worker_->Submit("decode", decode);
+      return;
+    }
+    if (!cache_hit) {
+      // 16-bit and float images keep their depth; only what's shown on
+      // screen gets squashed to 8 bits.
+      cv::Mat image =
+          decoded.empty()
+              ? cv::imread(source, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR)
+              : decoded;
+      // Other depths (signed or double-precision TIFFs, say) would only make
+      // PreProcess assert.
+      if (image.empty() || !MinMaxPyramid::SupportsDepth(image.depth())) {
+        QMetaObject::invokeMethod(
+            this,
+            [this, generation, fileName] { loadFailed(generation, fileName); },
+            Qt::QueuedConnection);
+        return;
+      }
+      // Don't bother pre-processing a file the user has already moved on
+      // from.
+      if (is_stale())
+        return;
+
+      // Kept in OpenCV's BGR order all the way through; SharedImage shows it
+      // as is.
+      pyramid_->PreProcess(image);
+    }
+    const int min_scale = pyramid_->MinScale();
+    const int max_scale = pyramid_->MaxScale();
+    const cv::Size image_size = pyramid_->ImageSize();
+    // Out of range, so this is just the original image, at display size.
+    const cv::Mat preview =
+        pyramid_->RelevelPreview(min_scale - 1, preview_size);
+    QMetaObject::invokeMethod(
+        this,
+        [this, generation, fileName, preview, image_size, min_scale,
+         max_scale] {
+          loadFinished(generation, fileName, preview, image_size, min_scale,
+                       max_scale, /*full_resolution=*/true);
+        },
+        Qt::QueuedConnection);
+
+    // Next the scale strip, which shares one small copy of the image and is
+    // rendered on all cores, so it shows up right behind the image.
+    if (!is_stale())
+      renderStrip(generation, thumbnail_width);
+
+    // Only once the image is up, so that writing the cache doesn't slow down
+    // the first open.
+    if (cacheable && !cache_hit && !is_stale())
+      saveCache(cache_path, key);
+    reportStats();
+  });
+  return true;
+}
+
+int Editor::draftShift(const QString &fileName, cv::Size preview_size) {
+  // Only JPEG can be decoded at a fraction of the size for a fraction of the
+  // time (straight from the DCT coefficients); anything else would be
+  // decoded in full and then shrunk, which is no help. Reading the header is
+  // cheap.
+  QImageReader reader(fileName);
+  const QSize size = reader.size();
+  if (reader.format() != "jpeg" || !size.isValid())
+    return 0;
+  // As small as possible, but no smaller than the window, and only if it
+  // saves a lot: 1/8 or 1/4 size. Compared by area, since the image may yet
+  // be rotated according to its EXIF orientation.
+  const int64_t pixels = static_cast<int64_t>(size.width()) * size.height();
+  for (int shift = 3; shift >= 2; shift--) {
+    if ((pixels >> (2 * shift)) >= preview_size.area())
+      return shift;
+  }
+  return 0;
+}
+
+bool Editor::loadDraft(int generation, const QString &fileName,
+                       cv::Size preview_size) {
+  const int shift = draftShift(fileName, preview_size);
+  if (shift == 0)
+    return false;
+  const cv::Mat draft = cv::imread(
+      fileName.toStdString(),
+      shift == 3 ? cv::IMREAD_REDUCED_COLOR_8 : cv::IMREAD_REDUCED_COLOR_4);
+  if (draft.empty())
+    return false;
+  draft_pyramid_->PreProcess(draft);
+  drafting_ = true;
+  draft_shift_ = shift;
+  // Near enough; refineFile corrects it if need be.
+  const cv::Size image_size(draft.cols << shift, draft.rows << shift);
+  MinMaxPyramid::ScaleRange(image_size, &full_min_scale_, &full_max_scale_);
+  const int min_scale = full_min_scale_;
+  const int max_scale = full_max_scale_;
+  const cv::Mat preview =
+      draft_pyramid_->RelevelPreview(min_scale - 1, preview_size);
+  QMetaObject::invokeMethod(
+      this,
+      [this, generation, fileName, preview, image_size, min_scale,
+       max_scale] {
+        loadFinished(generation, fileName, preview, image_size, min_scale,
+                     max_scale, /*full_resolution=*/false);
+      },
+      Qt::QueuedConnection);
+  return true;
+}
+
+void Editor::refineFile(int generation, const PyramidData &data,
+                        const std::vector<cv::Mat> &strip,
+                        const std::string &cache_path,
+                        const PyramidCacheKey &key) {
+  // Another file was opened while this one was decoding.
+  if (generation != loaded_generation_)
+    return;
+  if (data.image.empty()) {
+    // The draft is all there is, and it's not good enough to save.
+    QMetaObject::invokeMethod(
+        this, [this, generation] { refineFailed(generation); },
+        Qt::QueuedConnection);
+    return;
+  }
+  pyramid_->Adopt(data);
+  drafting_ = false;
+  const int min_scale = pyramid_->MinScale();
+  const int max_scale = pyramid_->MaxScale();
+  const cv::Size image_size = pyramid_->ImageSize();
+  QMetaObject::invokeMethod(
+      this,
+      [this, generation, image_size, min_scale, max_scale] {
+        refineFinished(generation, image_size, min_scale, max_scale);
+      },
+      Qt::QueuedConnection);
+  // The strip waited for this, rather than being rendered twice. Posted
+  // after refineFinished, which sets the scale range it's labelled with.
+  QMetaObject::invokeMethod(
+      this, [this, generation, strip] { stripFinished(generation, strip); },
+      Qt::QueuedConnection);
+  if (!cache_path.empty())
+    saveCache(cache_path, key);
+  reportStats();
+}
+
+const MinMaxPyramid &Editor::renderSource(float *scale) const {
+  if (!drafting_)
+    return *pyramid_;
+  // Each pyramid scale of the draft covers 2^draft_shift_ times as much of
+  // the image as the same scale of the full image would. The finest scales
+  // have no equivalent in the draft, so they get its finest instead.
+  if (*scale < full_min_scale_ || *scale > full_max_scale_) {
+    // Out of range either way, so still the original image.
+    *scale = -1;
+  } else {
+    *scale = std::min<float>(
+        std::max<float>(*scale - draft_shift_, draft_pyramid_->MinScale()),
+        draft_pyramid_->MaxScale());
+  }
+  return *draft_pyramid_;
+}
+
+std::string Editor::pyramidCachePath(const QString &fileName) {
+  const QString dir =
+      QStandardPaths::writableLocation(QStandardPaths::CacheLocation) +
+      "/pyramids";
+  if (!QDir().mkpath(dir))
+    return "";
+  return PyramidCachePath(dir.toStdString(), fileName.toStdString());
+}
+
+void Editor::saveCache(const std::string &cache_path,
+                       const PyramidCacheKey &key) {
+  PyramidData data;
+  if (!pyramid_->CacheData(&data))
+    return;
+  const std::string cache_dir =
+      cache_path.substr(0, cache_path.find_last_of('/'));
+  // Keyed by file, so that opening another image before this one is written
+  // doesn't drop it.
+  cache_worker_->Submit(
+      cache_path, [cache_path, cache_dir, key,
+                   data](const CoalescingWorker::IsStale &) {
+        if (WritePyramidCache(cache_path, key, data))
+          TrimPyramidCache(cache_dir, kPyramidCacheBytes);
+      });
+}
+
+void Editor::loadFinished(int generation, const QString &fileName,
+                          cv::Mat image, cv::Size image_size, int min_scale,
+                          int max_scale, bool full_resolution) {
+  if (generation != load_generation_)
+    return;
+
   setWindowTitle("UnderSee - " + fileName);
+  full_resolution_ = full_resolution;
+  if (full_resolution)
+    statusBar()->clearMessage();
+  else
+    statusBar()->showMessage(tr("Loading full resolution..."));
+
+  min_scale_ = min_scale;
+  max_scale_ = max_scale;
+  image_size_ = image_size;
+  current_scale_ = min_scale - 1;
+  backdrop_scale_ = current_scale_;
+  has_image_ = true;
+  {
+    // We're about to show the original image anyway, so there's no need for
+    // the slider to request a render of it.
+    const QSignalBlocker blocker(locality_slider_);
+    // See sliderChanged for detail on range
+    locality_slider_->setRange(
+        0, (max_scale_ - min_scale_) * kSliderStepsPerScale + 1);
+    locality_slider_->setValue(0); // Original image
+  }
+  locality_slider_->setEnabled(true);
+  // The old image's thumbnails; the new ones follow shortly.
+  scale_strip_->clear();
 
-  cv_image_ = image;
-  cv::cvtColor(cv_image_, cv_image_, cv::COLOR_BGR2RGB);
-  pyramid_->PreProcess(cv_image_);
-  // See sliderChanged for detail on range
-  locality_slider_->setRange(0, pyramid_->MaxScale() - pyramid_->MinScale());
-  locality_slider_->setValue(0); // Original image
-  QImage newImage(cv_image_.data, cv_image_.cols, cv_image_.rows,
-                  static_cast<int>(cv_image_.step), QImage::Format_RGB888);
+  showImage(image);
+  // Saving renders at full resolution, so it has to wait for that.
+  save_action_->setEnabled(full_resolution);
 
-  image_ = newImage;
+  centralWidget()->setVisible(true);
+  setZoom(1);
+}
+
+void Editor::refineFinished(int generation, cv::Size image_size,
+                            int min_scale, int max_scale) {
+  if (generation != load_generation_)
+    return;
 
+  statusBar()->clearMessage();
+  full_resolution_ = true;
   save_action_->setEnabled(true);
+  image_size_ = image_size;
+  if (min_scale != min_scale_ || max_scale != max_scale_) {
+    // The draft's guess at the range was off. Scales mean the same on the
+    // full image, so keep the one the user picked, just at its new notch.
+    min_scale_ = min_scale;
+    max_scale_ = max_scale;
+    const QSignalBlocker blocker(locality_slider_);
+    locality_slider_->setRange(
+        0, (max_scale_ - min_scale_) * kSliderStepsPerScale + 1);
+    if (current_scale_ < min_scale_ || current_scale_ > max_scale_) {
+      locality_slider_->setValue(0);
+    } else {
+      locality_slider_->setValue(
+          cvRound((max_scale_ - current_scale_) * kSliderStepsPerScale) + 1);
+      current_scale_ = sliderScale(locality_slider_->value());
+    }
+  }
+  // Everything rendered so far came from the draft.
+  render_epoch_++;
+  render_cache_.Clear();
+  backdrop_scale_ = std::nanf("");
+  if (locality_slider_->isEnabled())
+    requestRender();
+}
 
-  image_label_->setPixmap(QPixmap::fromImage(image_));
-  image_label_->adjustSize();
-  scroll_area_->setVisible(true);
-  return true;
+void Editor::refineFailed(int generation) {
+  if (generation != load_generation_)
+    return;
+  statusBar()->showMessage(
+      tr("Couldn't decode the full image; showing a reduced copy"));
+}
+
+void Editor::renderStrip(int generation, int thumbnail_width) {
+  // The draft's scales don't line up with the full image's, and it's only
+  // around until refineFile, which brings the full image's strip with it.
+  if (drafting_)
+    return;
+  const std::vector<cv::Mat> strip = relevelStrip(*pyramid_, thumbnail_width);
+  QMetaObject::invokeMethod(
+      this, [this, generation, strip] { stripFinished(generation, strip); },
+      Qt::QueuedConnection);
+}
+
+std::vector<cv::Mat> Editor::relevelStrip(const MinMaxPyramid &pyramid,
+                                          int thumbnail_width) {
+  const cv::Size image_size = pyramid.ImageSize();
+  const cv::Size thumbnail_size(
+      thumbnail_width, std::max(1, thumbnail_width * image_size.height /
+                                       std::max(1, image_size.width)));
+  return pyramid.RelevelStrip(thumbnail_size);
 }
 
-bool Editor::saveFile(const QString &fileName) {
-  QImageWriter writer(fileName);
+void Editor::stripFinished(int generation, const std::vector<cv::Mat> &strip) {
+  if (generation != load_generation_)
+    return;
+  scale_strip_->clear();
+  const qreal ratio = devicePixelRatioF();
+  QSize icon_size;
+  for (size_t i = 0; i < strip.size(); i++) {
+    // QPixmap copies the pixels, so the thumbnails don't need to outlive
+    // this.
+    QPixmap pixmap = QPixmap::fromImage(SharedImage(strip[i]).image());
+    pixmap.setDevicePixelRatio(ratio);
+    icon_size = icon_size.expandedTo(pixmap.size() / ratio);
+    const int scale = min_scale_ + static_cast<int>(i);
+    QListWidgetItem *item =
+        new QListWidgetItem(QIcon(pixmap), QString::number(scale));
+    item->setData(Qt::UserRole, scale);
+    item->setToolTip(tr("Relevel at scale %1").arg(scale));
+    scale_strip_->addItem(item);
+  }
+  scale_strip_->setIconSize(icon_size);
+  scale_strip_->setFixedHeight(icon_size.height() +
+                               2 * fontMetrics().height());
+  scale_strip_->setVisible(!strip.empty());
+}
+
+void Editor::scaleStripClicked(QListWidgetItem *item) {
+  if (!locality_slider_->isEnabled())
+    return;
+  // The inverse of localitySliderChanged, for whole scales.
+  const int scale = item->data(Qt::UserRole).toInt();
+  locality_slider_->setValue((max_scale_ - scale) * kSliderStepsPerScale + 1);
+}
+
+void Editor::loadFailed(int generation, const QString &fileName) {
+  if (generation != load_generation_)
+    return;
+
+  statusBar()->clearMessage();
+  // The pyramid wasn't touched, so whatever was loaded before is still good.
+  locality_slider_->setEnabled(has_image_);
+  if (has_image_)
+    setZoom(zoom_);
+  QMessageBox::information(
+      this, QGuiApplication::applicationDisplayName(),
+      tr("Cannot load %1").arg(QDir::toNativeSeparators(fileName)));
+}
+
+void Editor::showImage(cv::Mat image) {
+  image_view_->setImage(SharedImage(image));
+}
+
+cv::Size Editor::previewSize() const {
+  // The view isn't laid out until the first image is shown; until then the
+  // window size is a decent guess.
+  const QWidget *shown_in =
+      image_view_->isVisible() ? static_cast<const QWidget *>(image_view_)
+                                : this;
+  const qreal ratio = devicePixelRatioF();
+  return cv::Size(std::max(1, static_cast<int>(shown_in->width() * ratio)),
+                  std::max(1, static_cast<int>(shown_in->height() * ratio)));
+}
+
+cv::Size Editor::viewportSize() const {
+  const QWidget *viewport = scroll_area_->viewport();
+  const qreal ratio = devicePixelRatioF();
+  return cv::Size(std::max(1, static_cast<int>(viewport->width() * ratio)),
+                  std::max(1, static_cast<int>(viewport->height() * ratio)));
+}
 
-  if (!writer.write(image_)) {
+QRectF Editor::visibleArea() const {
+  // The view sits at a negative offset within the viewport when scrolled.
+  const QRect visible =
+      QRect(-image_view_->pos(), scroll_area_->viewport()->size()) &
+      image_view_->rect();
+  const qreal width = std::max(1, image_view_->width());
+  const qreal height = std::max(1, image_view_->height());
+  return QRectF(visible.x() / width, visible.y() / height,
+                visible.width() / width, visible.height() / height);
+}
+
+void Editor::setZoom(float zoom) {
+  // Past the point where image pixels are kMaxPixelZoom screen pixels across
+  // (in either direction), there's nothing more to see.
+  const cv::Size viewport = viewportSize();
+  const float max_zoom = std::max(
+      1.f, kMaxPixelZoom * std::min(image_size_.width /
+                                        static_cast<float>(viewport.width),
+                                    image_size_.height /
+                                        static_cast<float>(viewport.height)));
+  zoom = std::min(std::max(zoom, 1.f), max_zoom);
+
+  QScrollBar *horizontal = scroll_area_->horizontalScrollBar();
+  QScrollBar *vertical = scroll_area_->verticalScrollBar();
+  const QSize visible = scroll_area_->viewport()->size();
+  const qreal center_x = (horizontal->value() + visible.width() / 2.) /
+                         std::max(1, image_view_->width());
+  const qreal center_y = (vertical->value() + visible.height() / 2.) /
+                         std::max(1, image_view_->height());
+
+  zoom_ = zoom;
+  if (zoom_ == 1) {
+    scroll_area_->setWidgetResizable(true);
+  } else {
+    // Like fitting to the window, the image keeps the window's aspect ratio;
+    // it's just bigger.
+    scroll_area_->setWidgetResizable(false);
+    image_view_->resize(std::lround(visible.width() * zoom_),
+                        std::lround(visible.height() * zoom_));
+    horizontal->setValue(
+        std::lround(center_x * image_view_->width() - visible.width() / 2.));
+    vertical->setValue(
+        std::lround(center_y * image_view_->height() - visible.height() / 2.));
+  }
+  zoom_in_action_->setEnabled(has_image_ && zoom_ < max_zoom);
+  zoom_out_action_->setEnabled(has_image_ && zoom_ > 1);
+  zoom_fit_action_->setEnabled(has_image_ && zoom_ > 1);
+}
+
+void Editor::zoomIn() {
+  setZoom(zoom_ * 2);
+  requestRender();
+}
+
+void Editor::zoomOut() {
+  setZoom(zoom_ / 2);
+  requestRender();
+}
+
+void Editor::zoomToFit() {
+  setZoom(1);
+  requestRender();
+}
+
+void Editor::saveFile(const QString &fileName, bool close_when_done) {
+  statusBar()->showMessage(
+      tr("Saving \"%1\"...").arg(QDir::toNativeSeparators(fileName)));
+
+  // What's on screen is only a preview, so render the real thing.
+  const float scale = current_scale_;
+  worker_->Submit(
+      "save:" + fileName.toStdString(),
+      [this, scale, fileName, close_when_done](
+          const CoalescingWorker::IsStale &) {
+        // Deeper images stay that way in formats that can hold them (PNG and
+        // TIFF for 16-bit, TIFF and EXR for float), and are scaled down to 8
+        // bits for the rest.
+        const cv::Mat result = ConvertForFormat(pyramid_->Relevel(scale),
+                                                fileName.toStdString());
+        bool ok;
+        QString error;
+        if (result.depth() == CV_8U) {
+          QImageWriter writer(fileName);
+          ok = writer.write(SharedImage(result).image());
+          error = writer.errorString();
+        } else {
+          // QImage would lose the extra bits, so leave these to OpenCV.
+          ok = cv::imwrite(fileName.toStdString(), result);
+          if (!ok)
+            error = tr("OpenCV couldn't write the image");
+        }
+        QMetaObject::invokeMethod(
+            this,
+            [this, fileName, ok, error, close_when_done] {
+              saveFinished(fileName, ok, error, close_when_done);
+            },
+            Qt::QueuedConnection);
+      });
+}
+
+void Editor::saveFinished(const QString &fileName, bool ok,
+                          const QString &error, bool close_when_done) {
+  if (!ok) {
+    statusBar()->clearMessage();
     QMessageBox::information(
         this, QGuiApplication::applicationDisplayName(),
         tr("Cannot write %1: %2")
-            .arg(QDir::toNativeSeparators(fileName), writer.errorString()));
-    return false;
+            .arg(QDir::toNativeSeparators(fileName), error));
+  } else {
+    const QString message =
+        tr("Wrote \"%1\"").arg(QDir::toNativeSeparators(fileName));
+    statusBar()->showMessage(message);
+  }
+  if (close_when_done && !ok) {
+    // Only batch saves close the window, and a batch that didn't write its
+    // output has failed.
+    QCoreApplication::exit(1);
+  } else if (close_when_done) {
+    close();
   }
-  const QString message =
-      tr("Wrote \"%1\"").arg(QDir::toNativeSeparators(fileName));
-  statusBar()->showMessage(message);
-  return true;
 }
 
 void Editor::createActions() {
@@ -142,6 +674,32 @@ void Editor::createActions() {
   QAction *exitAct = fileMenu->addAction(tr("E&xit"), this, &QWidget::close);
   exitAct->setShortcut(tr("Ctrl+Q"));
 
+  QMenu *viewMenu = menuBar()->addMenu(tr("&View"));
+  QAction *statsAct = viewMenu->addAction(tr("Pyramid &Statistics"), this,
+                                          &Editor::showStatsToggled);
+  statsAct->setCheckable(true);
+  QAction *windowAct = viewMenu->addAction(
+      tr("Sliding &Window Min/Max"), this, &Editor::slidingWindowToggled);
+  windowAct->setCheckable(true);
+  windowAct->setToolTip(tr("Smoother but slower than the min/max pyramid"));
+  viewMenu->addSeparator();
+  zoom_in_action_ =
+      viewMenu->addAction(tr("Zoom &In"), this, &Editor::zoomIn);
+  zoom_in_action_->setShortcut(QKeySequence::ZoomIn);
+  zoom_in_action_->setEnabled(false);
+  zoom_out_action_ =
+      viewMenu->addAction(tr("Zoom &Out"), this, &Editor::zoomOut);
+  zoom_out_action_->setShortcut(QKeySequence::ZoomOut);
+  zoom_out_action_->setEnabled(false);
+  zoom_fit_action_ =
+      viewMenu->addAction(tr("&Fit to Window"), this, &Editor::zoomToFit);
+  zoom_fit_action_->setShortcut(tr("Ctrl+0"));
+  zoom_fit_action_->setEnabled(false);
+
+  stats_label_ = new QLabel;
+  stats_label_->setVisible(false);
+  statusBar()->addPermanentWidget(stats_label_);
+
   locality_slider_ = new QSlider(Qt::Horizontal);
   locality_slider_->setRange(0, 100);
   locality_slider_->setValue(0);
@@ -156,36 +714,277 @@ void Editor::createActions() {
   slider_hbox->addWidget(locality_label);
   slider_hbox->addWidget(locality_slider_);
 
+  // A single row of thumbnails, scrolling sideways if there are too many.
+  scale_strip_ = new QListWidget;
+  scale_strip_->setViewMode(QListView::IconMode);
+  scale_strip_->setFlow(QListView::LeftToRight);
+  scale_strip_->setWrapping(false);
+  scale_strip_->setMovement(QListView::Static);
+  scale_strip_->setVerticalScrollBarPolicy(Qt::ScrollBarAlwaysOff);
+  scale_strip_->setVisible(false);
+  QObject::connect(scale_strip_, &QListWidget::itemClicked,
+                   [this](QListWidgetItem *item) { scaleStripClicked(item); });
+
   QVBoxLayout *layout = new QVBoxLayout;
   layout->addLayout(slider_hbox);
-  layout->addWidget(image_label_);
-
-  scroll_area_->setLayout(layout);
+  layout->addWidget(scale_strip_);
+  layout->addWidget(scroll_area_);
+
+  QWidget *central = new QWidget;
+  central->setLayout(layout);
+  setCentralWidget(central);
+
+  // Zoomed in, scrolling brings new parts of the image on screen, which need
+  // rendering. Renders coalesce, so a drag only renders where it stops.
+  for (QScrollBar *bar : {scroll_area_->horizontalScrollBar(),
+                          scroll_area_->verticalScrollBar()}) {
+    QObject::connect(bar, &QScrollBar::valueChanged, [this](int) {
+      if (zoom_ > 1 && has_image_ && locality_slider_->isEnabled())
+        requestRender();
+    });
+  }
 }
 
 void Editor::localitySliderChanged(int value) {
   // It's nice for the UI to go from no change to more severe change. So reverse
   // the direction of the slider, and make sure that the leftmost value is
-  // out-of-range (and therefore returns the original image).
-  cv_image_ = pyramid_->Relevel(pyramid_->MaxScale() - value);
-  QImage newImage(cv_image_.data, cv_image_.cols, cv_image_.rows,
-                  static_cast<int>(cv_image_.step), QImage::Format_RGB888);
-  image_ = newImage;
-  image_label_->setPixmap(QPixmap::fromImage(image_));
+  // out-of-range (and therefore returns the original image). Past that, each
+  // notch is a fraction of a scale, so locality changes smoothly instead of
+  // doubling at every step.
+  current_scale_ = sliderScale(value);
+  requestRender();
+}
+
+float Editor::sliderScale(int value) const {
+  if (value == 0)
+    return max_scale_ + 1;
+  return max_scale_ - static_cast<float>(value - 1) / kSliderStepsPerScale;
+}
+
+Editor::RenderKey Editor::renderKey(float scale, cv::Size size) const {
+  // Scales are always a whole number of notches, so this is exact.
+  return RenderKey(render_epoch_, cvRound(scale * kSliderStepsPerScale),
+                   size.width, size.height);
+}
+
+void Editor::prefetchNeighbours() {
+  if (!has_image_ || zoom_ != 1 || !locality_slider_->isEnabled())
+    return;
+  const cv::Size preview_size = previewSize();
+  const int value = locality_slider_->value();
+  // Nearest first, alternating sides: the next move is as likely to go one
+  // way as the other.
+  std::vector<std::pair<float, RenderKey>> wanted;
+  for (int distance = 1; distance <= kPrefetchNotches; distance++) {
+    for (int next : {value - distance, value + distance}) {
+      if (next < locality_slider_->minimum() ||
+          next > locality_slider_->maximum())
+        continue;
+      const float scale = sliderScale(next);
+      const RenderKey key = renderKey(scale, preview_size);
+      cv::Mat cached;
+      if (!render_cache_.Get(key, &cached))
+        wanted.emplace_back(scale, key);
+    }
+  }
+  if (wanted.empty())
+    return;
+
+  // Under the same key as real renders, so that moving the slider cancels
+  // this if it hasn't started, and stops it between frames if it has. The
+  // frames are independent, so they're rendered side by side; the batch takes
+  // about as long as a single render would.
+  worker_->Submit("render", [this, wanted, preview_size](
+                                const CoalescingWorker::IsStale &is_stale) {
+    const int threads = std::max(1u, std::thread::hardware_concurrency());
+    ParallelFor(static_cast<int>(wanted.size()), threads, 1,
+                [&](int begin, int end) {
+                  for (int i = begin; i < end && !is_stale(); i++) {
+                    float scale = wanted[i].first;
+                    const cv::Mat frame = renderSource(&scale).RelevelPreview(
+                        scale, preview_size);
+                    render_cache_.Put(wanted[i].second, frame,
+                                      frame.total() * frame.elemSize());
+                  }
+                });
+    reportStats();
+  });
+}
+
+void Editor::requestRender() {
+  // Renders coalesce: while one is running, further slider moves just replace
+  // the pending one, so we only ever render the latest position.
+  const int generation = ++render_generation_;
+  const float scale = current_scale_;
+  // Render at the size we're going to display at. This keeps slider latency
+  // down to what the window size needs, however big the image is.
+  const cv::Size preview_size = previewSize();
+  if (zoom_ == 1) {
+    // Scrubbing back to somewhere we've already been (or prefetched) costs
+    // nothing at all.
+    const RenderKey key = renderKey(scale, preview_size);
+    cv::Mat cached;
+    if (render_cache_.Get(key, &cached)) {
+      // Nothing else queued is wanted any more either.
+      worker_->Submit("render", [](const CoalescingWorker::IsStale &) {});
+      renderFinished(generation, scale, cached, cv::Mat(), QRectF());
+      return;
+    }
+    worker_->Submit("render", [this, scale, preview_size, generation, key](
+                                  const CoalescingWorker::IsStale &is_stale) {
+      float source_scale = scale;
+      cv::Mat result = renderSource(&source_scale)
+                           .RelevelPreview(source_scale, preview_size);
+      render_cache_.Put(key, result, result.total() * result.elemSize());
+      reportStats();
+      // The slider has moved on while we were busy; don't bother the GUI.
+      if (is_stale())
+        return;
+      QMetaObject::invokeMethod(
+          this,
+          [this, generation, scale, result] {
+            renderFinished(generation, scale, result, cv::Mat(), QRectF());
+          },
+          Qt::QueuedConnection);
+    });
+    return;
+  }
+
+  // Zoomed in, the preview is the size of the zoomed image, which can be far
+  // bigger than the screen (or the image, in which case it's the image). Only
+  // the visible part of it gets rendered; the backdrop, at window size, stands
+  // in for the rest until it's scrolled into view.
+  const QRectF visible = visibleArea();
+  const cv::Size backdrop_size =
+      backdrop_scale_ != scale ? viewportSize() : cv::Size();
+  worker_->Submit("render", [this, scale, preview_size, visible,
+                             backdrop_size, generation](
+                                const CoalescingWorker::IsStale &is_stale) {
+    float source_scale = scale;
+    const MinMaxPyramid &source = renderSource(&source_scale);
+    cv::Mat backdrop;
+    if (!backdrop_size.empty())
+      backdrop = source.RelevelPreview(source_scale, backdrop_size);
+    // Round outwards to whole preview pixels, and tell the view exactly
+    // where that ended up.
+    const cv::Size size = source.PreviewSize(preview_size);
+    const int left = static_cast<int>(std::floor(visible.left() * size.width));
+    const int top = static_cast<int>(std::floor(visible.top() * size.height));
+    const int right =
+        static_cast<int>(std::ceil(visible.right() * size.width));
+    const int bottom =
+        static_cast<int>(std::ceil(visible.bottom() * size.height));
+    const cv::Rect roi(left, top, right - left, bottom - top);
+    const cv::Mat tile =
+        source.RelevelPreview(source_scale, preview_size, roi);
+    const QRectF area(
+        static_cast<qreal>(roi.x) / size.width,
+        static_cast<qreal>(roi.y) / size.height,
+        static_cast<qreal>(roi.width) / size.width,
+        static_cast<qreal>(roi.height) / size.height);
+    reportStats();
+    if (is_stale())
+      return;
+    QMetaObject::invokeMethod(
+        this,
+        [this, generation, scale, backdrop, tile, area] {
+          renderFinished(generation, scale, backdrop, tile, area);
+        },
+        Qt::QueuedConnection);
+  });
+}
+
+void Editor::slidingWindowToggled(bool on) {
+  const auto engine = on ? MinMaxPyramid::Engine::kSlidingWindow
+                         : MinMaxPyramid::Engine::kPyramid;
+  const bool has_image = has_image_;
+  const int generation = load_generation_;
+  const int thumbnail_width =
+      static_cast<int>(std::lround(kThumbnailWidth * devicePixelRatioF()));
+  render_epoch_++;
+  render_cache_.Clear();
+  // The pyramid belongs to the worker's thread, so switch it over there. The
+  // render queued behind this then sees the new engine.
+  worker_->Submit("engine", [this, engine, has_image, generation,
+                             thumbnail_width](
+                                const CoalescingWorker::IsStale &) {
+    pyramid_->SetEngine(engine);
+    draft_pyramid_->SetEngine(engine);
+    if (has_image)
+      renderStrip(generation, thumbnail_width);
+    reportStats();
+  });
+  // Zoomed in, the backdrop is only re-rendered when its scale is out of
+  // date; make sure it is, since it's out of date in a different way.
+  backdrop_scale_ = std::nanf("");
+  if (has_image_ && locality_slider_->isEnabled())
+    requestRender();
+}
+
+void Editor::showStatsToggled(bool show) {
+  show_stats_ = show;
+  stats_label_->setVisible(show);
+  stats_label_->setText(show ? tr("Collecting statistics...") : QString());
+  // Collection is off unless it's wanted, since it isn't quite free. The
+  // pyramid belongs to the worker's thread, so switch it over there.
+  worker_->Submit("stats", [this, show](const CoalescingWorker::IsStale &) {
+    pyramid_->SetCollectStats(show);
+    if (show)
+      pyramid_->ResetStats();
+  });
+}
+
+void Editor::reportStats() {
+  if (!show_stats_)
+    return;
+  const QString summary =
+      QString::fromStdString(pyramid_->GetStats().Summary());
+  QMetaObject::invokeMethod(
+      this,
+      [this, summary] {
+        if (show_stats_)
+          stats_label_->setText(summary);
+      },
+      Qt::QueuedConnection);
+}
+
+void Editor::renderFinished(int generation, float scale, cv::Mat backdrop,
+                            cv::Mat tile, const QRectF &area) {
+  if (generation != render_generation_)
+    return;
+  if (!backdrop.empty()) {
+    showImage(backdrop);
+    backdrop_scale_ = scale;
+  }
+  if (!tile.empty())
+    image_view_->setTile(SharedImage(tile), area);
+  // Now that what the user asked for is up, get ahead of them.
+  prefetchNeighbours();
 }
 
 bool Editor::runAsBatch(const QString &inFileName, const QString &outFileName) {
+  // Decoded right here rather than in the background, so that an input we
+  // can't use fails the command instead of popping up a message box and
+  // leaving it to exit successfully. The decoded image is passed on, so it
+  // isn't decoded twice.
+  const cv::Mat image = cv::imread(inFileName.toStdString(),
+                                   cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+  if (image.empty() || !MinMaxPyramid::SupportsDepth(image.depth()))
+    return false;
+
   batch_mode_ = true;
   batch_input_file_ = inFileName;
   batch_output_file_ = outFileName;
 
-  return loadFile(inFileName);
+  return loadFile(inFileName, image);
 }
 
 void Editor::keyPressEvent(QKeyEvent *event) {
   if (batch_mode_ && event->key() == Qt::Key_Space) {
-    saveFile(batch_output_file_);
-    close();
+    // Still loading; there's nothing to save yet.
+    if (!has_image_ || !full_resolution_)
+      return;
+    saveFile(batch_output_file_, /*close_when_done=*/true);
   } else if (batch_mode_ && event->key() == Qt::Key_Escape) {
     // Close without saving
     close();
@@ -193,3 +992,15 @@ void Editor::keyPressEvent(QKeyEvent *event) {
     QMainWindow::keyPressEvent(event);
   }
 }
+
+void Editor::resizeEvent(QResizeEvent *event) {
+  QMainWindow::resizeEvent(event);
+  // Zoomed in, the image is sized relative to the window, so it has to be
+  // resized by hand.
+  if (has_image_ && zoom_ > 1)
+    setZoom(zoom_);
+  // The preview was rendered for the old size. Resizes arrive in bursts, but
+  // renders coalesce, so this is cheap.
+  if (has_image_ && locality_slider_->isEnabled())
+    requestRender();
+}
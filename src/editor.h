@@ -1,23 +1,38 @@
+#include <QtCore/QRectF>
 #include <QtGui/QKeyEvent>
 #include <QtWidgets/QLabel>
+#include <QtWidgets/QListWidget>
 #include <QtWidgets/QMainWindow>
 #include <QtWidgets/QScrollArea>
 #include <QtWidgets/QSlider>
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
 
+#include "lru_cache.h"
 #include "opencv4/opencv2/opencv.hpp"
 
+class CoalescingWorker;
+class ImageView;
 class MinMaxPyramid;
+struct PyramidCacheKey;
+struct PyramidData;
 
 class Editor : public QMainWindow {
   Q_OBJECT
 
 public:
   explicit Editor(MinMaxPyramid *pyramid, QWidget *parent = nullptr);
-  ~Editor() = default;
+  ~Editor();
 
   // We want to be able to use the same UI to batch run against multiple images.
-  // To support this, let the caller initialize with fixed filenames.
+  // To support this, let the caller initialize with fixed filenames. Returns
+  // false, having done nothing, if the input can't be decoded; the caller
+  // should exit with an error then. If the output then can't be written,
+  // the application exits with 1.
   bool runAsBatch(const QString &inFileName, const QString &outFileName);
 
 private slots:
@@ -26,32 +41,204 @@ private slots:
 
 protected:
   void keyPressEvent(QKeyEvent *event) override;
+  void resizeEvent(QResizeEvent *event) override;
 
 private:
+  // Slider notches per pyramid scale. Each scale doubles the locality radius,
+  // which is far too coarse a step to be the only option.
+  static constexpr int kSliderStepsPerScale = 8;
+  // Zooming in stops once an image pixel covers this many screen pixels.
+  static constexpr int kMaxPixelZoom = 8;
+  // Width of the thumbnails in the scale strip, in device-independent pixels.
+  static constexpr int kThumbnailWidth = 96;
+  // Memory for finished renders; a few dozen at typical window sizes.
+  static constexpr size_t kRenderCacheBytes = size_t{256} << 20;
+  // Slider notches either side of the current one to render ahead of time.
+  static constexpr int kPrefetchNotches = 4;
+  // Disk space for cached pyramids. Each takes a bit under three times the
+  // decoded image, so this is a couple of dozen typical photos.
+  static constexpr uint64_t kPyramidCacheBytes = uint64_t{4} << 30;
+
+  // Identifies a finished render: (render_epoch_, scale in slider notches,
+  // width, height).
+  using RenderKey = std::tuple<int, int, int, int>;
+
   void createActions();
-  bool loadFile(const QString &fileName);
-  bool saveFile(const QString &fileName);
+  // Decoding and pre-processing happen in the background, and loadFinished is
+  // called once they're done. Returns false if the file obviously can't be
+  // read; errors decoding it are reported later. If the caller has already
+  // decoded the file, passing the image in saves decoding it again.
+  bool loadFile(const QString &fileName, cv::Mat decoded = cv::Mat());
+  // Saving renders at full resolution, so it also happens in the background.
+  // Optionally closes the window once the file is written (or failed to be).
+  void saveFile(const QString &fileName, bool close_when_done = false);
 
   void localitySliderChanged(int value);
+  // The scale that a slider position stands for.
+  float sliderScale(int value) const;
+  RenderKey renderKey(float scale, cv::Size size) const;
+  // Once the GUI is idle, renders the slider positions either side of the
+  // current one into render_cache_, so that scrubbing to them is instant.
+  // Any real render request cancels this.
+  void prefetchNeighbours();
+  // Jumps the slider to the whole scale that a scale strip thumbnail shows.
+  void scaleStripClicked(QListWidgetItem *item);
+  // Renders current_scale_ at display resolution, in the background. When
+  // zoomed in, that's only the part of the image that's on screen.
+  void requestRender();
+  // Size, in device pixels, that the image is displayed at. When zoomed in,
+  // that's the size of the whole (mostly off-screen) image.
+  cv::Size previewSize() const;
+  // Size, in device pixels, of the area the image is shown in.
+  cv::Size viewportSize() const;
+  // The part of the image that's on screen, in fractions of its size.
+  QRectF visibleArea() const;
+
+  // Zoom is relative to fitting the image to the window, so 1 is the normal,
+  // unscrolled view. Keeps the middle of the view in place.
+  void setZoom(float zoom);
+  void zoomIn();
+  void zoomOut();
+  void zoomToFit();
+  // Where the on-disk pyramid cache for the given image goes, or empty if
+  // there's nowhere to put it.
+  static std::string pyramidCachePath(const QString &fileName);
+  // Called on worker_'s thread once pyramid_ is built: writes it to the
+  // cache, and trims the cache back to kPyramidCacheBytes, on
+  // cache_worker_'s thread so that renders don't wait for the disk.
+  void saveCache(const std::string &cache_path, const PyramidCacheKey &key);
+
+  // Big JPEGs open in two steps. First a draft, decoded at 1/4 or 1/8 size,
+  // goes into draft_pyramid_ so that the user has something to work with
+  // right away; then the full-resolution image replaces it. These all run on
+  // worker_'s thread.
+  //
+  // How many pyramid scales smaller than the image a draft of it should be,
+  // or 0 if it isn't worth having one.
+  static int draftShift(const QString &fileName, cv::Size preview_size);
+  // Decodes and pre-processes the draft, and posts it to loadFinished.
+  // Returns false if there's no draft, which leaves loading to the usual path.
+  bool loadDraft(int generation, const QString &fileName,
+                 cv::Size preview_size);
+  // Swaps in the full-resolution pyramid, built on refine_worker_'s thread,
+  // in place of the draft, and posts to refineFinished and then the strip to
+  // stripFinished. An empty image in `data` means the full image couldn't be
+  // had. Writes the pyramid cache unless cache_path is empty.
+  void refineFile(int generation, const PyramidData &data,
+                  const std::vector<cv::Mat> &strip,
+                  const std::string &cache_path, const PyramidCacheKey &key);
+  // The pyramid to render from: the draft's, until the full image is in. The
+  // scale is for the full image, and is adjusted to match.
+  const MinMaxPyramid &renderSource(float *scale) const;
+
+  // Completion callbacks for work done on worker_; always called on the GUI
+  // thread. Results for anything that has since been superseded are dropped.
+  // With full_resolution false, the image is from the draft; refineFinished
+  // follows once the real thing is ready.
+  void loadFinished(int generation, const QString &fileName, cv::Mat image,
+                    cv::Size image_size, int min_scale, int max_scale,
+                    bool full_resolution);
+  void loadFailed(int generation, const QString &fileName);
+  void refineFinished(int generation, cv::Size image_size, int min_scale,
+                      int max_scale);
+  void refineFailed(int generation);
+  // Either image is empty if it wasn't rendered: the backdrop is the whole
+  // image at window size, and the tile the detailed part within it at `area`.
+  void renderFinished(int generation, float scale, cv::Mat backdrop,
+                      cv::Mat tile, const QRectF &area);
+  void saveFinished(const QString &fileName, bool ok, const QString &error,
+                    bool close_when_done);
+  // Thumbnails for every whole scale, from min_scale_ up.
+  void stripFinished(int generation, const std::vector<cv::Mat> &strip);
+
+  void showImage(cv::Mat image);
+
+  // Renders the scale strip on worker_'s thread, and posts it to
+  // stripFinished.
+  void renderStrip(int generation, int thumbnail_width);
+  // The thumbnails themselves, from any pyramid, on whatever thread owns it.
+  static std::vector<cv::Mat> relevelStrip(const MinMaxPyramid &pyramid,
+                                           int thumbnail_width);
+  // Switches between the pyramid and sliding-window engines, then re-renders.
+  void slidingWindowToggled(bool on);
+
+  void showStatsToggled(bool show);
+  // Called on worker_'s thread after the pyramid has done something: passes
+  // its stats on to the status bar, if they're being shown.
+  void reportStats();
 
   bool batch_mode_ = false;
   QString batch_input_file_;
   QString batch_output_file_;
 
+  // Only ever touched from worker_'s thread, apart from construction.
   MinMaxPyramid *pyramid_;
+  // The same goes for the draft, and everything about it. The draft is
+  // 2^draft_shift_ times smaller than the image, whose scale range it
+  // estimates as full_min_scale_ to full_max_scale_.
+  std::unique_ptr<MinMaxPyramid> draft_pyramid_;
+  bool drafting_ = false;
+  int draft_shift_ = 0;
+  int full_min_scale_ = 0;
+  int full_max_scale_ = 0;
+  // The load that pyramid_ belongs to (or will, once refined).
+  int loaded_generation_ = 0;
+
+  // Scale range of the loaded image, copied out of the pyramid when loading
+  // finishes so that the GUI thread never has to look at the pyramid.
+  int min_scale_ = 0;
+  int max_scale_ = 0;
+  cv::Size image_size_;
+  bool has_image_ = false;
+  // False while what's loaded is only the draft.
+  bool full_resolution_ = false;
+  // Scale currently being displayed; fractional in between slider notches.
+  // Starts out of range, which means the original image.
+  float current_scale_ = -1;
+  // Scale of the whole-image backdrop on screen. Zoomed in, the backdrop only
+  // gets re-rendered when this falls behind current_scale_.
+  float backdrop_scale_ = -1;
+  float zoom_ = 1;
+
+  // Bumped on every request, so that results which arrive after a newer
+  // request was made can be recognized and dropped.
+  int load_generation_ = 0;
+  int render_generation_ = 0;
 
-  QLabel *image_label_;
+  // Whole-image renders at window size, including prefetched ones. Only the
+  // unzoomed view uses these; zoomed in, every scroll position is different.
+  // Filled in on worker_'s thread and read on the GUI thread.
+  LruCache<RenderKey, cv::Mat> render_cache_{kRenderCacheBytes};
+  // Bumped whenever the pyramid changes (a new image, or a new engine), so
+  // that renders from before can't be mistaken for current ones, even if
+  // they land in the cache after it was cleared.
+  int render_epoch_ = 0;
+
+  // What's on screen: display-sized previews, not the full-resolution image.
+  // Zoomed in, this is bigger than scroll_area_ and scrolls within it.
+  ImageView *image_view_;
   QScrollArea *scroll_area_;
   QSlider *locality_slider_;
-
-  // QImage and cv::Mat can share their underlying data, and are ref-counted.
-  // This is convenient, except that they don't count each other as references.
-  // To avoid garbage collection problems, we keep one copy of each type;
-  // hopefully these usually point to the same buffer, although this class
-  // mostly uses QImage, and even then tries not to know anything about its
-  // internals.
-  cv::Mat cv_image_;
-  QImage image_;
+  // One thumbnail per whole scale, rendered right after loading, so that the
+  // user can see which scale suits the image without scrubbing through them.
+  QListWidget *scale_strip_;
+  // Permanent status bar entry for pyramid stats; hidden unless asked for.
+  QLabel *stats_label_;
+  // Read from worker_'s thread too.
+  std::atomic<bool> show_stats_{false};
 
   QAction *save_action_;
+  QAction *zoom_in_action_;
+  QAction *zoom_out_action_;
+  QAction *zoom_fit_action_;
+
+  // Runs loads and renders off the GUI thread. Declared last so that it's
+  // destroyed (and its thread joined) before any of the members above.
+  std::unique_ptr<CoalescingWorker> worker_;
+  // Decodes and pre-processes full-resolution images while worker_ renders
+  // their drafts.
+  std::unique_ptr<CoalescingWorker> refine_worker_;
+  // Writes the pyramid cache. Its jobs have their own copy of everything
+  // they touch, so it can go whenever.
+  std::unique_ptr<CoalescingWorker> cache_worker_;
 };
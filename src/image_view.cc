@@ -0,0 +1,54 @@
+#include "image_view.h"
+
+#include <QtGui/QPaintEvent>
+#include <QtGui/QPainter>
+
+ImageView::ImageView(QWidget *parent) : QWidget(parent) {
+  // Every pixel gets painted over, so there's no point Qt clearing them first.
+  setAttribute(Qt::WA_OpaquePaintEvent);
+}
+
+void ImageView::setImage(const SharedImage &image) {
+  image_ = image;
+  tile_ = SharedImage();
+  update();
+}
+
+void ImageView::setTile(const SharedImage &tile, const QRectF &area) {
+  tile_ = tile;
+  tile_area_ = area;
+  update();
+}
+
+QSize ImageView::sizeHint() const {
+  return image_.empty() ? QWidget::sizeHint() : image_.image().size();
+}
+
+void ImageView::paintEvent(QPaintEvent *event) {
+  QPainter painter(this);
+  if (image_.empty()) {
+    painter.fillRect(rect(), palette().color(backgroundRole()));
+    return;
+  }
+  // Previews are rendered at the displayed size, so this is normally 1:1 and
+  // the smoothing never kicks in; it just covers the moment between a resize
+  // and the re-render.
+  painter.setRenderHint(QPainter::SmoothPixmapTransform);
+  // Zoomed in, the widget can be many times the size of the screen, so only
+  // draw the part of the image that's actually exposed.
+  const QImage &image = image_.image();
+  const QRectF exposed = event->rect();
+  const qreal x_scale = image.width() / static_cast<qreal>(width());
+  const qreal y_scale = image.height() / static_cast<qreal>(height());
+  painter.drawImage(exposed, image,
+                    QRectF(exposed.x() * x_scale, exposed.y() * y_scale,
+                           exposed.width() * x_scale,
+                           exposed.height() * y_scale));
+  if (!tile_.empty()) {
+    painter.drawImage(QRectF(tile_area_.x() * width(),
+                             tile_area_.y() * height(),
+                             tile_area_.width() * width(),
+                             tile_area_.height() * height()),
+                      tile_.image());
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef IMAGE_VIEW_
+#define IMAGE_VIEW_
+
+#include <QtCore/QRectF>
+#include <QtWidgets/QWidget>
+
+#include "shared_image.h"
+
+// Shows an image stretched to fill the widget, optionally with a more detailed
+// tile drawn over part of it.
+//
+// This replaces a QLabel with a pixmap, which needed a QPixmap copy of every
+// new image before it could be shown. Here the image is painted straight from
+// its own pixels, and the view just holds a reference to them.
+class ImageView : public QWidget {
+public:
+  explicit ImageView(QWidget *parent = nullptr);
+
+  // Replaces the whole image, and drops the tile.
+  void setImage(const SharedImage &image);
+  // Draws `tile` over `area` of the image, given in fractions of its width and
+  // height, in place of any previous tile. When zoomed in, only what's on
+  // screen is worth rendering in detail; the image is a stand-in for the rest
+  // until the tile catches up with scrolling.
+  void setTile(const SharedImage &tile, const QRectF &area);
+
+  // The image's own size, so adjustSize() shows it 1:1.
+  QSize sizeHint() const override;
+
+protected:
+  void paintEvent(QPaintEvent *event) override;
+
+private:
+  SharedImage image_;
+  SharedImage tile_;
+  QRectF tile_area_;
+};
+
+#endif // IMAGE_VIEW_
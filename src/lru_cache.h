@@ -0,0 +1,113 @@
+#ifndef LRU_CACHE_
+#define LRU_CACHE_
+
+#include <cstddef>
+#include <list>
+#include <map>
+#include <mutex>
+#include <utility>
+
+// Least-recently-used cache bounded by total size in bytes rather than by entry
+// count, since the things we cache (mostly images) vary wildly in size. The
+// caller says how big each entry is when inserting it.
+//
+// Values are returned by copy, so this is intended for cheap-to-copy handles
+// like cv::Mat or shared_ptr; an evicted entry stays alive for as long as
+// someone still holds a copy.
+//
+// Thread-safe.
+template <typename Key, typename Value> class LruCache {
+public:
+  explicit LruCache(size_t budget_bytes) : budget_bytes_(budget_bytes) {}
+
+  // Returns true and fills in *value if the key is present. Marks the entry as
+  // most recently used.
+  bool Get(const Key &key, Value *value) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return false;
+    entries_.splice(entries_.begin(), entries_, it->second);
+    *value = it->second->value;
+    return true;
+  }
+
+  // Inserts or replaces an entry, then evicts the least recently used entries
+  // until we're back under budget. An entry bigger than the whole budget is not
+  // stored at all.
+  void Put(const Key &key, Value value, size_t bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EraseLocked(key);
+    if (bytes > budget_bytes_)
+      return;
+    entries_.push_front(Entry{key, std::move(value), bytes});
+    index_[key] = entries_.begin();
+    bytes_ += bytes;
+    EvictLocked();
+  }
+
+  void Erase(const Key &key) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    EraseLocked(key);
+  }
+
+  void Clear() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    index_.clear();
+    bytes_ = 0;
+  }
+
+  // Shrinking the budget evicts immediately.
+  void SetBudget(size_t budget_bytes) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budget_bytes_ = budget_bytes;
+    EvictLocked();
+  }
+
+  size_t budget() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return budget_bytes_;
+  }
+  // Total size of the entries currently held.
+  size_t bytes() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return bytes_;
+  }
+  size_t size() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return entries_.size();
+  }
+
+private:
+  struct Entry {
+    Key key;
+    Value value;
+    size_t bytes;
+  };
+
+  void EraseLocked(const Key &key) {
+    auto it = index_.find(key);
+    if (it == index_.end())
+      return;
+    bytes_ -= it->second->bytes;
+    entries_.erase(it->second);
+    index_.erase(it);
+  }
+
+  void EvictLocked() {
+    while (bytes_ > budget_bytes_ && !entries_.empty()) {
+      bytes_ -= entries_.back().bytes;
+      index_.erase(entries_.back().key);
+      entries_.pop_back();
+    }
+  }
+
+  mutable std::mutex mutex_;
+  size_t budget_bytes_;
+  size_t bytes_ = 0;
+  // Most recently used at the front.
+  std::list<Entry> entries_;
+  std::map<Key, typename std::list<Entry>::iterator> index_;
+};
+#endif // LRU_CACHE_
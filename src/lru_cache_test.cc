@@ -0,0 +1,71 @@
+#include "lru_cache.h"
+
+#include <string>
+
+#include "gtest/gtest.h"
+
+TEST(LruCache, ReturnsStoredValues) {
+  LruCache<int, std::string> cache(100);
+  cache.Put(1, "one", 10);
+  cache.Put(2, "two", 10);
+
+  std::string value;
+  ASSERT_TRUE(cache.Get(1, &value));
+  EXPECT_EQ("one", value);
+  ASSERT_TRUE(cache.Get(2, &value));
+  EXPECT_EQ("two", value);
+  EXPECT_FALSE(cache.Get(3, &value));
+  EXPECT_EQ(20u, cache.bytes());
+}
+
+TEST(LruCache, EvictsLeastRecentlyUsedFirst) {
+  LruCache<int, std::string> cache(30);
+  cache.Put(1, "one", 10);
+  cache.Put(2, "two", 10);
+  cache.Put(3, "three", 10);
+
+  // Touch 1 so that 2 becomes the oldest.
+  std::string value;
+  ASSERT_TRUE(cache.Get(1, &value));
+  cache.Put(4, "four", 10);
+
+  EXPECT_TRUE(cache.Get(1, &value));
+  EXPECT_FALSE(cache.Get(2, &value));
+  EXPECT_TRUE(cache.Get(3, &value));
+  EXPECT_TRUE(cache.Get(4, &value));
+  EXPECT_EQ(30u, cache.bytes());
+}
+
+TEST(LruCache, ReplacingAnEntryUpdatesSize) {
+  LruCache<int, std::string> cache(100);
+  cache.Put(1, "one", 10);
+  cache.Put(1, "uno", 25);
+
+  std::string value;
+  ASSERT_TRUE(cache.Get(1, &value));
+  EXPECT_EQ("uno", value);
+  EXPECT_EQ(25u, cache.bytes());
+  EXPECT_EQ(1u, cache.size());
+}
+
+TEST(LruCache, SkipsEntriesLargerThanBudget) {
+  LruCache<int, std::string> cache(10);
+  cache.Put(1, "one", 5);
+  cache.Put(2, "huge", 11);
+
+  std::string value;
+  EXPECT_TRUE(cache.Get(1, &value));
+  EXPECT_FALSE(cache.Get(2, &value));
+}
+
+TEST(LruCache, ShrinkingBudgetEvicts) {
+  LruCache<int, std::string> cache(100);
+  cache.Put(1, "one", 40);
+  cache.Put(2, "two", 40);
+  cache.SetBudget(50);
+
+  std::string value;
+  EXPECT_FALSE(cache.Get(1, &value));
+  EXPECT_TRUE(cache.Get(2, &value));
+  EXPECT_EQ(40u, cache.bytes());
+}
@@ -9,9 +9,11 @@
 #include <QtWidgets/QMenuBar>
 #include <QtWidgets/QSlider>
 #include <QtWidgets/QVBoxLayout>
+#include <algorithm>
 #include <chrono>
 #include <fstream>
 #include <iostream>
+#include <thread>
 
 #include "editor.h"
 #include "min_max_pyramid.h"
@@ -22,20 +24,30 @@ cv::Mat display_image;
 std::string window_title;
 
 int main(int argc, char **argv) {
-  MinMaxPyramid pyramid;
+  // Only upsample the layers the user actually looks at; big panoramas would
+  // otherwise need several GB just to open.
+  MinMaxPyramid::Options options;
+  options.lazy_layers = true;
+  // Opening an image is the one wait the user can't avoid, so throw every core
+  // at it.
+  options.threads = std::max(1u, std::thread::hardware_concurrency());
+  MinMaxPyramid pyramid(options);
   QApplication app(argc, argv);
   Editor editor(&pyramid);
 
   // If we have arguments, process in batch mode; otherwise, interactive.
   if (argc == 3) {
     if (!editor.runAsBatch(argv[1], argv[2])) {
-      std::cerr << "Failed to inialize; bad batch arguments?\n\n";
+      std::cerr << "Couldn't decode " << argv[1]
+                << " (or its pixel depth isn't supported)\n";
       return 1;
     }
   }
 
   if (argc == 2) {
-    std::cerr << "Batch usage: undersee <input_filename> <output_filename>\n\n";
+    std::cerr << "Batch usage: undersee <input_filename> <output_filename>\n"
+              << "For whole directories without a display, see //src:batch."
+              << "\n\n";
   }
   editor.show();
   return app.exec();
@@ -1,13 +1,26 @@
 #include "min_max_pyramid.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <limits>
+#include <vector>
+
+#include "parallel_for.h"
+#include "relevel_kernel.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 using uchar = unsigned char;
 
-// Note: we could compute max and min for the first level in one pass, but after
-// that the source images are different. Might be worth special-casing anyway as
-// the base image is the largest we handle.
+// Generic (and slow) version, kept around as the reference implementation for
+// the fused kernel below.
 cv::Mat Downsample(const cv::Mat input, std::function<uchar(uchar, uchar)> fn) {
   // Pad dimensions, but only if the size of the input is odd.
   // I.e., 3- or 4-pixel wide input will map to 2 pixel output.
@@ -66,80 +79,1033 @@ cv::Mat Downsample(const cv::Mat input, std::function<uchar(uchar, uchar)> fn) {
   return output;
 }
 
+namespace {
+
+// The fused kernel works on one pair of input rows at a time, in three steps:
+//   1. Vertical: min/max of the two rows, value by value.
+//   2. Horizontal: min/max of each value with the one a pixel to its right.
+//      After this, every even pixel holds the result for its 2x2 block.
+//   3. Compact: copy the even pixels into the output row.
+// Steps 1 and 2 don't care about pixel boundaries, so they run over the raw
+// interleaved channel values at full vector width (pminub/pmaxub for 8 bits,
+// and the equivalents for 16-bit and float values). Step 3 is a plain copy.
+//
+// Odd dimensions fall out naturally: an odd last row is paired with itself,
+// and an odd last column has no right-hand neighbour, so step 2 leaves it
+// alone.
+//
+// Single-channel 8-bit rows (grayscale images) do steps 2 and 3 together
+// instead, a whole vector of pixel pairs at a time.
+
+// Vector min/max for each pixel type. Everything is passed around as integer
+// registers (floats are cast in and out) so that one loop serves all of them.
+template <typename T> struct SimdMinMax;
+
+#if defined(__SSE2__)
+template <> struct SimdMinMax<uchar> {
+  static __m128i Min(__m128i a, __m128i b) { return _mm_min_epu8(a, b); }
+  static __m128i Max(__m128i a, __m128i b) { return _mm_max_epu8(a, b); }
+#if defined(__AVX2__)
+  static __m256i Min(__m256i a, __m256i b) { return _mm256_min_epu8(a, b); }
+  static __m256i Max(__m256i a, __m256i b) { return _mm256_max_epu8(a, b); }
+#endif
+};
+
+template <> struct SimdMinMax<uint16_t> {
+  // SSE2 only has signed 16-bit min and max, but saturating subtraction gets
+  // the unsigned ones: a - (a -sat b) is min(a, b), b + (a -sat b) is max.
+  static __m128i Min(__m128i a, __m128i b) {
+    return _mm_sub_epi16(a, _mm_subs_epu16(a, b));
+  }
+  static __m128i Max(__m128i a, __m128i b) {
+    return _mm_add_epi16(b, _mm_subs_epu16(a, b));
+  }
+#if defined(__AVX2__)
+  static __m256i Min(__m256i a, __m256i b) { return _mm256_min_epu16(a, b); }
+  static __m256i Max(__m256i a, __m256i b) { return _mm256_max_epu16(a, b); }
+#endif
+};
+
+template <> struct SimdMinMax<float> {
+  static __m128i Min(__m128i a, __m128i b) {
+    return _mm_castps_si128(
+        _mm_min_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+  }
+  static __m128i Max(__m128i a, __m128i b) {
+    return _mm_castps_si128(
+        _mm_max_ps(_mm_castsi128_ps(a), _mm_castsi128_ps(b)));
+  }
+#if defined(__AVX2__)
+  static __m256i Min(__m256i a, __m256i b) {
+    return _mm256_castps_si256(
+        _mm256_min_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b)));
+  }
+  static __m256i Max(__m256i a, __m256i b) {
+    return _mm256_castps_si256(
+        _mm256_max_ps(_mm256_castsi256_ps(a), _mm256_castsi256_ps(b)));
+  }
+#endif
+};
+#endif
+
+// out[i] = min(a[i], b[i]), or max if kMax, for n values. `out` may be `a`:
+// each step only reads values that haven't been written yet, so this is safe
+// to run front to back in place, even when b is a few values ahead of a.
+template <typename T, bool kMax>
+void Combine(const T *a, const T *b, T *out, int n) {
+  int i = 0;
+#if defined(__AVX2__)
+  for (; i + static_cast<int>(32 / sizeof(T)) <= n; i += 32 / sizeof(T)) {
+    const __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+    const __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+    _mm256_storeu_si256((__m256i *)(out + i),
+                        kMax ? SimdMinMax<T>::Max(va, vb)
+                             : SimdMinMax<T>::Min(va, vb));
+  }
+#endif
+#if defined(__SSE2__)
+  for (; i + static_cast<int>(16 / sizeof(T)) <= n; i += 16 / sizeof(T)) {
+    const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    _mm_storeu_si128((__m128i *)(out + i), kMax ? SimdMinMax<T>::Max(va, vb)
+                                                : SimdMinMax<T>::Min(va, vb));
+  }
+#endif
+  for (; i < n; i++)
+    out[i] = kMax ? std::max(a[i], b[i]) : std::min(a[i], b[i]);
+}
+
+// out_min[i] = min(min1[i], min2[i]), out_max[i] = max(max1[i], max2[i]).
+// Either output may be null, in which case its inputs are ignored.
+template <typename T>
+void VerticalMinMax(const T *min1, const T *min2, const T *max1,
+                    const T *max2, T *out_min, T *out_max, int n) {
+  if (out_min != nullptr)
+    Combine<T, false>(min1, min2, out_min, n);
+  if (out_max != nullptr)
+    Combine<T, true>(max1, max2, out_max, n);
+}
+
+// In place: row[i] = op(row[i], row[i + shift]) for all i where that exists.
+template <typename T>
+void HorizontalMinMax(T *row_min, T *row_max, int n, int shift) {
+  const int last = n - shift;
+  if (row_min != nullptr)
+    Combine<T, false>(row_min, row_min + shift, row_min, last);
+  if (row_max != nullptr)
+    Combine<T, true>(row_max, row_max + shift, row_max, last);
+}
+
+// Copies every other pixel of row into out.
+template <typename T>
+void CompactEvenPixels(const T *row, T *out, int out_cols, int cn) {
+  if (cn == 3) {
+    // Worth special-casing: with a constant pixel size the compiler turns this
+    // into something much better than a memcpy per pixel.
+    for (int col = 0; col < out_cols; col++, row += 6, out += 3) {
+      out[0] = row[0];
+      out[1] = row[1];
+      out[2] = row[2];
+    }
+    return;
+  }
+  for (int col = 0; col < out_cols; col++, row += 2 * cn, out += cn)
+    std::copy(row, row + cn, out);
+}
+
+// Steps 2 and 3: from the scratch rows, `cols` pixels wide, into the output
+// rows. Either pair may be null.
+template <typename T>
+void HorizontalCompact(T *row_min, T *row_max, T *out_min, T *out_max,
+                       int cols, int cn) {
+  HorizontalMinMax(row_min, row_max, cols * cn, cn);
+  if (row_min != nullptr)
+    CompactEvenPixels(row_min, out_min, (cols + 1) / 2, cn);
+  if (row_max != nullptr)
+    CompactEvenPixels(row_max, out_max, (cols + 1) / 2, cn);
+}
+
+// out[i] = min(row[2 * i], row[2 * i + 1]), or max if kMax, with an odd last
+// pixel copied as it is. Each pair of pixels is one 16-bit lane, so masking
+// and shifting the lanes splits a vector into its even and odd pixels, and
+// packing them back down leaves the results in order.
+template <bool kMax>
+void PairwiseMinMax8(const uchar *row, uchar *out, int cols) {
+  const int pairs = cols / 2;
+  int i = 0;
+#if defined(__AVX2__)
+  const __m256i low_bytes256 = _mm256_set1_epi16(0x00FF);
+  for (; i + 32 <= pairs; i += 32) {
+    const __m256i a = _mm256_loadu_si256((const __m256i *)(row + 2 * i));
+    const __m256i b =
+        _mm256_loadu_si256((const __m256i *)(row + 2 * i + 32));
+    const __m256i even = _mm256_packus_epi16(_mm256_and_si256(a, low_bytes256),
+                                             _mm256_and_si256(b, low_bytes256));
+    const __m256i odd =
+        _mm256_packus_epi16(_mm256_srli_epi16(a, 8), _mm256_srli_epi16(b, 8));
+    const __m256i result = kMax ? SimdMinMax<uchar>::Max(even, odd)
+                                : SimdMinMax<uchar>::Min(even, odd);
+    // Packing works within each 128-bit half, which leaves the quarters in
+    // the order a, b, a, b; put them back.
+    _mm256_storeu_si256((__m256i *)(out + i),
+                        _mm256_permute4x64_epi64(result, 0xD8));
+  }
+#endif
+#if defined(__SSE2__)
+  const __m128i low_bytes128 = _mm_set1_epi16(0x00FF);
+  for (; i + 16 <= pairs; i += 16) {
+    const __m128i a = _mm_loadu_si128((const __m128i *)(row + 2 * i));
+    const __m128i b = _mm_loadu_si128((const __m128i *)(row + 2 * i + 16));
+    const __m128i even = _mm_packus_epi16(_mm_and_si128(a, low_bytes128),
+                                          _mm_and_si128(b, low_bytes128));
+    const __m128i odd =
+        _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+    _mm_storeu_si128((__m128i *)(out + i),
+                     kMax ? SimdMinMax<uchar>::Max(even, odd)
+                          : SimdMinMax<uchar>::Min(even, odd));
+  }
+#endif
+  for (; i < pairs; i++) {
+    out[i] = kMax ? std::max(row[2 * i], row[2 * i + 1])
+                  : std::min(row[2 * i], row[2 * i + 1]);
+  }
+  if (cols % 2 != 0)
+    out[pairs] = row[cols - 1];
+}
+
+void HorizontalCompact(uchar *row_min, uchar *row_max, uchar *out_min,
+                       uchar *out_max, int cols, int cn) {
+  if (cn != 1) {
+    HorizontalCompact<uchar>(row_min, row_max, out_min, out_max, cols, cn);
+    return;
+  }
+  if (row_min != nullptr)
+    PairwiseMinMax8<false>(row_min, out_min, cols);
+  if (row_max != nullptr)
+    PairwiseMinMax8<true>(row_max, out_max, cols);
+}
+
+// Below this much input per band, splitting a level across threads costs more
+// in thread startup than it saves.
+constexpr int kMinBandBytes = 256 << 10;
+
+// Output rows [begin, end) of DownsampleFused, for pixels of type T.
+template <typename T>
+void DownsampleRows(const cv::Mat *min_input, const cv::Mat *max_input,
+                    cv::Mat *min_output, cv::Mat *max_output, int begin,
+                    int end) {
+  const cv::Mat &any_input = min_input != nullptr ? *min_input : *max_input;
+  const int cn = any_input.channels();
+  const int row_len = any_input.cols * cn;
+
+  std::vector<T> scratch_min, scratch_max;
+  if (min_input != nullptr)
+    scratch_min.resize(row_len);
+  if (max_input != nullptr)
+    scratch_max.resize(row_len);
+  T *vmin = min_input != nullptr ? scratch_min.data() : nullptr;
+  T *vmax = max_input != nullptr ? scratch_max.data() : nullptr;
+
+  for (int row = begin; row < end; row++) {
+    // Pair an odd last row with itself; min(a, a) == a.
+    const int row1 = row * 2;
+    const int row2 = std::min(row1 + 1, any_input.rows - 1);
+    VerticalMinMax<T>(vmin ? min_input->ptr<T>(row1) : nullptr,
+                      vmin ? min_input->ptr<T>(row2) : nullptr,
+                      vmax ? max_input->ptr<T>(row1) : nullptr,
+                      vmax ? max_input->ptr<T>(row2) : nullptr, vmin, vmax,
+                      row_len);
+    HorizontalCompact(vmin, vmax, vmin ? min_output->ptr<T>(row) : nullptr,
+                      vmax ? max_output->ptr<T>(row) : nullptr,
+                      any_input.cols, cn);
+  }
+}
+
+// Shared implementation for DownsampleMin, DownsampleMax and DownsampleMinMax.
+// Inputs and outputs come in pairs; either pair may be null. Output rows are
+// independent of each other, so they're split into bands across threads.
+void DownsampleFused(const cv::Mat *min_input, const cv::Mat *max_input,
+                     cv::Mat *min_output, cv::Mat *max_output,
+                     int threads = 1) {
+  const cv::Mat &any_input = min_input != nullptr ? *min_input : *max_input;
+  const int depth = any_input.depth();
+  CV_Assert(depth == CV_8U || depth == CV_16U || depth == CV_32F);
+  CV_Assert(min_input == nullptr || max_input == nullptr ||
+            (min_input->size() == max_input->size() &&
+             min_input->type() == max_input->type()));
+
+  const int nRows = (any_input.rows + 1) / 2;
+  const int nCols = (any_input.cols + 1) / 2;
+  if (min_input != nullptr)
+    min_output->create(nRows, nCols, any_input.type());
+  if (max_input != nullptr)
+    max_output->create(nRows, nCols, any_input.type());
+
+  // Each output row reads two input rows, from each input.
+  const int row_bytes = static_cast<int>(any_input.cols * any_input.elemSize());
+  const int bytes_per_row = 2 * row_bytes * (min_input && max_input ? 2 : 1);
+  const int min_band = std::max(1, kMinBandBytes / bytes_per_row);
+  ParallelFor(nRows, threads, min_band, [&](int begin, int end) {
+    if (depth == CV_16U) {
+      DownsampleRows<uint16_t>(min_input, max_input, min_output, max_output,
+                               begin, end);
+    } else if (depth == CV_32F) {
+      DownsampleRows<float>(min_input, max_input, min_output, max_output,
+                            begin, end);
+    } else {
+      DownsampleRows<uchar>(min_input, max_input, min_output, max_output,
+                            begin, end);
+    }
+  });
+}
+
+// The sliding window filter, van Herk/Gil-Werman style. Along one axis of
+// length n, with window w = 2 * radius + 1, cut the axis into blocks of w
+// (starting `radius` before the first pixel), and keep two running results:
+//     g[i] = op of the block's values from its start up to i,
+//     h[i] = op of the block's values from i up to its end.
+// A window [s, e] covers the end of one block and the start of the next, so
+// its result is op(h[s], g[e]): three operations per value, whatever the
+// radius. Windows are clipped to [0, n), which the blocks handle for free,
+// apart from a clipped window that lies within a single block. That only
+// happens at the far end, where h[s] already covers it.
+struct WindowBlocks {
+  WindowBlocks(int n, int radius)
+      : n(n), radius(radius), width(2 * radius + 1) {}
+
+  bool StartsBlock(int i) const { return (i + radius) % width == 0; }
+  bool EndsBlock(int i) const {
+    return i == n - 1 || (i + 1 + radius) % width == 0;
+  }
+  // Where output i should look: h[*start] alone if `only_h`, otherwise
+  // op(h[*start], g[*end]).
+  void Window(int i, int *start, int *end, bool *only_h) const {
+    *start = std::max(i - radius, 0);
+    *end = std::min(i + radius, n - 1);
+    *only_h = *end == n - 1 &&
+              (*start + radius) / width == (*end + radius) / width;
+  }
+
+  int n;
+  int radius;
+  int width;
+};
+
+// One row of interleaved pixels, along the row. g and h are scratch space the
+// size of the row; `out` mustn't be `in`. Within a block, each value only
+// depends on the one a pixel before (or after), so the running results are
+// plain loops over values, and the windows that lie wholly inside the row
+// (nearly all of them) are one vectorized Combine.
+template <typename T, bool kMax>
+void SlidingRow(const T *in, int cols, int cn, const WindowBlocks &blocks,
+                T *g, T *h, T *out) {
+  auto op = [](T a, T b) { return kMax ? std::max(a, b) : std::min(a, b); };
+  for (int block = -blocks.radius; block < cols; block += blocks.width) {
+    const int begin = std::max(block, 0) * cn;
+    const int end = std::min(block + blocks.width, cols) * cn;
+    std::copy(in + begin, in + begin + cn, g + begin);
+    for (int i = begin + cn; i < end; i++)
+      g[i] = op(g[i - cn], in[i]);
+    std::copy(in + end - cn, in + end, h + end - cn);
+    for (int i = end - cn - 1; i >= begin; i--)
+      h[i] = op(h[i + cn], in[i]);
+  }
+
+  const int reach = blocks.radius * cn;
+  const int inner_begin = std::min(blocks.radius, cols);
+  const int inner_end = std::max(cols - blocks.radius, inner_begin);
+  if (inner_end > inner_begin) {
+    Combine<T, kMax>(h, g + 2 * reach, out + reach,
+                     (inner_end - inner_begin) * cn);
+  }
+  auto clipped = [&](int col) {
+    int start, end;
+    bool only_h;
+    blocks.Window(col, &start, &end, &only_h);
+    for (int c = 0; c < cn; c++) {
+      const T from_h = h[start * cn + c];
+      out[col * cn + c] = only_h ? from_h : op(from_h, g[end * cn + c]);
+    }
+  };
+  for (int col = 0; col < inner_begin; col++)
+    clipped(col);
+  for (int col = inner_end; col < cols; col++)
+    clipped(col);
+}
+
+// The same down the columns [begin, begin + len) of `image` (as values, not
+// pixels), in place. Here each step works on a whole run of values at once,
+// so it vectorizes just like the pyramid's downsampling. g and h hold
+// image.rows * len values each.
+template <typename T, bool kMax>
+void SlidingColumns(cv::Mat *image, int begin, int len,
+                    const WindowBlocks &blocks, T *g, T *h) {
+  const int rows = image->rows;
+  for (int row = 0; row < rows; row++) {
+    const T *in = image->ptr<T>(row) + begin;
+    T *g_row = g + static_cast<size_t>(row) * len;
+    if (row == 0 || blocks.StartsBlock(row))
+      std::copy(in, in + len, g_row);
+    else
+      Combine<T, kMax>(g_row - len, in, g_row, len);
+  }
+  for (int row = rows - 1; row >= 0; row--) {
+    const T *in = image->ptr<T>(row) + begin;
+    T *h_row = h + static_cast<size_t>(row) * len;
+    if (blocks.EndsBlock(row))
+      std::copy(in, in + len, h_row);
+    else
+      Combine<T, kMax>(h_row + len, in, h_row, len);
+  }
+  for (int row = 0; row < rows; row++) {
+    int start, end;
+    bool only_h;
+    blocks.Window(row, &start, &end, &only_h);
+    const T *from_h = h + static_cast<size_t>(start) * len;
+    T *out = image->ptr<T>(row) + begin;
+    if (only_h)
+      std::copy(from_h, from_h + len, out);
+    else
+      Combine<T, kMax>(from_h, g + static_cast<size_t>(end) * len, out, len);
+  }
+}
+
+// Columns are done in bands of this many bytes, which bounds the scratch
+// space to a few bands' worth of the image rather than all of it.
+constexpr int kColumnBandBytes = 1024;
+
+template <typename T>
+void SlidingMinMaxOf(const cv::Mat &input, int radius, cv::Mat *min_output,
+                     cv::Mat *max_output, int threads) {
+  const int cn = input.channels();
+  const int row_len = input.cols * cn;
+  const WindowBlocks across(input.cols, radius);
+  const WindowBlocks down(input.rows, radius);
+
+  // Along the rows, from the input into the outputs.
+  const int row_bytes = static_cast<int>(row_len * sizeof(T));
+  const int min_rows = std::max(1, kMinBandBytes / row_bytes);
+  ParallelFor(input.rows, threads, min_rows, [&](int begin, int end) {
+    std::vector<T> g(row_len), h(row_len);
+    for (int row = begin; row < end; row++) {
+      SlidingRow<T, false>(input.ptr<T>(row), input.cols, cn, across,
+                           g.data(), h.data(), min_output->ptr<T>(row));
+      SlidingRow<T, true>(input.ptr<T>(row), input.cols, cn, across,
+                          g.data(), h.data(), max_output->ptr<T>(row));
+    }
+  });
+
+  // Then down the columns of the outputs, in place.
+  const int band_len = static_cast<int>(kColumnBandBytes / sizeof(T));
+  const int bands = (row_len + band_len - 1) / band_len;
+  const int min_bands =
+      std::max(1, kMinBandBytes / (kColumnBandBytes * input.rows));
+  ParallelFor(bands, threads, min_bands, [&](int begin, int end) {
+    const size_t scratch = static_cast<size_t>(input.rows) * band_len;
+    std::vector<T> g(scratch), h(scratch);
+    for (int band = begin; band < end; band++) {
+      const int first = band * band_len;
+      const int len = std::min(band_len, row_len - first);
+      SlidingColumns<T, false>(min_output, first, len, down, g.data(),
+                               h.data());
+      SlidingColumns<T, true>(max_output, first, len, down, g.data(),
+                              h.data());
+    }
+  });
+}
+
+} // namespace
+
 cv::Mat DownsampleMax(cv::Mat input) {
-  return Downsample(input, [](uchar a, uchar b) { return a > b ? a : b; });
+  cv::Mat output;
+  DownsampleFused(nullptr, &input, nullptr, &output);
+  return output;
 }
 
 cv::Mat DownsampleMin(cv::Mat input) {
-  return Downsample(input, [](uchar a, uchar b) { return a < b ? a : b; });
+  cv::Mat output;
+  DownsampleFused(&input, nullptr, &output, nullptr);
+  return output;
+}
+
+void DownsampleMinMax(const cv::Mat min_input, const cv::Mat max_input,
+                      cv::Mat *min_output, cv::Mat *max_output, int threads) {
+  DownsampleFused(&min_input, &max_input, min_output, max_output, threads);
+}
+
+void SlidingMinMax(const cv::Mat input, int radius, cv::Mat *min_output,
+                   cv::Mat *max_output, int threads) {
+  const int depth = input.depth();
+  CV_Assert(depth == CV_8U || depth == CV_16U || depth == CV_32F);
+  CV_Assert(radius >= 0 && !input.empty());
+  // Fresh outputs, since they're written before the input is done with.
+  *min_output = cv::Mat(input.size(), input.type());
+  *max_output = cv::Mat(input.size(), input.type());
+  if (depth == CV_16U)
+    SlidingMinMaxOf<uint16_t>(input, radius, min_output, max_output, threads);
+  else if (depth == CV_32F)
+    SlidingMinMaxOf<float>(input, radius, min_output, max_output, threads);
+  else
+    SlidingMinMaxOf<uchar>(input, radius, min_output, max_output, threads);
+}
+
+namespace {
+
+// Measures wall time since construction, for Stats. When stats are off it
+// doesn't even read the clock.
+class StageTimer {
+public:
+  explicit StageTimer(bool enabled) {
+    if (enabled)
+      start_ = std::chrono::steady_clock::now();
+  }
+
+  double Seconds() const {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start_)
+        .count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start_;
+};
+
+size_t MatBytes(const cv::Mat &mat) { return mat.total() * mat.elemSize(); }
+
+// Builds the min and max pyramids of `image`, from half size up to and
+// including max_layer.
+void BuildLevels(const cv::Mat &image, int max_layer, int threads,
+                 std::vector<cv::Mat> *min_levels,
+                 std::vector<cv::Mat> *max_levels) {
+  cv::Mat min_level, max_level;
+  // The base level reads the input once for both min and max.
+  DownsampleMinMax(image, image, &min_level, &max_level, threads);
+  min_levels->push_back(min_level);
+  max_levels->push_back(max_level);
+
+  for (int i = 1; i <= max_layer; i++) {
+    // Fresh Mats each time, since the previous ones are now owned by the
+    // vectors.
+    cv::Mat next_min, next_max;
+    DownsampleMinMax(min_levels->back(), max_levels->back(), &next_min,
+                     &next_max, threads);
+    min_levels->push_back(next_min);
+    max_levels->push_back(next_max);
+  }
+}
+
+// The mean of max_level - min_level, per channel.
+cv::Scalar MeanRange(const cv::Mat &min_level, const cv::Mat &max_level) {
+  cv::Mat range;
+  cv::subtract(max_level, min_level, range, cv::noArray(), CV_32F);
+  return cv::mean(range);
+}
+
+} // namespace
+
+MinMaxPyramid::MinMaxPyramid(const Options &options)
+    : options_(options),
+      // The budget only applies in lazy mode; eager mode has to hold
+      // everything.
+      layer_cache_(options.lazy_layers ? options.layer_cache_bytes
+                                       : std::numeric_limits<size_t>::max()),
+      preview_sources_(64 << 20) {}
+
+bool MinMaxPyramid::SupportsDepth(int depth) {
+  return depth == CV_8U || depth == CV_16U || depth == CV_32F;
+}
+
+void MinMaxPyramid::ScaleRange(cv::Size image_size, int *min_scale,
+                               int *max_scale) {
+  // The top of the pyramid is the first level that's down to a single pixel.
+  // Capped to allow for ridiculously large images, without allowing total
+  // runaway if something goes wrong.
+  int cols = (image_size.width + 1) / 2;
+  int rows = (image_size.height + 1) / 2;
+  *max_scale = 0;
+  while (*max_scale < 49 && (rows >= 2 || cols >= 2)) {
+    cols = (cols + 1) / 2;
+    rows = (rows + 1) / 2;
+    ++*max_scale;
+  }
+
+  // For very small images, make sure there are still some levels available.
+  // This is mostly for testing.
+  *min_scale = std::min(
+      4 /*normal min level*/,
+      std::max(0,
+               static_cast<int>(std::floor(std::log2(image_size.height)) - 4)));
 }
 
 void MinMaxPyramid::PreProcess(cv::Mat input) {
+  const StageTimer timer(options_.collect_stats);
   image_ = input;
 
   // Clear out any previous state
-  min_images_.clear();
-  max_images_.clear();
-  max_layer_ = 50;
-
-  std::vector<cv::Mat> min_pyramid;
-  std::vector<cv::Mat> max_pyramid;
-  min_pyramid.push_back(DownsampleMin(input));
-  max_pyramid.push_back(DownsampleMax(input));
-
-  for (int i = 1; i < max_layer_; i++) {
-    if (min_pyramid.back().rows < 2 && min_pyramid.back().cols < 2) {
-      max_layer_ = i - 1;
-      break;
+  min_pyramid_.clear();
+  max_pyramid_.clear();
+  layer_cache_.Clear();
+  preview_sources_.Clear();
+  storage_.reset();
+  ScaleRange(input.size(), &min_layer_, &max_layer_);
+  // Sliding windows work straight off the image; there's nothing to build.
+  if (options_.engine == Engine::kSlidingWindow) {
+    UpdateStats([](Stats *stats) { stats->preprocess_calls++; });
+    UpdateMemoryStats();
+    return;
+  }
+
+  BuildLevels(input, max_layer_, options_.threads, &min_pyramid_,
+              &max_pyramid_);
+
+  UpdateStats([&](Stats *stats) {
+    stats->preprocess_calls++;
+    stats->downsample_seconds += timer.Seconds();
+  });
+  UpdateMemoryStats();
+
+  // The fused path never needs full-resolution layers.
+  if (!UsesLayers() || options_.lazy_layers)
+    return;
+
+  // Eager mode: upsample every layer now, so that Relevel never has to wait.
+  UpsampleAllLayers();
+}
+
+void MinMaxPyramid::SetEngine(Engine engine) {
+  if (options_.engine == engine)
+    return;
+  options_.engine = engine;
+  if (image_.empty())
+    return;
+  // The image may live in a mapped cache file, which PreProcess would
+  // otherwise let go of.
+  const std::shared_ptr<const void> storage = storage_;
+  PreProcess(image_);
+  storage_ = storage;
+}
+
+int MinMaxPyramid::EstimateScale(float min_range) const {
+  CV_Assert(!image_.empty());
+  // The sliding-window engine keeps no levels, so build some for the
+  // occasion. That reads the whole image once, like PreProcess would have.
+  std::vector<cv::Mat> built_min, built_max;
+  if (min_pyramid_.empty()) {
+    BuildLevels(image_, max_layer_, options_.threads, &built_min,
+                &built_max);
+  }
+  const std::vector<cv::Mat> &min_levels =
+      min_pyramid_.empty() ? built_min : min_pyramid_;
+  const std::vector<cv::Mat> &max_levels =
+      max_pyramid_.empty() ? built_max : max_pyramid_;
+
+  // The top level is a single pixel, holding the whole image's range.
+  const cv::Scalar whole = MeanRange(min_levels[max_layer_],
+                                     max_levels[max_layer_]);
+  const int channels = std::min(image_.channels(), 4);
+  // A level's pixels each cover more of the image than those of the level
+  // below, so their range can only be as wide or wider: the mean range only
+  // grows with scale. Walk down until it gets too narrow.
+  int scale = max_layer_;
+  for (int level = max_layer_ - 1; level >= min_layer_; level--) {
+    const cv::Scalar local = MeanRange(min_levels[level], max_levels[level]);
+    for (int c = 0; c < channels; c++) {
+      // Flat channels come out flat at any scale, so they don't get a say.
+      if (whole[c] > 0 && local[c] < min_range * whole[c])
+        return scale;
     }
-    min_pyramid.push_back(DownsampleMin(min_pyramid.back()));
-    max_pyramid.push_back(DownsampleMax(max_pyramid.back()));
+    scale = level;
   }
+  return scale;
+}
 
-  // For very small images, make sure there are still some levels available.
-  // This is mostly for testing.
-  min_layer_ = std::min(
-      4 /*normal min level*/,
-      std::max(0, static_cast<int>(std::floor(std::log2(image_.rows)) - 4)));
+bool MinMaxPyramid::SaveCache(const std::string &path,
+                              const PyramidCacheKey &key) const {
+  PyramidData data;
+  return CacheData(&data) && WritePyramidCache(path, key, data);
+}
 
-  // Now upsample again. The interpolation blurs the min and max images so that
-  // the final transformation doesn't have hard edges.
-  for (int layer = min_layer_; layer <= max_layer_; layer++) {
-    cv::Mat min_image(image_.rows, image_.cols, CV_8UC3);
-    cv::Mat max_image(image_.rows, image_.cols, CV_8UC3);
+bool MinMaxPyramid::CacheData(PyramidData *data) const {
+  // Without a pyramid, a cache file would only be a slow copy of the image.
+  if (options_.engine == Engine::kSlidingWindow || image_.empty())
+    return false;
+  data->image = image_;
+  data->min_levels = min_pyramid_;
+  data->max_levels = max_pyramid_;
+  data->min_scale = min_layer_;
+  data->max_scale = max_layer_;
+  // If it came from a cache file in the first place, that has to stay mapped.
+  data->storage = storage_;
+  return true;
+}
 
-    cv::resize(min_pyramid[layer], min_image, min_image.size(), 0, 0,
-               cv::INTER_LINEAR);
-    cv::resize(max_pyramid[layer], max_image, max_image.size(), 0, 0,
-               cv::INTER_LINEAR);
+bool MinMaxPyramid::LoadCache(const std::string &path,
+                              const PyramidCacheKey &key) {
+  PyramidData data;
+  if (!MapPyramidCache(path, key, &data)) {
+    UpdateStats([](Stats *stats) { stats->disk_cache_misses++; });
+    return false;
+  }
+  UpdateStats([](Stats *stats) { stats->disk_cache_hits++; });
+  Adopt(data);
+  return true;
+}
+
+void MinMaxPyramid::Adopt(const PyramidData &data) {
+  CV_Assert(!data.image.empty() &&
+            data.min_levels.size() == data.max_levels.size() &&
+            0 <= data.min_scale && data.min_scale <= data.max_scale &&
+            data.max_scale < static_cast<int>(data.min_levels.size()));
+  image_ = data.image;
+  min_pyramid_ = data.min_levels;
+  max_pyramid_ = data.max_levels;
+  min_layer_ = data.min_scale;
+  max_layer_ = data.max_scale;
+  layer_cache_.Clear();
+  preview_sources_.Clear();
+  storage_ = data.storage;
+  UpdateMemoryStats();
 
-    min_images_.push_back(min_image);
-    max_images_.push_back(max_image);
+  // Same as the end of PreProcess.
+  if (UsesLayers() && !options_.lazy_layers)
+    UpsampleAllLayers();
+}
+
+MinMaxPyramid::Layer MinMaxPyramid::GetLayer(int scale) const {
+  Layer layer;
+  if (layer_cache_.Get(scale, &layer)) {
+    UpdateStats([](Stats *stats) { stats->layer_cache_hits++; });
+    return layer;
   }
+  const StageTimer timer(options_.collect_stats);
+
+  // Upsample the pyramid level back to full size. The interpolation blurs the
+  // min and max images so that the final transformation doesn't have hard
+  // edges.
+  // (UpsampleLinear rather than cv::resize so that we interpolate exactly the
+  // same way as the fused path.)
+  layer.min = UpsampleLinear(min_pyramid_[scale], image_.size());
+  layer.max = UpsampleLinear(max_pyramid_[scale], image_.size());
+
+  layer_cache_.Put(scale, layer, MatBytes(layer.min) + MatBytes(layer.max));
+  UpdateStats([&](Stats *stats) {
+    stats->layer_cache_misses++;
+    stats->upsample_seconds += timer.Seconds();
+  });
+  UpdateMemoryStats();
+  return layer;
+}
+
+void MinMaxPyramid::UpsampleAllLayers() const {
+  // Layers don't depend on each other, and they're all the same size, so each
+  // thread just takes a share of them.
+  ParallelFor(max_layer_ - min_layer_ + 1, options_.threads, 1,
+              [this](int begin, int end) {
+                for (int layer = begin; layer < end; layer++)
+                  GetLayer(min_layer_ + layer);
+              });
 }
 
-cv::Mat MinMaxPyramid::Relevel(int scale) const {
-  if (scale < min_layer_ || scale > max_layer_)
-    return image_;
-  cv::Mat output(image_.rows, image_.cols, CV_8UC3);
+size_t MinMaxPyramid::LayerCacheBytes() const { return layer_cache_.bytes(); }
+
+void MinMaxPyramid::UpdateMemoryStats() const {
+  UpdateStats([this](Stats *stats) {
+    stats->level_bytes.clear();
+    size_t bytes = layer_cache_.bytes();
+    for (size_t i = 0; i < min_pyramid_.size(); i++) {
+      stats->level_bytes.push_back(MatBytes(min_pyramid_[i]) +
+                                   MatBytes(max_pyramid_[i]));
+      bytes += stats->level_bytes.back();
+    }
+    stats->held_bytes = bytes;
+    stats->peak_held_bytes = std::max(stats->peak_held_bytes, bytes);
+  });
+}
 
-  const cv::Mat max_img = max_images_[scale - min_layer_];
-  const cv::Mat min_img = min_images_[scale - min_layer_];
+MinMaxPyramid::Stats MinMaxPyramid::GetStats() const {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  return stats_;
+}
+
+void MinMaxPyramid::ResetStats() {
+  std::lock_guard<std::mutex> lock(stats_mutex_);
+  // The level sizes and held bytes describe the current pyramid rather than
+  // counting anything, so they carry over.
+  Stats fresh;
+  fresh.level_bytes = stats_.level_bytes;
+  fresh.held_bytes = fresh.peak_held_bytes = stats_.held_bytes;
+  stats_ = fresh;
+}
+
+void MinMaxPyramid::Stats::Add(const Stats &other) {
+  preprocess_calls += other.preprocess_calls;
+  downsample_seconds += other.downsample_seconds;
+  upsample_seconds += other.upsample_seconds;
+  relevel_calls += other.relevel_calls;
+  relevel_seconds += other.relevel_seconds;
+  if (level_bytes.size() < other.level_bytes.size())
+    level_bytes.resize(other.level_bytes.size());
+  for (size_t i = 0; i < other.level_bytes.size(); i++)
+    level_bytes[i] += other.level_bytes[i];
+  held_bytes += other.held_bytes;
+  peak_held_bytes += other.peak_held_bytes;
+  layer_cache_hits += other.layer_cache_hits;
+  layer_cache_misses += other.layer_cache_misses;
+  preview_cache_hits += other.preview_cache_hits;
+  preview_cache_misses += other.preview_cache_misses;
+  disk_cache_hits += other.disk_cache_hits;
+  disk_cache_misses += other.disk_cache_misses;
+}
+
+std::string MinMaxPyramid::Stats::Summary() const {
+  char summary[256];
+  snprintf(summary, sizeof(summary),
+           "pyramid %d x %.1f ms, upsample %.1f ms, relevel %d x %.1f ms; "
+           "%.1f MB held (peak %.1f MB); hits: layers %zu/%zu, "
+           "previews %zu/%zu, disk %zu/%zu",
+           preprocess_calls,
+           preprocess_calls > 0 ? downsample_seconds * 1e3 / preprocess_calls
+                                : 0.0,
+           upsample_seconds * 1e3, relevel_calls,
+           relevel_calls > 0 ? relevel_seconds * 1e3 / relevel_calls : 0.0,
+           held_bytes / 1e6, peak_held_bytes / 1e6, layer_cache_hits,
+           layer_cache_hits + layer_cache_misses, preview_cache_hits,
+           preview_cache_hits + preview_cache_misses, disk_cache_hits,
+           disk_cache_hits + disk_cache_misses);
+  return summary;
+}
+
+namespace {
+
+// Splits a fractional scale into the level at or below it, and how much of the
+// next level up to blend in, out of 256.
+void SplitScale(float scale, int *level, int *weight) {
+  *level = static_cast<int>(std::floor(scale));
+  *weight = cvRound((scale - *level) * 256);
+  if (*weight == 256) {
+    ++*level;
+    *weight = 0;
+  }
+}
+
+} // namespace
+
+cv::Mat MinMaxPyramid::Relevel(float scale) const {
+  // A mapped image only lives as long as this pyramid holds on to the mapping,
+  // so callers get a copy of it instead.
+  if (!InRange(scale))
+    return storage_ ? image_.clone() : image_;
+  cv::Mat result;
+  Relevel(scale, &result);
+  return result;
+}
+
+void MinMaxPyramid::Relevel(float scale, cv::Mat *output) const {
+  const StageTimer timer(options_.collect_stats);
+  // Never write over the original; it may have been handed out as a result.
+  if (output->data == image_.data)
+    output->release();
+
+  const cv::Rect all(0, 0, image_.cols, image_.rows);
+  if (!InRange(scale))
+    image_.copyTo(*output);
+  else if (options_.engine == Engine::kSlidingWindow)
+    *output = RelevelSliding(image_, std::exp2(scale), all);
+  else if (UsesLayers())
+    *output = RelevelLayered(scale, all);
+  else
+    RelevelFusedAt(image_, scale, all, output);
+
+  UpdateStats([&](Stats *stats) {
+    stats->relevel_calls++;
+    stats->relevel_seconds += timer.Seconds();
+  });
+}
+
+cv::Mat MinMaxPyramid::Relevel(float scale, cv::Rect roi) const {
+  const StageTimer timer(options_.collect_stats);
+  roi &= cv::Rect(0, 0, image_.cols, image_.rows);
+  if (roi.empty())
+    return cv::Mat();
+  if (!InRange(scale))
+    return image_(roi).clone();
+
+  cv::Mat result;
+  if (options_.engine == Engine::kSlidingWindow)
+    result = RelevelSliding(image_, std::exp2(scale), roi);
+  else if (UsesLayers())
+    result = RelevelLayered(scale, roi);
+  else
+    RelevelFusedAt(image_, scale, roi, &result);
+  UpdateStats([&](Stats *stats) {
+    stats->relevel_calls++;
+    stats->relevel_seconds += timer.Seconds();
+  });
+  return result;
+}
+
+void MinMaxPyramid::RelevelFusedAt(const cv::Mat &image, float scale,
+                                   cv::Rect roi, cv::Mat *output) const {
+  int level, weight;
+  SplitScale(scale, &level, &weight);
+  if (weight == 0) {
+    RelevelFusedRegion(image, roi, min_pyramid_[level], max_pyramid_[level],
+                       cv::Mat(), cv::Mat(), 0, output);
+    return;
+  }
+  RelevelFusedRegion(image, roi, min_pyramid_[level], max_pyramid_[level],
+                     min_pyramid_[level + 1], max_pyramid_[level + 1], weight,
+                     output);
+}
+
+cv::Size MinMaxPyramid::PreviewSize(cv::Size target) const {
+  if (target.width >= image_.cols && target.height >= image_.rows)
+    return image_.size();
+  return cv::Size(std::max(1, std::min(target.width, image_.cols)),
+                  std::max(1, std::min(target.height, image_.rows)));
+}
+
+cv::Mat MinMaxPyramid::PreviewSource(cv::Size size) const {
+  cv::Mat source;
+  const std::pair<int, int> key(size.width, size.height);
+  const bool hit = preview_sources_.Get(key, &source);
+  UpdateStats([hit](Stats *stats) {
+    (hit ? stats->preview_cache_hits : stats->preview_cache_misses)++;
+  });
+  if (!hit) {
+    // INTER_AREA averages rather than skipping pixels, so fine detail doesn't
+    // alias.
+    cv::resize(image_, source, size, 0, 0, cv::INTER_AREA);
+    preview_sources_.Put(key, source, source.total() * source.elemSize());
+  }
+  return source;
+}
+
+cv::Mat MinMaxPyramid::RelevelPreview(float scale, cv::Size target) const {
+  const cv::Size size = PreviewSize(target);
+  if (size == image_.size())
+    return Relevel(scale);
+  return RelevelPreview(scale, target, cv::Rect(cv::Point(0, 0), size));
+}
+
+cv::Mat MinMaxPyramid::RelevelPreview(float scale, cv::Size target,
+                                      cv::Rect roi) const {
+  const cv::Size size = PreviewSize(target);
+  if (size == image_.size())
+    return Relevel(scale, roi);
+  const StageTimer timer(options_.collect_stats);
+  roi &= cv::Rect(0, 0, size.width, size.height);
+  if (roi.empty())
+    return cv::Mat();
+  const cv::Mat source = PreviewSource(size);
+  if (!InRange(scale))
+    return source(roi).clone();
+
+  // The fused kernel stretches the pyramid levels over whatever image it's
+  // given, so at this point there's nothing preview-specific left to do.
+  // Sliding windows, on the other hand, are measured in pixels of whatever
+  // they're run on, so they shrink along with the image.
+  cv::Mat result;
+  if (options_.engine == Engine::kSlidingWindow) {
+    result = RelevelSliding(
+        source, std::exp2(scale) * size.width / image_.cols, roi);
+  } else {
+    RelevelFusedAt(source, scale, roi, &result);
+  }
+  UpdateStats([&](Stats *stats) {
+    stats->relevel_calls++;
+    stats->relevel_seconds += timer.Seconds();
+  });
+  return result;
+}
+
+std::vector<cv::Mat> MinMaxPyramid::RelevelStrip(cv::Size target) const {
+  std::vector<cv::Mat> strip(max_layer_ - min_layer_ + 1);
+  // Make the shared source once up front, rather than have every thread
+  // miss the cache and make its own.
+  const cv::Size size = PreviewSize(target);
+  if (size != image_.size())
+    PreviewSource(size);
+  ParallelFor(static_cast<int>(strip.size()), options_.threads, 1,
+              [&](int begin, int end) {
+                for (int i = begin; i < end; i++)
+                  strip[i] = RelevelPreview(min_layer_ + i, target);
+              });
+  return strip;
+}
+
+cv::Mat MinMaxPyramid::RelevelLayered(float scale, cv::Rect roi) const {
+  int level, weight;
+  SplitScale(scale, &level, &weight);
+  Layer layer = GetLayer(level);
+  layer.min = layer.min(roi);
+  layer.max = layer.max(roi);
+  if (weight != 0) {
+    // Blend with the same arithmetic as the fused path, so the two agree.
+    const Layer above = GetLayer(level + 1);
+    layer.min = BlendImages(layer.min, above.min(roi), weight);
+    layer.max = BlendImages(layer.max, above.max(roi), weight);
+  }
+  return NormalizeAgainst(image_(roi), layer.min, layer.max);
+}
+
+cv::Mat MinMaxPyramid::RelevelSliding(const cv::Mat &image, float radius,
+                                      cv::Rect roi) const {
+  // A window of one pixel would make everything its own min and max.
+  const int r = std::max(1, cvRound(radius));
+  // The windows around the roi reach this far, and no further; filtering
+  // just that much gives exactly the same min/max inside the roi as
+  // filtering the whole image.
+  const cv::Rect reach =
+      cv::Rect(roi.x - r, roi.y - r, roi.width + 2 * r, roi.height + 2 * r) &
+      cv::Rect(0, 0, image.cols, image.rows);
+  cv::Mat min_img, max_img;
+  SlidingMinMax(image(reach), r, &min_img, &max_img, options_.threads);
+  const cv::Rect inside = roi - reach.tl();
+  return NormalizeAgainst(image(roi), min_img(inside), max_img(inside));
+}
+
+cv::Mat MinMaxPyramid::NormalizeAgainst(const cv::Mat &image,
+                                        const cv::Mat &min_img,
+                                        const cv::Mat &max_img) const {
+  cv::Mat result;
+  if (options_.relevel_path == RelevelPath::kFused) {
+    Normalize(image, min_img, max_img, &result);
+    return result;
+  }
+  if (options_.relevel_path == RelevelPath::kFixedPoint &&
+      image.depth() == CV_8U) {
+    NormalizeFixedPoint(image, min_img, max_img, &result);
+    return result;
+  }
 
   cv::Mat range_img = max_img - min_img;
 
-  cv::Mat zeroed = image_ - min_img;
+  cv::Mat zeroed = image - min_img;
 
   // Now the annoying bit. We should be able to write
   //     return zeroed.mul(255 / range_img);
   // but the integer division truncates, and that creates visible artifacts
   // when the cutoff changes along a gradient. So we have to do this as floating
-  // point and then convert back.
+  // point and then convert back. (Or in fixed point, as kFixedPoint does.)
   cv::Mat zeroed_f, range_f;
   zeroed.convertTo(zeroed_f, CV_32F);
   range_img.convertTo(range_f, CV_32F);
-  cv::Mat resultf, result;
-  resultf = zeroed_f.mul(255.f / range_f);
-  resultf.convertTo(result, CV_8U);
+  // Where the range is zero, pretend it's a hair above zero instead of dividing
+  // by it: pixels at min stay at 0, anything above saturates. For integer
+  // pixels, a hair is half a step.
+  const bool is_float = image.depth() == CV_32F;
+  cv::max(range_f, is_float ? std::numeric_limits<float>::min() : 0.5,
+          range_f);
+  // The top of the output range: 255, 65535, or 1 for float.
+  const float top = is_float ? 1.f : image.depth() == CV_16U ? 65535.f : 255.f;
+  cv::Mat resultf = zeroed_f.mul(top / range_f);
+  if (is_float) {
+    // Integer types saturate in convertTo, and can't go below min in the
+    // first place; floats need both ends clamping by hand.
+    cv::max(resultf, 0, resultf);
+    cv::min(resultf, 1, resultf);
+  }
+  resultf.convertTo(result, image.depth());
   return result;
 }
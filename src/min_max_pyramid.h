@@ -2,9 +2,16 @@
 #define MIN_MAX_PYRAMID_
 
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
 #include <vector>
 
+#include "lru_cache.h"
 #include "opencv4/opencv2/opencv.hpp"
+#include "pyramid_cache.h"
 
 // Custom downsample that applies fn to the four available pixels in the output.
 // We assume fn is associative, i.e.
@@ -14,21 +21,204 @@
 // Also note that the last row/col are thrown away in the case of odd input
 // dimensions.
 //
-// Exposed for testing.
-cv::Mat Downsample(const cv::Mat input, std::function<uchar(uchar, uchar)> fn,
-                   uchar default_value);
+// Exposed for testing; this is the slow reference version, for CV_8UC3 only.
+// The functions below use a vectorized kernel that gives bit-identical results,
+// and also take 16-bit and float images (CV_16U, CV_32F) with any number of
+// channels.
+cv::Mat Downsample(const cv::Mat input, std::function<uchar(uchar, uchar)> fn);
 
 cv::Mat DownsampleMin(const cv::Mat input);
 cv::Mat DownsampleMax(const cv::Mat input);
 
+// Equivalent to
+//     *min_output = DownsampleMin(min_input);
+//     *max_output = DownsampleMax(max_input);
+// but done in a single pass over the inputs. The inputs must have the same size
+// and type; for the base of the pyramid, pass the same image as both.
+//
+// Big inputs are split into bands of rows across up to `threads` threads. The
+// result is the same however many there are.
+void DownsampleMinMax(const cv::Mat min_input, const cv::Mat max_input,
+                      cv::Mat *min_output, cv::Mat *max_output,
+                      int threads = 1);
+
+// The min and max of each channel over the (2 * radius + 1)-pixel square
+// window centred on every pixel, with windows clipped to the image. This is
+// the van Herk/Gil-Werman filter, done along the rows and then down the
+// columns, so it costs a handful of operations per value whatever the radius.
+// Takes the same types as DownsampleMinMax, and splits the work across up to
+// `threads` threads in the same way.
+void SlidingMinMax(const cv::Mat input, int radius, cv::Mat *min_output,
+                   cv::Mat *max_output, int threads = 1);
+
 class MinMaxPyramid {
 public:
-  MinMaxPyramid() = default;
+  // Where the local min and max come from.
+  enum class Engine {
+    // The min/max pyramid: each level halves the one before, and Relevel
+    // interpolates between its cells. Cheap to relevel at any scale, but the
+    // regions are aligned to a power-of-two grid, which the interpolation
+    // softens but doesn't hide entirely.
+    kPyramid,
+    // The true min and max over a square window around every pixel
+    // (SlidingMinMax), with a radius of 2^scale pixels, so that scale means
+    // about the same as for the pyramid. Fractional scales just mean a radius
+    // in between, rather than a blend. No grid, and a cost per pixel that
+    // doesn't depend on the radius, but that cost is paid in full-resolution
+    // passes on every Relevel, where the pyramid's was paid once, at a
+    // sixteenth of the size or less, in PreProcess. PreProcess is nearly free.
+    kSlidingWindow,
+  };
+
+  enum class RelevelPath {
+    // Interpolates the pyramid levels on the fly, in a single pass over the
+    // image. No full-size temporaries besides the output.
+    kFused,
+    // The original implementation: upsample full-resolution min/max layers,
+    // then normalize with CV_32F Mats. Much slower and hungrier, but easy to
+    // follow, so it's kept around as the reference.
+    kFloat,
+    // The same full-resolution layers as kFloat, but normalized in 16-bit
+    // fixed point with a table of reciprocals: no CV_32F temporaries and no
+    // divisions. Within 1 of kFloat everywhere. 8-bit images only; deeper
+    // ones are normalized as for kFloat.
+    kFixedPoint,
+  };
+
+  struct Options {
+    Engine engine = Engine::kPyramid;
+    // With kSlidingWindow, this only picks how the image is normalized
+    // against the window min/max: kFused means the fused kernel's arithmetic,
+    // and there are no layers either way.
+    RelevelPath relevel_path = RelevelPath::kFused;
+
+    // Only relevant to the paths with layers, kFloat and kFixedPoint.
+    // By default PreProcess upsamples every layer to full resolution up front,
+    // which costs 2 * layers * image size in memory. In lazy mode, PreProcess
+    // only builds the (small) pyramid, and each full-resolution layer is
+    // upsampled the first time Relevel needs it.
+    bool lazy_layers = false;
+    // In lazy mode, upsampled layers are kept in an LRU cache of this many
+    // bytes. Each cached layer costs twice the size of the image.
+    size_t layer_cache_bytes = size_t{1} << 30;
+
+    // Whether to collect Stats (below). When off, nothing is timed or counted.
+    bool collect_stats = false;
+
+    // Threads PreProcess may use: each pyramid level is split into bands of
+    // rows, and in eager mode the layers are upsampled in parallel. The
+    // result doesn't depend on this. Leave it at 1 when there are already
+    // several pyramids being built at once, as in the batch tool.
+    int threads = 1;
+  };
 
-  // Pre-process the image by building the relevant pyramid
+  // Where the time and memory go, for finding out what's slow on real images.
+  // Times are wall-clock and summed over calls.
+  struct Stats {
+    int preprocess_calls = 0;
+    // Building the min/max pyramid in PreProcess.
+    double downsample_seconds = 0;
+    // Upsampling levels to full-resolution layers (kFloat and kFixedPoint).
+    // That happens at the end of PreProcess in eager mode, or as needed by
+    // Relevel in lazy mode, in which case it's part of relevel_seconds too.
+    double upsample_seconds = 0;
+    int relevel_calls = 0;
+    // Relevel and RelevelPreview, start to finish.
+    double relevel_seconds = 0;
+
+    // Bytes allocated for each level of the current pyramid, min and max
+    // together, from half size on down.
+    std::vector<size_t> level_bytes;
+    // Bytes held by the pyramid levels plus any full-resolution layers; now,
+    // and the most there have been since stats were last reset.
+    size_t held_bytes = 0;
+    size_t peak_held_bytes = 0;
+
+    // Lookups in the cache of full-resolution layers, the cache of
+    // preview-sized source images, and the on-disk cache (LoadCache).
+    size_t layer_cache_hits = 0;
+    size_t layer_cache_misses = 0;
+    size_t preview_cache_hits = 0;
+    size_t preview_cache_misses = 0;
+    size_t disk_cache_hits = 0;
+    size_t disk_cache_misses = 0;
+
+    // Accumulates another pyramid's stats into this one, e.g. to total up a
+    // pool of pyramids. Byte counts are summed, so the peak is an upper bound.
+    void Add(const Stats &other);
+    // One line, for logs and status bars.
+    std::string Summary() const;
+  };
+
+  MinMaxPyramid() : MinMaxPyramid(Options()) {}
+  explicit MinMaxPyramid(const Options &options);
+
+  // Pre-process the image by building the relevant pyramid. The image can be
+  // 8-bit, 16-bit or float (CV_8U, CV_16U or CV_32F), with any number of
+  // channels; results come back the same way, stretched to the full range of
+  // the type (which for float is 0 to 1). 16-bit images avoid the banding
+  // that stretching an 8-bit copy would show in smooth gradients.
   void PreProcess(cv::Mat input);
 
-  cv::Mat Relevel(int scale) const;
+  // Saves the image and pyramid built by PreProcess to a cache file (see
+  // pyramid_cache.h), tagged with the key of the file the image came from.
+  bool SaveCache(const std::string &path, const PyramidCacheKey &key) const;
+  // What SaveCache writes, for writing it elsewhere (e.g. on another thread).
+  // PreProcess and LoadCache replace the Mats rather than writing into them,
+  // so the result stays as it is whatever this pyramid does next. Returns
+  // false if there's nothing worth caching.
+  bool CacheData(PyramidData *data) const;
+  // Alternative to PreProcess: picks up a pyramid saved by SaveCache, if there
+  // is one for this version of the source file. The cache file is mapped into
+  // memory and used in place, so this costs next to nothing however big the
+  // image is. Returns false, leaving the pyramid as it was, if there's no
+  // usable cache file.
+  bool LoadCache(const std::string &path, const PyramidCacheKey &key);
+  // Another alternative to PreProcess: takes over an image and pyramid built
+  // elsewhere, e.g. by CacheData of a pyramid that ran PreProcess on another
+  // thread. Nothing is copied, so the data must not be written to afterwards.
+  // Like PreProcess, this mustn't be called while other calls are in
+  // progress.
+  void Adopt(const PyramidData &data);
+
+  // Stretches each channel of the image to the full range, using the local min
+  // and max at the given scale. Pixels whose local min and max are the same
+  // map to 0 if they're at the min, or 255 if they're above it.
+  //
+  // Fractional scales blend the min/max of the levels either side, so
+  // locality can be varied smoothly rather than doubling with each step. The
+  // fraction is resolved to 1/256 of a level.
+  cv::Mat Relevel(float scale) const;
+  // As above, but writes into *output, reusing its buffer if it's already the
+  // right size and type. Handy for batch processing.
+  void Relevel(float scale, cv::Mat *output) const;
+  // Just the part of Relevel(scale) inside roi (clipped to the image), for
+  // when only a small area is on screen. Cost scales with the roi, and the
+  // pixels are exactly those the whole image would have had there.
+  cv::Mat Relevel(float scale, cv::Rect roi) const;
+
+  // Same as Relevel, but computes the result directly at (roughly) the given
+  // size, rather than at full resolution. Cost scales with the target size
+  // rather than the image size, so this is what the UI should use for display.
+  // The source pixels come from a downscaled copy of the image, which is
+  // cached per target size.
+  //
+  // Targets at least as big as the image (in both dimensions) just get the
+  // full-resolution result.
+  cv::Mat RelevelPreview(float scale, cv::Size target) const;
+  // Just the part of RelevelPreview(scale, target) inside roi, which is in the
+  // coordinates of that result (see PreviewSize) and clipped to it.
+  cv::Mat RelevelPreview(float scale, cv::Size target, cv::Rect roi) const;
+  // The size of RelevelPreview's result for the given target.
+  cv::Size PreviewSize(cv::Size target) const;
+  // RelevelPreview at every whole scale from MinScale() to MaxScale(), in
+  // that order, for picking a scale by eye. They all start from the same
+  // downscaled copy of the image, and are rendered on Options::threads
+  // threads, so a strip of thumbnails costs little more than one of them.
+  std::vector<cv::Mat> RelevelStrip(cv::Size target) const;
+
+  // Size of the pre-processed image.
+  cv::Size ImageSize() const { return image_.size(); }
 
   // Smallest scale at which Relevel will operate. Smaller inputs will be
   // treated the same as the min value, so this is mostly present to improve UI.
@@ -37,7 +227,92 @@ public:
   // original image.
   int MaxScale() const { return max_layer_; }
 
+  // The MinScale() and MaxScale() that PreProcess would settle on for an image
+  // of the given size, without needing the image.
+  static void ScaleRange(cv::Size image_size, int *min_scale, int *max_scale);
+  // Whether PreProcess takes images of this depth. Decoders can come up with
+  // others (signed or double-precision TIFFs, say), so check first.
+  static bool SupportsDepth(int depth);
+
+  // Default for EstimateScale's min_range.
+  static constexpr float kDefaultMinRange = 0.5f;
+  // Picks a scale for the loaded image without anyone having to look at it:
+  // the most local one at which, in every channel, the local range is still
+  // on average at least min_range of the range over the whole image. Any more
+  // local than that, and Relevel is mostly stretching small variations into
+  // noise and edges. Higher min_range picks coarser scales.
+  //
+  // This only reads the pyramid levels, so after PreProcess it costs next to
+  // nothing. With the sliding-window engine there aren't any, so they get
+  // built, which costs about as much as PreProcess does with the pyramid.
+  int EstimateScale(float min_range = kDefaultMinRange) const;
+
+  // Memory currently held by upsampled full-resolution layers.
+  size_t LayerCacheBytes() const;
+
+  // Switches to another engine, rebuilding whatever it needs from the image
+  // that's already loaded, if any. Like PreProcess, this mustn't be called
+  // while other calls are in progress.
+  void SetEngine(Engine engine);
+
+  // Turns stats collection on or off, like Options::collect_stats. Like
+  // PreProcess, this mustn't be called while other calls are in progress.
+  void SetCollectStats(bool collect) { options_.collect_stats = collect; }
+  // A snapshot of the stats collected so far. All zeros unless collection is
+  // on. Safe to call at any time.
+  Stats GetStats() const;
+  void ResetStats();
+
 private:
+  // A pyramid level upsampled back to the size of the original image.
+  struct Layer {
+    cv::Mat min;
+    cv::Mat max;
+  };
+
+  // Returns the upsampled layer for the given scale, building it if it isn't
+  // already cached. Safe to call from several threads at once.
+  Layer GetLayer(int scale) const;
+  // Builds every layer, for eager mode.
+  void UpsampleAllLayers() const;
+
+  bool InRange(float scale) const {
+    return scale >= min_layer_ && scale <= max_layer_;
+  }
+  // Relevels the roi of `image` (the original, or a preview-sized copy) with
+  // the fused kernel. The scale must be in range.
+  void RelevelFusedAt(const cv::Mat &image, float scale, cv::Rect roi,
+                      cv::Mat *output) const;
+  // Relevels the roi of image_ against upsampled layers, normalizing as
+  // kFloat or kFixedPoint says. The scale must be in range.
+  cv::Mat RelevelLayered(float scale, cv::Rect roi) const;
+  bool UsesLayers() const {
+    return options_.engine == Engine::kPyramid &&
+           options_.relevel_path != RelevelPath::kFused;
+  }
+  // Relevels the roi of `image` (the original, or a preview-sized copy)
+  // against SlidingMinMax, with windows of the given radius.
+  cv::Mat RelevelSliding(const cv::Mat &image, float radius,
+                         cv::Rect roi) const;
+  // (image - min) * top / (max - min), by whichever arithmetic relevel_path
+  // says.
+  cv::Mat NormalizeAgainst(const cv::Mat &image, const cv::Mat &min_img,
+                           const cv::Mat &max_img) const;
+  // The downscaled copy of image_ that previews of the given size start from.
+  cv::Mat PreviewSource(cv::Size size) const;
+
+  // Applies fn to stats_ if stats are being collected; otherwise does nothing.
+  template <typename Fn> void UpdateStats(Fn fn) const {
+    if (!options_.collect_stats)
+      return;
+    std::lock_guard<std::mutex> lock(stats_mutex_);
+    fn(&stats_);
+  }
+  // Refreshes level_bytes, held_bytes and peak_held_bytes.
+  void UpdateMemoryStats() const;
+
+  Options options_;
+
   cv::Mat image_;
 
   // The largest-scale layer, set during pre-processing. Default set high to
@@ -49,7 +324,22 @@ private:
   // Relevel degenerates into an edge detector.
   int min_layer_ = 4;
 
-  std::vector<cv::Mat> min_images_;
-  std::vector<cv::Mat> max_images_;
+  // The downsampled pyramids, from half size on down. Index i is used for
+  // Relevel(i).
+  std::vector<cv::Mat> min_pyramid_;
+  std::vector<cv::Mat> max_pyramid_;
+
+  // If the image and pyramids came from LoadCache, the mapped cache file they
+  // live in.
+  std::shared_ptr<const void> storage_;
+
+  // Upsampled layers, by scale. Relevel is const but fills this in as needed.
+  mutable LruCache<int, Layer> layer_cache_;
+  // Downscaled copies of image_ for RelevelPreview, by (width, height). These
+  // are display-sized, so a handful of them costs very little.
+  mutable LruCache<std::pair<int, int>, cv::Mat> preview_sources_;
+
+  mutable std::mutex stats_mutex_;
+  mutable Stats stats_;
 };
 #endif // MIN_MAX_PYRAMID_
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <map>
+#include <string>
+#include <tuple>
+#include <utility>
+
+#include "benchmark/benchmark.h"
+#include "min_max_pyramid.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+// Timings for the hot paths, on synthetic images from 1MP to 100MP in both odd
+// and even dimensions (odd sizes take the ragged-edge code paths).
+//
+// Besides time, each benchmark reports throughput in megapixels per second,
+// and how much memory OpenCV allocated per iteration. For tracking over time,
+// use Google Benchmark's JSON output, by passing
+//     --benchmark_out=results.json --benchmark_out_format=json
+// after the `--` of `bazel run -c opt //src:min_max_pyramid_benchmark --`.
+// The big sizes take a while; --benchmark_filter=MP:1/ sticks to 1MP.
+
+namespace {
+
+// Counts what cv::Mat allocates, by sitting in front of OpenCV's usual
+// allocator. Only allocations are counted: that's what costs time (and page
+// faults), and freeing goes straight back to the underlying allocator anyway.
+class CountingAllocator : public cv::MatAllocator {
+public:
+  cv::UMatData *allocate(int dims, const int *sizes, int type, void *data,
+                         size_t *step, cv::AccessFlag flags,
+                         cv::UMatUsageFlags usage) const override {
+    cv::UMatData *u = cv::Mat::getStdAllocator()->allocate(
+        dims, sizes, type, data, step, flags, usage);
+    if (u != nullptr && data == nullptr) {
+      bytes_ += u->size;
+      count_++;
+    }
+    return u;
+  }
+
+  bool allocate(cv::UMatData *data, cv::AccessFlag flags,
+                cv::UMatUsageFlags usage) const override {
+    return cv::Mat::getStdAllocator()->allocate(data, flags, usage);
+  }
+
+  void deallocate(cv::UMatData *data) const override {
+    cv::Mat::getStdAllocator()->deallocate(data);
+  }
+
+  size_t bytes() const { return bytes_; }
+  size_t count() const { return count_; }
+
+private:
+  mutable std::atomic<size_t> bytes_{0};
+  mutable std::atomic<size_t> count_{0};
+};
+
+CountingAllocator *Allocator() {
+  static CountingAllocator *allocator = [] {
+    auto *allocator = new CountingAllocator;
+    cv::Mat::setDefaultAllocator(allocator);
+    return allocator;
+  }();
+  return allocator;
+}
+
+// Roughly `megapixels` at 4:3, with both dimensions odd or both even.
+cv::Size ImageSize(int megapixels, bool odd) {
+  const int height =
+      2 * static_cast<int>(std::lround(std::sqrt(megapixels * 0.75e6) / 2));
+  const int width = 2 * static_cast<int>(std::lround(height * 4 / 3.0 / 2));
+  return odd ? cv::Size(width + 1, height + 1) : cv::Size(width, height);
+}
+
+// Noise, so that nothing is accidentally cheap. Generated once per size, since
+// the big ones take a while.
+const cv::Mat &TestImage(int megapixels, bool odd) {
+  static std::map<std::pair<int, bool>, cv::Mat> images;
+  cv::Mat &image = images[{megapixels, odd}];
+  if (image.empty()) {
+    image.create(ImageSize(megapixels, odd), CV_8UC3);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  }
+  return image;
+}
+
+// Wraps the timed loop: reports throughput in pixels of `input`, and
+// allocations made during the loop.
+template <typename Fn>
+void Run(benchmark::State &state, const cv::Mat &input, Fn fn) {
+  CountingAllocator *allocator = Allocator();
+  const size_t bytes_before = allocator->bytes();
+  const size_t count_before = allocator->count();
+  for (auto _ : state)
+    fn();
+
+  const double pixels = static_cast<double>(input.total());
+  state.SetBytesProcessed(state.iterations() * input.total() *
+                          input.elemSize());
+  state.counters["MP/s"] = benchmark::Counter(
+      pixels * 1e-6 * state.iterations(), benchmark::Counter::kIsRate);
+  state.counters["alloc_bytes"] =
+      benchmark::Counter(allocator->bytes() - bytes_before,
+                         benchmark::Counter::kAvgIterations,
+                         benchmark::Counter::kIs1024);
+  state.counters["allocs"] =
+      benchmark::Counter(allocator->count() - count_before,
+                         benchmark::Counter::kAvgIterations);
+  state.SetLabel(std::to_string(input.cols) + "x" +
+                 std::to_string(input.rows));
+}
+
+// Arguments for every benchmark: megapixels, then odd (1) or even (0).
+void SizeArgs(benchmark::internal::Benchmark *benchmark) {
+  benchmark->ArgNames({"MP", "odd"});
+  for (int megapixels : {1, 12, 100}) {
+    for (int odd : {0, 1})
+      benchmark->Args({megapixels, odd});
+  }
+  benchmark->Unit(benchmark::kMillisecond);
+}
+
+// As SizeArgs, plus every scale from MinScale up to `top_offset` below
+// MaxScale.
+void AddScaleArgs(benchmark::internal::Benchmark *benchmark, int top_offset) {
+  benchmark->ArgNames({"MP", "odd", "scale"});
+  for (int megapixels : {1, 12, 100}) {
+    for (int odd : {0, 1}) {
+      int min_scale, max_scale;
+      MinMaxPyramid::ScaleRange(ImageSize(megapixels, odd), &min_scale,
+                                &max_scale);
+      for (int scale = min_scale; scale <= max_scale - top_offset; scale++)
+        benchmark->Args({megapixels, odd, scale});
+    }
+  }
+  benchmark->Unit(benchmark::kMillisecond);
+}
+
+void ScaleArgs(benchmark::internal::Benchmark *benchmark) {
+  AddScaleArgs(benchmark, 0);
+}
+
+// For fractional scales, which need a level above too.
+void FractionalScaleArgs(benchmark::internal::Benchmark *benchmark) {
+  AddScaleArgs(benchmark, 1);
+}
+
+void BM_Downsample(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  const auto min = [](uchar a, uchar b) { return std::min(a, b); };
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(Downsample(input, min).data); });
+}
+BENCHMARK(BM_Downsample)->Apply(SizeArgs);
+
+void BM_DownsampleMin(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(DownsampleMin(input).data); });
+}
+BENCHMARK(BM_DownsampleMin)->Apply(SizeArgs);
+
+void BM_DownsampleMax(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(DownsampleMax(input).data); });
+}
+BENCHMARK(BM_DownsampleMax)->Apply(SizeArgs);
+
+void BM_DownsampleMinMax(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  cv::Mat min, max;
+  Run(state, input, [&] {
+    DownsampleMinMax(input, input, &min, &max);
+    benchmark::DoNotOptimize(min.data);
+  });
+}
+BENCHMARK(BM_DownsampleMinMax)->Apply(SizeArgs);
+
+void BM_PreProcess(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid pyramid;
+  Run(state, input, [&] { pyramid.PreProcess(input); });
+}
+BENCHMARK(BM_PreProcess)->Apply(SizeArgs);
+
+// On top of PreProcess, so compare with BM_PreProcess: it only reads levels
+// of half size and below.
+void BM_EstimateScale(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.EstimateScale()); });
+}
+BENCHMARK(BM_EstimateScale)->Apply(SizeArgs);
+
+void BM_Relevel(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  const int scale = state.range(2);
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.Relevel(scale).data); });
+}
+BENCHMARK(BM_Relevel)->Apply(ScaleArgs);
+
+// Halfway between a level and the next, which blends the two.
+void BM_RelevelFractional(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  const float scale = state.range(2) + 0.5f;
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.Relevel(scale).data); });
+}
+BENCHMARK(BM_RelevelFractional)->Apply(FractionalScaleArgs);
+
+// PreProcess splits each level into bands across threads; on a machine with
+// cores to spare, this shows what that buys over BM_PreProcess.
+void BM_PreProcess3Threads(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid::Options options;
+  options.threads = 3;
+  MinMaxPyramid pyramid(options);
+  Run(state, input, [&] { pyramid.PreProcess(input); });
+}
+BENCHMARK(BM_PreProcess3Threads)->Apply(SizeArgs)->UseRealTime();
+
+// One channel of the test image, as a grayscale image would be, which takes
+// its own downsample kernel: compare with a third of BM_DownsampleMinMax.
+void BM_DownsampleMinMaxPlane(benchmark::State &state) {
+  cv::Mat input;
+  cv::extractChannel(TestImage(state.range(0), state.range(1)), input, 0);
+  cv::Mat min, max;
+  Run(state, input, [&] {
+    DownsampleMinMax(input, input, &min, &max);
+    benchmark::DoNotOptimize(min.data);
+  });
+}
+BENCHMARK(BM_DownsampleMinMaxPlane)->Apply(SizeArgs);
+
+// The normalization step on its own, float against fixed point: both paths
+// relevel against the same upsampled layers. Layers are lazy and warmed up
+// before timing, so that only the one in use takes memory, and building it
+// isn't part of the time.
+void RelevelLayered(benchmark::State &state, MinMaxPyramid::RelevelPath path) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid::Options options;
+  options.relevel_path = path;
+  options.lazy_layers = true;
+  MinMaxPyramid pyramid(options);
+  pyramid.PreProcess(input);
+  const int scale = state.range(2);
+  pyramid.Relevel(scale);
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.Relevel(scale).data); });
+}
+
+void BM_RelevelFloat(benchmark::State &state) {
+  RelevelLayered(state, MinMaxPyramid::RelevelPath::kFloat);
+}
+BENCHMARK(BM_RelevelFloat)->Apply(ScaleArgs);
+
+void BM_RelevelFixedPoint(benchmark::State &state) {
+  RelevelLayered(state, MinMaxPyramid::RelevelPath::kFixedPoint);
+}
+BENCHMARK(BM_RelevelFixedPoint)->Apply(ScaleArgs);
+
+// The sliding-window engine, to weigh against BM_Relevel: it does all its
+// work here, where the pyramid did most of it in PreProcess.
+void BM_RelevelSlidingWindow(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  MinMaxPyramid::Options options;
+  options.engine = MinMaxPyramid::Engine::kSlidingWindow;
+  MinMaxPyramid pyramid(options);
+  pyramid.PreProcess(input);
+  const int scale = state.range(2);
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.Relevel(scale).data); });
+}
+BENCHMARK(BM_RelevelSlidingWindow)->Apply(ScaleArgs);
+
+// SlidingMinMax on its own: the time shouldn't depend on the radius.
+void BM_SlidingMinMax(benchmark::State &state) {
+  const cv::Mat &input = TestImage(state.range(0), state.range(1));
+  const int radius = 1 << state.range(2);
+  cv::Mat min, max;
+  Run(state, input, [&] { SlidingMinMax(input, radius, &min, &max); });
+}
+BENCHMARK(BM_SlidingMinMax)->Apply(ScaleArgs);
+
+// The same noise at a higher depth, scaled to fill the range, for comparing
+// 16-bit and float images against 8-bit ones.
+const cv::Mat &DeepTestImage(int megapixels, bool odd, int depth) {
+  static std::map<std::tuple<int, bool, int>, cv::Mat> images;
+  cv::Mat &image = images[std::make_tuple(megapixels, odd, depth)];
+  if (image.empty()) {
+    TestImage(megapixels, odd)
+        .convertTo(image, depth, depth == CV_16U ? 257.0 : 1.0 / 255);
+  }
+  return image;
+}
+
+void PreProcessDepth(benchmark::State &state, int depth) {
+  const cv::Mat &input = DeepTestImage(state.range(0), state.range(1), depth);
+  MinMaxPyramid pyramid;
+  Run(state, input, [&] { pyramid.PreProcess(input); });
+}
+
+void RelevelDepth(benchmark::State &state, int depth) {
+  const cv::Mat &input = DeepTestImage(state.range(0), state.range(1), depth);
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  const int scale = state.range(2);
+  Run(state, input,
+      [&] { benchmark::DoNotOptimize(pyramid.Relevel(scale).data); });
+}
+
+void BM_PreProcess16U(benchmark::State &state) {
+  PreProcessDepth(state, CV_16U);
+}
+BENCHMARK(BM_PreProcess16U)->Apply(SizeArgs);
+
+void BM_PreProcess32F(benchmark::State &state) {
+  PreProcessDepth(state, CV_32F);
+}
+BENCHMARK(BM_PreProcess32F)->Apply(SizeArgs);
+
+void BM_Relevel16U(benchmark::State &state) { RelevelDepth(state, CV_16U); }
+BENCHMARK(BM_Relevel16U)->Apply(ScaleArgs);
+
+void BM_Relevel32F(benchmark::State &state) { RelevelDepth(state, CV_32F); }
+BENCHMARK(BM_Relevel32F)->Apply(ScaleArgs);
+
+} // namespace
@@ -1,5 +1,10 @@
 #include "min_max_pyramid.h"
 
+#include <stdlib.h>
+
+#include <cmath>
+#include <string>
+
 #include "opencv4/opencv2/opencv.hpp"
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -51,6 +56,11 @@ inline ::testing::Matcher<cv::Mat> ImageEq(const cv::Mat &rhs) {
   return ::testing::MakeMatcher(new ImageEqMatcher(rhs));
 }
 
+// Largest per-element difference between two images of the same type.
+double MaxDifference(const cv::Mat &a, const cv::Mat &b) {
+  return cv::norm(a, b, cv::NORM_INF);
+}
+
 TEST(MinMaxPyramid, DownsamplePreservesConstantValue) {
   // Testing to ensure that channel values don't bleed, aka R B and G are
   // processed separately.
@@ -102,6 +112,182 @@ TEST(MinMaxPyramid, DownsampleUpsizesForOddDimensions) {
   EXPECT_THAT(output, ImageEq(expected));
 }
 
+TEST(MinMaxPyramid, FusedDownsampleMatchesReference) {
+  // Covers odd and even dimensions, plus widths on either side of the vector
+  // sizes used by the SIMD kernels.
+  auto min_fn = [](uchar a, uchar b) { return a < b ? a : b; };
+  auto max_fn = [](uchar a, uchar b) { return a > b ? a : b; };
+  for (int rows : {1, 2, 3, 7, 8}) {
+    for (int cols : {1, 2, 3, 5, 6, 10, 11, 16, 21, 22, 33, 64, 65}) {
+      SCOPED_TRACE(testing::Message() << rows << "x" << cols);
+      cv::Mat input(rows, cols, CV_8UC3);
+      cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+
+      EXPECT_THAT(DownsampleMin(input), ImageEq(Downsample(input, min_fn)));
+      EXPECT_THAT(DownsampleMax(input), ImageEq(Downsample(input, max_fn)));
+
+      // Different sources for min and max, as for every level past the first.
+      cv::Mat other(rows, cols, CV_8UC3);
+      cv::randu(other, cv::Scalar::all(0), cv::Scalar::all(256));
+      cv::Mat min_output, max_output;
+      DownsampleMinMax(input, other, &min_output, &max_output);
+      EXPECT_THAT(min_output, ImageEq(Downsample(input, min_fn)));
+      EXPECT_THAT(max_output, ImageEq(Downsample(other, max_fn)));
+    }
+  }
+}
+
+// The 2x2 min (or max) by plain loops, for the pixel types the reference
+// Downsample doesn't take.
+template <typename T> cv::Mat NaiveDownsample(const cv::Mat &input, bool max) {
+  const int cn = input.channels();
+  cv::Mat output((input.rows + 1) / 2, (input.cols + 1) / 2, input.type());
+  for (int row = 0; row < output.rows; row++) {
+    for (int col = 0; col < output.cols; col++) {
+      for (int k = 0; k < cn; k++) {
+        T value = input.ptr<T>(2 * row)[2 * col * cn + k];
+        for (int dy = 0; dy < 2; dy++) {
+          for (int dx = 0; dx < 2; dx++) {
+            const int y = std::min(2 * row + dy, input.rows - 1);
+            const int x = std::min(2 * col + dx, input.cols - 1);
+            const T other = input.ptr<T>(y)[x * cn + k];
+            value = max ? std::max(value, other) : std::min(value, other);
+          }
+        }
+        output.ptr<T>(row)[col * cn + k] = value;
+      }
+    }
+  }
+  return output;
+}
+
+TEST(MinMaxPyramid, FusedDownsampleHandlesDeeperPixels) {
+  for (int cn : {1, 3, 4}) {
+    for (cv::Size size : {cv::Size(1, 1), cv::Size(7, 3), cv::Size(33, 8),
+                          cv::Size(65, 11)}) {
+      SCOPED_TRACE(testing::Message() << size << " x " << cn);
+      cv::Mat input16(size, CV_16UC(cn));
+      cv::randu(input16, cv::Scalar::all(0), cv::Scalar::all(65536));
+      cv::Mat min, max;
+      DownsampleMinMax(input16, input16, &min, &max);
+      EXPECT_EQ(0, MaxDifference(min, NaiveDownsample<uint16_t>(input16,
+                                                                false)));
+      EXPECT_EQ(0,
+                MaxDifference(max, NaiveDownsample<uint16_t>(input16, true)));
+
+      cv::Mat input32(size, CV_32FC(cn));
+      cv::randu(input32, cv::Scalar::all(-1), cv::Scalar::all(2));
+      DownsampleMinMax(input32, input32, &min, &max);
+      EXPECT_EQ(0, MaxDifference(min, NaiveDownsample<float>(input32, false)));
+      EXPECT_EQ(0, MaxDifference(max, NaiveDownsample<float>(input32, true)));
+    }
+  }
+}
+
+TEST(MinMaxPyramid, SingleChannelDownsampleMatchesNaive) {
+  // Single-channel 8-bit rows have a kernel of their own. Wide enough for
+  // several vectors of pairs with a tail left over, and odd widths, and an
+  // roi whose rows don't start on any particular boundary.
+  cv::Mat parent(70, 301, CV_8UC1);
+  cv::randu(parent, cv::Scalar::all(0), cv::Scalar::all(256));
+  for (cv::Rect rect : {cv::Rect(0, 0, 1, 1), cv::Rect(0, 0, 7, 3),
+                        cv::Rect(0, 0, 64, 5), cv::Rect(0, 0, 301, 70),
+                        cv::Rect(3, 1, 259, 67)}) {
+    SCOPED_TRACE(testing::Message() << rect);
+    const cv::Mat input = parent(rect);
+    cv::Mat min, max;
+    DownsampleMinMax(input, input, &min, &max);
+    EXPECT_EQ(0, MaxDifference(min, NaiveDownsample<uchar>(input, false)));
+    EXPECT_EQ(0, MaxDifference(max, NaiveDownsample<uchar>(input, true)));
+    EXPECT_EQ(0, MaxDifference(DownsampleMin(input),
+                               NaiveDownsample<uchar>(input, false)));
+  }
+}
+
+TEST(MinMaxPyramid, FusedDownsampleHandlesRoiInput) {
+  // Row pointers, not a continuous buffer: make sure we respect the step.
+  cv::Mat parent(9, 13, CV_8UC3);
+  cv::randu(parent, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat input = parent(cv::Rect(1, 1, 11, 7));
+
+  cv::Mat min_output, max_output;
+  DownsampleMinMax(input, input, &min_output, &max_output);
+  EXPECT_THAT(min_output, ImageEq(DownsampleMin(input.clone())));
+  EXPECT_THAT(max_output, ImageEq(DownsampleMax(input.clone())));
+}
+
+TEST(MinMaxPyramid, ThreadedDownsampleMatchesSerial) {
+  // Big enough to be split into several bands, and odd in both dimensions.
+  cv::Mat input(1203, 1001, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+
+  cv::Mat min, max, threaded_min, threaded_max;
+  DownsampleMinMax(input, input, &min, &max);
+  DownsampleMinMax(input, input, &threaded_min, &threaded_max, 4);
+  EXPECT_THAT(threaded_min, ImageEq(min));
+  EXPECT_THAT(threaded_max, ImageEq(max));
+}
+
+// Brute force: every pixel looks at its whole (clipped) window.
+template <typename T>
+cv::Mat NaiveSlidingMinMax(const cv::Mat &input, int radius, bool max) {
+  const int cn = input.channels();
+  cv::Mat output(input.size(), input.type());
+  for (int row = 0; row < input.rows; row++) {
+    for (int col = 0; col < input.cols; col++) {
+      for (int k = 0; k < cn; k++) {
+        T value = input.ptr<T>(row)[col * cn + k];
+        for (int y = std::max(row - radius, 0);
+             y <= std::min(row + radius, input.rows - 1); y++) {
+          for (int x = std::max(col - radius, 0);
+               x <= std::min(col + radius, input.cols - 1); x++) {
+            const T other = input.ptr<T>(y)[x * cn + k];
+            value = max ? std::max(value, other) : std::min(value, other);
+          }
+        }
+        output.ptr<T>(row)[col * cn + k] = value;
+      }
+    }
+  }
+  return output;
+}
+
+TEST(MinMaxPyramid, SlidingMinMaxMatchesBruteForce) {
+  // An roi of a bigger image, so rows aren't contiguous.
+  cv::Mat parent8(40, 70, CV_8UC3);
+  cv::randu(parent8, cv::Scalar::all(0), cv::Scalar::all(256));
+  const cv::Mat input8 = parent8(cv::Rect(3, 2, 61, 37));
+  cv::Mat input16(23, 1200, CV_16UC1);
+  cv::randu(input16, cv::Scalar::all(0), cv::Scalar::all(65536));
+  cv::Mat input32(17, 9, CV_32FC2);
+  cv::randu(input32, cv::Scalar::all(-1), cv::Scalar::all(2));
+
+  // From one pixel, through windows that straddle blocks in every way, to
+  // windows bigger than the image.
+  for (int radius : {0, 1, 2, 3, 7, 30, 100}) {
+    for (int threads : {1, 3}) {
+      SCOPED_TRACE(testing::Message()
+                   << "radius " << radius << ", threads " << threads);
+      cv::Mat min, max;
+      SlidingMinMax(input8, radius, &min, &max, threads);
+      EXPECT_EQ(0, MaxDifference(min, NaiveSlidingMinMax<uchar>(
+                                          input8, radius, false)));
+      EXPECT_EQ(0, MaxDifference(max, NaiveSlidingMinMax<uchar>(
+                                          input8, radius, true)));
+      SlidingMinMax(input16, radius, &min, &max, threads);
+      EXPECT_EQ(0, MaxDifference(min, NaiveSlidingMinMax<uint16_t>(
+                                          input16, radius, false)));
+      EXPECT_EQ(0, MaxDifference(max, NaiveSlidingMinMax<uint16_t>(
+                                          input16, radius, true)));
+      SlidingMinMax(input32, radius, &min, &max, threads);
+      EXPECT_EQ(0, MaxDifference(min, NaiveSlidingMinMax<float>(
+                                          input32, radius, false)));
+      EXPECT_EQ(0, MaxDifference(max, NaiveSlidingMinMax<float>(
+                                          input32, radius, true)));
+    }
+  }
+}
+
 TEST(MinMaxPyramid, ReducesLevelsForSmallImage) {
   MinMaxPyramid pyramid;
   cv::Mat input =
@@ -143,3 +329,592 @@ TEST(MinMaxPyramid, RelevelScalesImagePixels) {
 
   EXPECT_THAT(pyramid.Relevel(1), ImageEq(expected));
 }
+
+TEST(MinMaxPyramid, LazyLayersMatchEagerLayers) {
+  cv::Mat input(37, 50, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+
+  MinMaxPyramid::Options options;
+  options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  MinMaxPyramid eager(options);
+  eager.PreProcess(input);
+
+  options.lazy_layers = true;
+  MinMaxPyramid lazy(options);
+  lazy.PreProcess(input);
+  EXPECT_EQ(0u, lazy.LayerCacheBytes());
+
+  ASSERT_EQ(eager.MinScale(), lazy.MinScale());
+  ASSERT_EQ(eager.MaxScale(), lazy.MaxScale());
+  for (int scale = eager.MinScale(); scale <= eager.MaxScale(); scale++)
+    EXPECT_THAT(lazy.Relevel(scale), ImageEq(eager.Relevel(scale)));
+}
+
+TEST(MinMaxPyramid, LazyLayersStayWithinBudget) {
+  cv::Mat input(64, 64, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  const size_t layer_bytes = 2 * input.total() * input.elemSize();
+
+  MinMaxPyramid::Options options;
+  options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  options.lazy_layers = true;
+  options.layer_cache_bytes = 2 * layer_bytes;
+  MinMaxPyramid pyramid(options);
+  pyramid.PreProcess(input);
+
+  for (int scale = pyramid.MinScale(); scale <= pyramid.MaxScale(); scale++) {
+    pyramid.Relevel(scale);
+    EXPECT_LE(pyramid.LayerCacheBytes(), 2 * layer_bytes);
+  }
+  EXPECT_EQ(2 * layer_bytes, pyramid.LayerCacheBytes());
+}
+
+TEST(MinMaxPyramid, ThreadedPreProcessMatchesSerial) {
+  cv::Mat input(601, 803, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+
+  for (MinMaxPyramid::RelevelPath path :
+       {MinMaxPyramid::RelevelPath::kFused,
+        MinMaxPyramid::RelevelPath::kFloat}) {
+    MinMaxPyramid::Options options;
+    options.relevel_path = path;
+    MinMaxPyramid serial(options);
+    serial.PreProcess(input);
+    options.threads = 4;
+    MinMaxPyramid threaded(options);
+    threaded.PreProcess(input);
+
+    ASSERT_EQ(serial.MaxScale(), threaded.MaxScale());
+    for (int scale = serial.MinScale(); scale <= serial.MaxScale(); scale++)
+      EXPECT_THAT(threaded.Relevel(scale), ImageEq(serial.Relevel(scale)));
+  }
+}
+
+TEST(MinMaxPyramid, StatsOnlyCollectedWhenEnabled) {
+  cv::Mat input(64, 64, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+
+  MinMaxPyramid::Options options;
+  options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  options.lazy_layers = true;
+  MinMaxPyramid quiet(options);
+  quiet.PreProcess(input);
+  quiet.Relevel(quiet.MinScale());
+  EXPECT_EQ(0, quiet.GetStats().relevel_calls);
+  EXPECT_EQ(0u, quiet.GetStats().peak_held_bytes);
+
+  options.collect_stats = true;
+  MinMaxPyramid pyramid(options);
+  pyramid.PreProcess(input);
+  pyramid.Relevel(pyramid.MinScale());
+  pyramid.Relevel(pyramid.MinScale());
+  const MinMaxPyramid::Stats stats = pyramid.GetStats();
+  EXPECT_EQ(1, stats.preprocess_calls);
+  EXPECT_EQ(2, stats.relevel_calls);
+  EXPECT_EQ(1u, stats.layer_cache_misses);
+  EXPECT_EQ(1u, stats.layer_cache_hits);
+  // Half size, in min and max.
+  ASSERT_EQ(static_cast<size_t>(pyramid.MaxScale() + 1),
+            stats.level_bytes.size());
+  EXPECT_EQ(input.total() * input.elemSize() / 2, stats.level_bytes[0]);
+  size_t pyramid_bytes = 0;
+  for (size_t level_bytes : stats.level_bytes)
+    pyramid_bytes += level_bytes;
+  EXPECT_EQ(pyramid_bytes + pyramid.LayerCacheBytes(), stats.held_bytes);
+  EXPECT_EQ(stats.held_bytes, stats.peak_held_bytes);
+
+  pyramid.ResetStats();
+  EXPECT_EQ(0, pyramid.GetStats().relevel_calls);
+  EXPECT_EQ(stats.held_bytes, pyramid.GetStats().held_bytes);
+}
+
+TEST(MinMaxPyramid, FusedRelevelMatchesFloatPath) {
+  MinMaxPyramid::Options float_options;
+  float_options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+
+  // Noise gives big local ranges; the gradient gives small ones, where any
+  // error in the interpolated min/max would get amplified the most.
+  cv::Mat noise(61, 94, CV_8UC3);
+  cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat gradient(80, 71, CV_8UC3);
+  for (int row = 0; row < gradient.rows; row++)
+    for (int col = 0; col < gradient.cols; col++)
+      gradient.at<cv::Vec3b>(row, col) =
+          cv::Vec3b(row + col, 2 * row, 100 + col / 3);
+
+  for (const cv::Mat &input : {noise, gradient}) {
+    MinMaxPyramid fused;
+    MinMaxPyramid reference(float_options);
+    fused.PreProcess(input);
+    reference.PreProcess(input);
+    for (int scale = fused.MinScale(); scale <= fused.MaxScale(); scale++) {
+      SCOPED_TRACE(testing::Message() << "scale " << scale);
+      EXPECT_LE(MaxDifference(fused.Relevel(scale), reference.Relevel(scale)),
+                1);
+    }
+  }
+}
+
+TEST(MinMaxPyramid, FixedPointRelevelMatchesFloatPath) {
+  MinMaxPyramid::Options float_options;
+  float_options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  MinMaxPyramid::Options fixed_options;
+  fixed_options.relevel_path = MinMaxPyramid::RelevelPath::kFixedPoint;
+
+  cv::Mat noise(61, 94, CV_8UC3);
+  cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat gradient(80, 71, CV_8UC3);
+  for (int row = 0; row < gradient.rows; row++)
+    for (int col = 0; col < gradient.cols; col++)
+      gradient.at<cv::Vec3b>(row, col) =
+          cv::Vec3b(row + col, 2 * row, 100 + col / 3);
+
+  for (const cv::Mat &input : {noise, gradient}) {
+    MinMaxPyramid fixed(fixed_options);
+    MinMaxPyramid reference(float_options);
+    fixed.PreProcess(input);
+    reference.PreProcess(input);
+    // Same layers, so only the normalization differs.
+    for (float scale = fixed.MinScale(); scale <= fixed.MaxScale();
+         scale += 0.5f) {
+      SCOPED_TRACE(testing::Message() << "scale " << scale);
+      EXPECT_LE(MaxDifference(fixed.Relevel(scale), reference.Relevel(scale)),
+                1);
+    }
+  }
+}
+
+TEST(MinMaxPyramid, DeeperPixelsRelevelLikeEightBit) {
+  // The same picture at three depths should relevel to (nearly) the same
+  // result, each stretched over its own full range. Interpolation and
+  // rounding differ a little between the 8-bit fixed point and the others'
+  // float, hence the tolerance.
+  cv::Mat input8(93, 131, CV_8UC3);
+  cv::randu(input8, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat input16, input32;
+  input8.convertTo(input16, CV_16U, 257);
+  input8.convertTo(input32, CV_32F, 1 / 255.);
+
+  for (auto path : {MinMaxPyramid::RelevelPath::kFused,
+                    MinMaxPyramid::RelevelPath::kFloat,
+                    MinMaxPyramid::RelevelPath::kFixedPoint}) {
+    MinMaxPyramid::Options options;
+    options.relevel_path = path;
+    MinMaxPyramid pyramid8(options), pyramid16(options), pyramid32(options);
+    pyramid8.PreProcess(input8);
+    pyramid16.PreProcess(input16);
+    pyramid32.PreProcess(input32);
+    for (float scale = pyramid8.MinScale(); scale <= pyramid8.MaxScale();
+         scale += 0.5f) {
+      SCOPED_TRACE(testing::Message() << "scale " << scale);
+      const cv::Mat result8 = pyramid8.Relevel(scale);
+      const cv::Mat result16 = pyramid16.Relevel(scale);
+      const cv::Mat result32 = pyramid32.Relevel(scale);
+      ASSERT_EQ(CV_16UC3, result16.type());
+      ASSERT_EQ(CV_32FC3, result32.type());
+      cv::Mat scaled16, scaled32;
+      result16.convertTo(scaled16, CV_8U, 1 / 257.);
+      result32.convertTo(scaled32, CV_8U, 255);
+      EXPECT_LE(MaxDifference(scaled16, result8), 2);
+      EXPECT_LE(MaxDifference(scaled32, result8), 2);
+    }
+  }
+}
+
+TEST(MinMaxPyramid, FractionalScalesBlendNeighbouringLevels) {
+  MinMaxPyramid::Options float_options;
+  float_options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  cv::Mat input(90, 120, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid fused;
+  MinMaxPyramid reference(float_options);
+  fused.PreProcess(input);
+  reference.PreProcess(input);
+
+  for (float scale = fused.MinScale(); scale <= fused.MaxScale();
+       scale += 0.25f) {
+    SCOPED_TRACE(testing::Message() << "scale " << scale);
+    EXPECT_LE(MaxDifference(fused.Relevel(scale), reference.Relevel(scale)), 1);
+  }
+
+  // Whole numbers, and anything within rounding of them, are just the level.
+  const int level = fused.MinScale() + 1;
+  EXPECT_THAT(fused.Relevel(level + 0.001f), ImageEq(fused.Relevel(level)));
+  EXPECT_THAT(fused.Relevel(level - 0.001f), ImageEq(fused.Relevel(level)));
+  // A blend really is somewhere in between.
+  EXPECT_GT(MaxDifference(fused.Relevel(level + 0.5f), fused.Relevel(level)),
+            0);
+  EXPECT_GT(
+      MaxDifference(fused.Relevel(level + 0.5f), fused.Relevel(level + 1)), 0);
+
+  // Just past either end is out of range.
+  EXPECT_THAT(fused.Relevel(fused.MaxScale() + 0.5f), ImageEq(input));
+  EXPECT_THAT(fused.Relevel(fused.MinScale() - 0.5f), ImageEq(input));
+}
+
+TEST(MinMaxPyramid, RelevelDefinesZeroRange) {
+  // A flat channel has zero range everywhere. It used to divide by zero; now
+  // the flat value maps to 0.
+  cv::Mat input(16, 16, CV_8UC3, cv::Scalar(50, 60, 70));
+  input.at<cv::Vec3b>(3, 3) = cv::Vec3b(50, 61, 70);
+
+  for (auto path : {MinMaxPyramid::RelevelPath::kFused,
+                    MinMaxPyramid::RelevelPath::kFloat,
+                    MinMaxPyramid::RelevelPath::kFixedPoint}) {
+    MinMaxPyramid::Options options;
+    options.relevel_path = path;
+    MinMaxPyramid pyramid(options);
+    pyramid.PreProcess(input);
+
+    cv::Mat output = pyramid.Relevel(pyramid.MaxScale());
+    cv::Mat expected(16, 16, CV_8UC3, cv::Scalar(0, 0, 0));
+    // The odd pixel has a real (if small) range in the green channel.
+    expected.at<cv::Vec3b>(3, 3) = cv::Vec3b(0, 255, 0);
+    EXPECT_THAT(output, ImageEq(expected));
+  }
+}
+
+TEST(MinMaxPyramid, RelevelPreviewRendersAtTargetSize) {
+  cv::Mat input(120, 160, CV_8UC3);
+  for (int row = 0; row < input.rows; row++)
+    for (int col = 0; col < input.cols; col++)
+      input.at<cv::Vec3b>(row, col) = cv::Vec3b(row, col, (row + col) / 2);
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+
+  // A quarter of the size in each dimension.
+  const cv::Size target(40, 30);
+  for (int scale = pyramid.MinScale(); scale <= pyramid.MaxScale(); scale++) {
+    SCOPED_TRACE(testing::Message() << "scale " << scale);
+    cv::Mat preview = pyramid.RelevelPreview(scale, target);
+    ASSERT_EQ(target, preview.size());
+
+    // Rendering small should look like rendering big and then shrinking, as
+    // long as each pyramid cell spans plenty of preview pixels. (At finer
+    // scales, Relevel on this gradient is basically an edge detector, and the
+    // average of that isn't something we can get from averaged pixels.)
+    if ((2 << scale) < 8 * 4)
+      continue;
+    cv::Mat shrunk, difference;
+    cv::resize(pyramid.Relevel(scale), shrunk, target, 0, 0, cv::INTER_AREA);
+    cv::absdiff(preview, shrunk, difference);
+    const cv::Scalar mean_difference = cv::mean(difference);
+    // Within 2% on average is indistinguishable on screen.
+    for (int channel = 0; channel < 3; channel++)
+      EXPECT_LE(mean_difference[channel], 5);
+  }
+
+  // Out of range still means "original image".
+  cv::Mat shrunk_input;
+  cv::resize(input, shrunk_input, target, 0, 0, cv::INTER_AREA);
+  EXPECT_THAT(pyramid.RelevelPreview(pyramid.MaxScale() + 1, target),
+              ImageEq(shrunk_input));
+}
+
+TEST(MinMaxPyramid, RelevelPreviewAtFullSizeIsRelevel) {
+  cv::Mat input(37, 50, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+
+  EXPECT_THAT(pyramid.RelevelPreview(pyramid.MinScale(), cv::Size(50, 40)),
+              ImageEq(pyramid.Relevel(pyramid.MinScale())));
+}
+
+TEST(MinMaxPyramid, RelevelStripHasEveryScale) {
+  cv::Mat input(121, 163, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid::Options options;
+  options.threads = 3;
+  MinMaxPyramid pyramid(options);
+  pyramid.PreProcess(input);
+
+  const cv::Size target(40, 30);
+  const std::vector<cv::Mat> strip = pyramid.RelevelStrip(target);
+  ASSERT_EQ(static_cast<size_t>(pyramid.MaxScale() - pyramid.MinScale() + 1),
+            strip.size());
+  for (size_t i = 0; i < strip.size(); i++) {
+    const int scale = pyramid.MinScale() + static_cast<int>(i);
+    SCOPED_TRACE(testing::Message() << "scale " << scale);
+    EXPECT_THAT(strip[i], ImageEq(pyramid.RelevelPreview(scale, target)));
+  }
+}
+
+TEST(MinMaxPyramid, SlidingWindowRelevelsAgainstWindowMinMax) {
+  cv::Mat input(77, 102, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid::Options options;
+  options.engine = MinMaxPyramid::Engine::kSlidingWindow;
+  options.threads = 2;
+
+  for (auto path : {MinMaxPyramid::RelevelPath::kFused,
+                    MinMaxPyramid::RelevelPath::kFloat,
+                    MinMaxPyramid::RelevelPath::kFixedPoint}) {
+    options.relevel_path = path;
+    MinMaxPyramid pyramid(options);
+    pyramid.PreProcess(input);
+    int min_scale, max_scale;
+    MinMaxPyramid::ScaleRange(input.size(), &min_scale, &max_scale);
+    EXPECT_EQ(min_scale, pyramid.MinScale());
+    EXPECT_EQ(max_scale, pyramid.MaxScale());
+
+    // Radius 2^scale, so fractional scales fall in between.
+    for (float scale : {static_cast<float>(pyramid.MinScale()),
+                        pyramid.MinScale() + 0.5f,
+                        static_cast<float>(pyramid.MaxScale())}) {
+      SCOPED_TRACE(testing::Message() << "scale " << scale);
+      const int radius = cvRound(std::exp2(scale));
+      const cv::Mat min = NaiveSlidingMinMax<uchar>(input, radius, false);
+      const cv::Mat max = NaiveSlidingMinMax<uchar>(input, radius, true);
+      cv::Mat expected(input.size(), input.type());
+      for (int i = 0; i < static_cast<int>(input.total()) * 3; i++) {
+        const int range = max.data[i] - min.data[i];
+        expected.data[i] = cv::saturate_cast<uchar>(
+            (input.data[i] - min.data[i]) * 255.0 / std::max(range, 1));
+      }
+      // The three normalizations differ only in rounding.
+      EXPECT_LE(MaxDifference(pyramid.Relevel(scale), expected), 1);
+    }
+  }
+}
+
+TEST(MinMaxPyramid, SetEngineRebuildsFromLoadedImage) {
+  cv::Mat input(64, 80, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid::Options options;
+  options.engine = MinMaxPyramid::Engine::kSlidingWindow;
+  MinMaxPyramid window(options);
+  window.PreProcess(input);
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+
+  MinMaxPyramid switched;
+  switched.PreProcess(input);
+  const float scale = switched.MinScale() + 0.5f;
+  switched.SetEngine(MinMaxPyramid::Engine::kSlidingWindow);
+  EXPECT_THAT(switched.Relevel(scale), ImageEq(window.Relevel(scale)));
+  switched.SetEngine(MinMaxPyramid::Engine::kPyramid);
+  EXPECT_THAT(switched.Relevel(scale), ImageEq(pyramid.Relevel(scale)));
+}
+
+TEST(MinMaxPyramid, RelevelRoiMatchesCrop) {
+  cv::Mat input(93, 131, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  const cv::Rect roi(17, 40, 61, 29);
+
+  for (auto engine : {MinMaxPyramid::Engine::kPyramid,
+                      MinMaxPyramid::Engine::kSlidingWindow}) {
+    for (auto path : {MinMaxPyramid::RelevelPath::kFused,
+                      MinMaxPyramid::RelevelPath::kFloat,
+                      MinMaxPyramid::RelevelPath::kFixedPoint}) {
+      MinMaxPyramid::Options options;
+      options.engine = engine;
+      options.relevel_path = path;
+      MinMaxPyramid pyramid(options);
+      pyramid.PreProcess(input);
+      for (float scale = pyramid.MinScale() - 1.f;
+           scale <= pyramid.MaxScale() + 1; scale += 0.5f) {
+        SCOPED_TRACE(testing::Message() << "scale " << scale);
+        EXPECT_THAT(pyramid.Relevel(scale, roi),
+                    ImageEq(pyramid.Relevel(scale)(roi)));
+      }
+    }
+  }
+
+  // Anything off the edge is clipped.
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  const float scale = pyramid.MinScale();
+  EXPECT_THAT(pyramid.Relevel(scale, cv::Rect(100, 80, 100, 100)),
+              ImageEq(pyramid.Relevel(scale)(cv::Rect(100, 80, 31, 13))));
+  EXPECT_TRUE(pyramid.Relevel(scale, cv::Rect(200, 0, 10, 10)).empty());
+}
+
+TEST(MinMaxPyramid, RelevelPreviewRoiMatchesCrop) {
+  cv::Mat input(120, 160, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+
+  const cv::Rect roi(5, 7, 22, 13);
+  for (cv::Size target : {cv::Size(40, 30), cv::Size(500, 500)}) {
+    SCOPED_TRACE(testing::Message() << "target " << target);
+    EXPECT_EQ(pyramid.RelevelPreview(1, target).size(),
+              pyramid.PreviewSize(target));
+    for (float scale : {1.f, 2.5f, 100.f}) {
+      EXPECT_THAT(pyramid.RelevelPreview(scale, target, roi),
+                  ImageEq(pyramid.RelevelPreview(scale, target)(roi)));
+    }
+  }
+}
+
+TEST(MinMaxPyramid, RelevelIntoReusesBuffer) {
+  cv::Mat input(37, 50, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  const cv::Mat original = input.clone();
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+
+  cv::Mat output;
+  pyramid.Relevel(pyramid.MinScale(), &output);
+  const uchar *buffer = output.data;
+  pyramid.Relevel(pyramid.MaxScale(), &output);
+  EXPECT_EQ(buffer, output.data);
+  EXPECT_THAT(output, ImageEq(pyramid.Relevel(pyramid.MaxScale())));
+
+  // The out-of-range result is the input itself; rendering into it must not
+  // scribble over the input.
+  output = pyramid.Relevel(pyramid.MaxScale() + 1);
+  pyramid.Relevel(pyramid.MinScale(), &output);
+  EXPECT_THAT(input, ImageEq(original));
+}
+
+TEST(MinMaxPyramid, ScaleRangeMatchesPreProcess) {
+  for (const cv::Size size : {cv::Size(1, 1), cv::Size(2, 1), cv::Size(37, 50),
+                              cv::Size(300, 17), cv::Size(257, 256)}) {
+    MinMaxPyramid pyramid;
+    pyramid.PreProcess(cv::Mat(size, CV_8UC3, cv::Scalar::all(0)));
+    int min_scale, max_scale;
+    MinMaxPyramid::ScaleRange(size, &min_scale, &max_scale);
+    EXPECT_EQ(pyramid.MinScale(), min_scale) << size;
+    EXPECT_EQ(pyramid.MaxScale(), max_scale) << size;
+  }
+}
+
+TEST(MinMaxPyramid, EstimateScaleFollowsLocalRange) {
+  // Noise spans nearly the whole range in any neighbourhood, so even the most
+  // local scale is safe.
+  cv::Mat noise(256, 256, CV_8UC3);
+  cv::randu(noise, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid noisy;
+  noisy.PreProcess(noise);
+  EXPECT_EQ(noisy.MinScale(), noisy.EstimateScale());
+
+  // A ramp across the image spans just under half of its range in blocks half
+  // the width of the image, which level 6 of 256 pixels is, and just under a
+  // quarter at level 5.
+  cv::Mat ramp(256, 256, CV_8UC3);
+  for (int x = 0; x < ramp.cols; x++)
+    ramp.col(x).setTo(cv::Scalar::all(x));
+  MinMaxPyramid smooth;
+  smooth.PreProcess(ramp);
+  EXPECT_EQ(6, smooth.EstimateScale(0.4f));
+  // Asking for more range only ever picks coarser scales.
+  EXPECT_EQ(smooth.MaxScale(), smooth.EstimateScale(1));
+  EXPECT_LE(smooth.EstimateScale(0.1f), smooth.EstimateScale(0.3f));
+  EXPECT_EQ(smooth.MinScale(), smooth.EstimateScale(0));
+
+  // A flat channel doesn't hold the others back.
+  std::vector<cv::Mat> channels;
+  cv::split(ramp, channels);
+  channels[0].setTo(cv::Scalar::all(7));
+  cv::Mat flat_blue;
+  cv::merge(channels, flat_blue);
+  MinMaxPyramid partly_flat;
+  partly_flat.PreProcess(flat_blue);
+  EXPECT_EQ(6, partly_flat.EstimateScale(0.4f));
+}
+
+TEST(MinMaxPyramid, EstimateScaleIsTheSameForEitherEngine) {
+  cv::Mat input(150, 230, CV_16UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(65536));
+  cv::blur(input, input, cv::Size(25, 25));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(input);
+  MinMaxPyramid::Options options;
+  options.engine = MinMaxPyramid::Engine::kSlidingWindow;
+  MinMaxPyramid window(options);
+  window.PreProcess(input);
+  for (float min_range : {0.2f, 0.5f, 0.8f}) {
+    const int scale = pyramid.EstimateScale(min_range);
+    EXPECT_GE(scale, pyramid.MinScale());
+    EXPECT_LE(scale, pyramid.MaxScale());
+    EXPECT_EQ(scale, window.EstimateScale(min_range)) << min_range;
+  }
+}
+
+TEST(MinMaxPyramid, CacheRoundTrips) {
+  cv::Mat input(53, 71, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid built;
+  built.PreProcess(input);
+
+  const char *root = getenv("TEST_TMPDIR");
+  const std::string path =
+      std::string(root ? root : "/tmp") + "/round_trip.pyramid";
+  const PyramidCacheKey key{1234, 5678, 9};
+  ASSERT_TRUE(built.SaveCache(path, key));
+
+  MinMaxPyramid loaded;
+  PyramidCacheKey stale = key;
+  stale.mtime_ns++;
+  EXPECT_FALSE(loaded.LoadCache(path, stale));
+  ASSERT_TRUE(loaded.LoadCache(path, key));
+  ASSERT_EQ(built.MinScale(), loaded.MinScale());
+  ASSERT_EQ(built.MaxScale(), loaded.MaxScale());
+  for (int scale = built.MinScale() - 1; scale <= built.MaxScale() + 1;
+       scale++) {
+    EXPECT_THAT(loaded.Relevel(scale), ImageEq(built.Relevel(scale)))
+        << "scale " << scale;
+  }
+
+  // The out-of-range result is a copy, so it outlives the mapping.
+  const cv::Mat original = loaded.Relevel(loaded.MaxScale() + 1);
+  loaded.PreProcess(cv::Mat(8, 8, CV_8UC3, cv::Scalar::all(0)));
+  EXPECT_THAT(original, ImageEq(input));
+}
+
+TEST(MinMaxPyramid, AdoptsAnotherPyramidsData) {
+  cv::Mat input(53, 71, CV_16UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(65536));
+  MinMaxPyramid built;
+  built.PreProcess(input);
+  PyramidData data;
+  ASSERT_TRUE(built.CacheData(&data));
+
+  // Into a pyramid that already has an image, as when the editor swaps in a
+  // pyramid that was built on another thread. With layers too, which Adopt
+  // has to upsample the same way PreProcess does.
+  MinMaxPyramid::Options layered_options;
+  layered_options.relevel_path = MinMaxPyramid::RelevelPath::kFloat;
+  for (const MinMaxPyramid::Options &options :
+       {MinMaxPyramid::Options(), layered_options}) {
+    MinMaxPyramid expected(options);
+    expected.PreProcess(input);
+    MinMaxPyramid adopted(options);
+    adopted.PreProcess(cv::Mat(8, 8, CV_8UC3, cv::Scalar::all(0)));
+    adopted.Adopt(data);
+    ASSERT_EQ(expected.MinScale(), adopted.MinScale());
+    ASSERT_EQ(expected.MaxScale(), adopted.MaxScale());
+    for (float scale = expected.MinScale(); scale <= expected.MaxScale();
+         scale += 0.5f) {
+      EXPECT_THAT(adopted.Relevel(scale), ImageEq(expected.Relevel(scale)))
+          << "scale " << scale;
+    }
+  }
+}
+
+TEST(MinMaxPyramid, CacheDataOutlivesTheNextImage) {
+  cv::Mat input(53, 71, CV_8UC3);
+  cv::randu(input, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid pyramid;
+  PyramidData data;
+  EXPECT_FALSE(pyramid.CacheData(&data));
+  pyramid.PreProcess(input.clone());
+  ASSERT_TRUE(pyramid.CacheData(&data));
+
+  // Written after the pyramid has moved on to another image of the same
+  // size, as it would be on a separate thread.
+  pyramid.PreProcess(cv::Mat(53, 71, CV_8UC3, cv::Scalar::all(7)));
+  const char *root = getenv("TEST_TMPDIR");
+  const std::string path =
+      std::string(root ? root : "/tmp") + "/snapshot.pyramid";
+  const PyramidCacheKey key{1234, 5678, 9};
+  ASSERT_TRUE(WritePyramidCache(path, key, data));
+
+  MinMaxPyramid built, loaded;
+  built.PreProcess(input);
+  ASSERT_TRUE(loaded.LoadCache(path, key));
+  for (int scale = built.MinScale(); scale <= built.MaxScale(); scale++)
+    EXPECT_THAT(loaded.Relevel(scale), ImageEq(built.Relevel(scale)));
+}
@@ -0,0 +1,54 @@
+#include "output_format.h"
+
+#include <algorithm>
+#include <cctype>
+#include <initializer_list>
+
+namespace {
+
+std::string LowerExtension(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  const size_t slash = path.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return "";
+  std::string extension = path.substr(dot + 1);
+  std::transform(extension.begin(), extension.end(), extension.begin(),
+                 ::tolower);
+  return extension;
+}
+
+bool IsOneOf(const std::string &extension,
+             std::initializer_list<const char *> known) {
+  for (const char *candidate : known) {
+    if (extension == candidate)
+      return true;
+  }
+  return false;
+}
+
+} // namespace
+
+cv::Mat ConvertForFormat(const cv::Mat &image, const std::string &path) {
+  const int depth = image.depth();
+  if (depth == CV_8U)
+    return image;
+  // What OpenCV's encoders keep without narrowing.
+  const std::string extension = LowerExtension(path);
+  const bool takes_16u = IsOneOf(
+      extension, {"png", "tif", "tiff", "ppm", "pgm", "pnm", "pxm", "jp2"});
+  const bool takes_32f =
+      IsOneOf(extension, {"tif", "tiff", "exr", "hdr", "pfm"});
+  if ((depth == CV_16U && takes_16u) || (depth == CV_32F && takes_32f))
+    return image;
+
+  cv::Mat converted;
+  if (depth == CV_32F && takes_16u)
+    image.convertTo(converted, CV_16U, 65535.0);
+  else if (depth == CV_32F)
+    image.convertTo(converted, CV_8U, 255.0);
+  else if (depth == CV_16U)
+    image.convertTo(converted, CV_8U, 1.0 / 257);
+  else
+    return image;
+  return converted;
+}
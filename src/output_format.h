@@ -0,0 +1,20 @@
+#ifndef OUTPUT_FORMAT_
+#define OUTPUT_FORMAT_
+
+#include <string>
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// Converts a releveled image to a depth that the format it's being written as
+// (going by the extension of `path`) can hold, so that it can go straight to
+// cv::imwrite or cv::imencode. Left to themselves, those narrow a deeper
+// image with a plain convertTo(CV_8U), which saturates 16-bit images to white
+// and rounds float ones, which run from 0 to 1, to black.
+//
+// Relevel's results span the full range of their type, so narrowing is a
+// rescale: 16-bit to 8-bit divides by 257, and float multiplies by 65535 for
+// formats that can take 16 bits, or by 255 for those that can't. Images the
+// format can already hold come back as they are.
+cv::Mat ConvertForFormat(const cv::Mat &image, const std::string &path);
+
+#endif // OUTPUT_FORMAT_
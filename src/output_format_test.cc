@@ -0,0 +1,82 @@
+#include "output_format.h"
+
+#include <stdlib.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+std::string TempPath(const std::string &name) {
+  const char *root = getenv("TEST_TMPDIR");
+  return std::string(root ? root : "/tmp") + "/" + name;
+}
+
+// Writes `image` as `name`, the way the callers do, and reads it back.
+cv::Mat RoundTrip(const cv::Mat &image, const std::string &name) {
+  const std::string path = TempPath(name);
+  EXPECT_TRUE(cv::imwrite(path, ConvertForFormat(image, path)));
+  return cv::imread(path, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+}
+
+} // namespace
+
+TEST(ConvertForFormat, KeepsDepthsTheFormatCanHold) {
+  const cv::Mat wide(4, 4, CV_16UC3, cv::Scalar::all(1000));
+  const cv::Mat fine(4, 4, CV_32FC3, cv::Scalar::all(0.25));
+  EXPECT_EQ(CV_16U, ConvertForFormat(wide, "a.png").depth());
+  EXPECT_EQ(CV_16U, ConvertForFormat(wide, "dir.x/a.TIFF").depth());
+  EXPECT_EQ(CV_32F, ConvertForFormat(fine, "a.exr").depth());
+  EXPECT_EQ(CV_32F, ConvertForFormat(fine, "a.tif").depth());
+  const cv::Mat narrow(4, 4, CV_8UC3, cv::Scalar::all(9));
+  EXPECT_EQ(narrow.data, ConvertForFormat(narrow, "a.jpg").data);
+}
+
+TEST(ConvertForFormat, ScalesRatherThanSaturates) {
+  // Full range in, full range out, rather than everything going white (or
+  // black, for float).
+  cv::Mat wide(2, 3, CV_16UC3, cv::Scalar::all(0));
+  wide.at<cv::Vec3w>(1, 2) = cv::Vec3w(65535, 32896, 257);
+  const cv::Mat narrowed = ConvertForFormat(wide, "a.jpg");
+  ASSERT_EQ(CV_8UC3, narrowed.type());
+  EXPECT_EQ(cv::Vec3b(0, 0, 0), narrowed.at<cv::Vec3b>(0, 0));
+  EXPECT_EQ(cv::Vec3b(255, 128, 1), narrowed.at<cv::Vec3b>(1, 2));
+
+  cv::Mat fine(2, 3, CV_32FC3, cv::Scalar::all(0));
+  fine.at<cv::Vec3f>(1, 2) = cv::Vec3f(1, 0.5f, 0);
+  const cv::Mat to_8u = ConvertForFormat(fine, "a.jpg");
+  ASSERT_EQ(CV_8UC3, to_8u.type());
+  EXPECT_EQ(cv::Vec3b(255, 128, 0), to_8u.at<cv::Vec3b>(1, 2));
+  // PNG can keep 16 of the bits.
+  const cv::Mat to_16u = ConvertForFormat(fine, "a.png");
+  ASSERT_EQ(CV_16UC3, to_16u.type());
+  EXPECT_EQ(cv::Vec3w(65535, 32768, 0), to_16u.at<cv::Vec3w>(1, 2));
+}
+
+TEST(ConvertForFormat, RoundTripsThroughFiles) {
+  // Flat, so that JPEG gives back exactly what it was given.
+  const cv::Mat wide(16, 16, CV_16UC3, cv::Scalar(65535, 32896, 0));
+  const cv::Mat jpeg = RoundTrip(wide, "wide.jpg");
+  ASSERT_EQ(CV_8UC3, jpeg.type());
+  EXPECT_LE(cv::norm(jpeg, cv::Mat(16, 16, CV_8UC3, cv::Scalar(255, 128, 0)),
+                     cv::NORM_INF),
+            1);
+  const cv::Mat png = RoundTrip(wide, "wide.png");
+  ASSERT_EQ(CV_16UC3, png.type());
+  EXPECT_EQ(0, cv::norm(png, wide, cv::NORM_INF));
+
+  const cv::Mat fine(16, 16, CV_32FC3, cv::Scalar(1, 0.5, 0));
+  const cv::Mat fine_jpeg = RoundTrip(fine, "fine.jpg");
+  ASSERT_EQ(CV_8UC3, fine_jpeg.type());
+  EXPECT_LE(
+      cv::norm(fine_jpeg, cv::Mat(16, 16, CV_8UC3, cv::Scalar(255, 128, 0)),
+               cv::NORM_INF),
+      1);
+  const cv::Mat fine_png = RoundTrip(fine, "fine.png");
+  ASSERT_EQ(CV_16UC3, fine_png.type());
+  EXPECT_EQ(0, cv::norm(fine_png,
+                        cv::Mat(16, 16, CV_16UC3, cv::Scalar(65535, 32768, 0)),
+                        cv::NORM_INF));
+}
@@ -0,0 +1,45 @@
+#ifndef PARALLEL_FOR_
+#define PARALLEL_FOR_
+
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+// Splits [0, count) into contiguous chunks and calls fn(begin, end) for each,
+// one chunk per thread, returning once they've all finished. At most `threads`
+// chunks are made, and none smaller than `min_chunk` (except when count itself
+// is), since starting a thread costs something too. The calling thread does
+// the first chunk itself, so with one chunk this is just a function call.
+//
+// Threads are started fresh each time. That's fine for the handful of big
+// chunks of work this is meant for; it's not meant for fine-grained tasks.
+template <typename Fn>
+void ParallelFor(int count, int threads, int min_chunk, Fn fn) {
+  if (count <= 0)
+    return;
+  const int max_chunks = std::max(1, count / std::max(min_chunk, 1));
+  const int chunks = std::max(1, std::min(threads, max_chunks));
+  if (chunks == 1) {
+    fn(0, count);
+    return;
+  }
+
+  // Spread the remainder over the first few chunks, so sizes differ by at
+  // most one.
+  auto chunk_begin = [count, chunks](int chunk) {
+    return static_cast<int>(static_cast<long long>(count) * chunk / chunks);
+  };
+  std::vector<std::thread> workers;
+  workers.reserve(chunks - 1);
+  for (int chunk = 1; chunk < chunks; chunk++) {
+    workers.emplace_back(
+        [&fn, begin = chunk_begin(chunk), end = chunk_begin(chunk + 1)] {
+          fn(begin, end);
+        });
+  }
+  fn(0, chunk_begin(1));
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+#endif // PARALLEL_FOR_
@@ -0,0 +1,52 @@
+#include "parallel_for.h"
+
+#include <atomic>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+
+TEST(ParallelFor, CoversEveryIndexOnce) {
+  std::vector<std::atomic<int>> visits(103);
+  for (std::atomic<int> &count : visits)
+    count = 0;
+  ParallelFor(visits.size(), 4, 1, [&](int begin, int end) {
+    for (int i = begin; i < end; i++)
+      visits[i]++;
+  });
+  for (const std::atomic<int> &count : visits)
+    EXPECT_EQ(1, count);
+}
+
+TEST(ParallelFor, RespectsThreadsAndMinChunk) {
+  std::mutex mutex;
+  std::vector<std::pair<int, int>> chunks;
+  auto record = [&](int begin, int end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    chunks.emplace_back(begin, end);
+  };
+
+  ParallelFor(100, 8, 30, record);
+  // Only room for three chunks of at least 30.
+  EXPECT_THAT(chunks, ::testing::UnorderedElementsAre(
+                          std::make_pair(0, 33), std::make_pair(33, 66),
+                          std::make_pair(66, 100)));
+
+  chunks.clear();
+  ParallelFor(100, 2, 1, record);
+  EXPECT_THAT(chunks, ::testing::UnorderedElementsAre(
+                          std::make_pair(0, 50), std::make_pair(50, 100)));
+}
+
+TEST(ParallelFor, SingleChunkRunsOnCallingThread) {
+  std::set<std::thread::id> ids;
+  auto record = [&](int, int) { ids.insert(std::this_thread::get_id()); };
+  ParallelFor(10, 1, 1, record);
+  // Too small to be worth splitting.
+  ParallelFor(10, 8, 20, record);
+  EXPECT_THAT(ids, ::testing::ElementsAre(std::this_thread::get_id()));
+}
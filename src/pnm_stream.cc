@@ -0,0 +1,121 @@
+#include "pnm_stream.h"
+
+#include <algorithm>
+#include <cctype>
+
+namespace {
+
+// Reads the next whitespace-separated header number, skipping comments.
+bool ReadHeaderInt(FILE *file, int *value) {
+  int c = fgetc(file);
+  while (c != EOF && (isspace(c) || c == '#')) {
+    if (c == '#') {
+      while (c != EOF && c != '\n')
+        c = fgetc(file);
+    }
+    c = fgetc(file);
+  }
+  if (c == EOF || !isdigit(c))
+    return false;
+  *value = 0;
+  for (; c != EOF && isdigit(c); c = fgetc(file))
+    *value = *value * 10 + (c - '0');
+  // Exactly one whitespace character separates the header from the data, and
+  // we've just consumed it.
+  return c != EOF && isspace(c);
+}
+
+} // namespace
+
+PnmReader::~PnmReader() {
+  if (file_ != nullptr)
+    fclose(file_);
+}
+
+bool PnmReader::Open(const std::string &path) {
+  file_ = fopen(path.c_str(), "rb");
+  if (file_ == nullptr)
+    return false;
+
+  char magic[2];
+  int max_value;
+  if (fread(magic, 1, 2, file_) != 2 || magic[0] != 'P' ||
+      (magic[1] != '5' && magic[1] != '6') ||
+      !ReadHeaderInt(file_, &size_.width) ||
+      !ReadHeaderInt(file_, &size_.height) ||
+      !ReadHeaderInt(file_, &max_value) || max_value != 255 ||
+      size_.width <= 0 || size_.height <= 0)
+    return false;
+
+  type_ = magic[1] == '5' ? CV_8UC1 : CV_8UC3;
+  data_offset_ = ftell(file_);
+  next_row_ = 0;
+  return true;
+}
+
+bool PnmReader::ReadRows(int count, cv::Mat *rows) {
+  count = std::min(count, size_.height - next_row_);
+  if (file_ == nullptr || count <= 0)
+    return false;
+  rows->create(count, size_.width, type_);
+  const size_t row_bytes = size_.width * rows->elemSize();
+  for (int row = 0; row < count; row++) {
+    if (fread(rows->ptr(row), 1, row_bytes, file_) != row_bytes)
+      return false;
+  }
+  next_row_ += count;
+  if (type_ == CV_8UC3)
+    cv::cvtColor(*rows, *rows, cv::COLOR_RGB2BGR);
+  return true;
+}
+
+bool PnmReader::Rewind() {
+  if (file_ == nullptr || fseek(file_, data_offset_, SEEK_SET) != 0)
+    return false;
+  next_row_ = 0;
+  return true;
+}
+
+PnmWriter::~PnmWriter() { Close(); }
+
+bool PnmWriter::Open(const std::string &path, cv::Size size, int type) {
+  if (type != CV_8UC1 && type != CV_8UC3)
+    return false;
+  file_ = fopen(path.c_str(), "wb");
+  if (file_ == nullptr)
+    return false;
+  size_ = size;
+  type_ = type;
+  rows_written_ = 0;
+  ok_ = fprintf(file_, "P%c\n%d %d\n255\n", type == CV_8UC1 ? '5' : '6',
+                size.width, size.height) > 0;
+  return ok_;
+}
+
+bool PnmWriter::WriteRows(const cv::Mat &rows) {
+  if (file_ == nullptr || rows.type() != type_ || rows.cols != size_.width ||
+      rows_written_ + rows.rows > size_.height) {
+    ok_ = false;
+    return false;
+  }
+  cv::Mat converted = rows;
+  if (type_ == CV_8UC3)
+    cv::cvtColor(rows, converted, cv::COLOR_BGR2RGB);
+  const size_t row_bytes = size_.width * converted.elemSize();
+  for (int row = 0; row < converted.rows; row++) {
+    if (fwrite(converted.ptr(row), 1, row_bytes, file_) != row_bytes) {
+      ok_ = false;
+      return false;
+    }
+  }
+  rows_written_ += rows.rows;
+  return true;
+}
+
+bool PnmWriter::Close() {
+  if (file_ == nullptr)
+    return ok_;
+  ok_ = fclose(file_) == 0 && ok_ && rows_written_ == size_.height;
+  file_ = nullptr;
+  return ok_;
+}
@@ -0,0 +1,71 @@
+#ifndef PNM_STREAM_
+#define PNM_STREAM_
+
+#include <cstdio>
+#include <string>
+
+#include "opencv4/opencv2/opencv.hpp"
+#include "row_stream.h"
+
+// Streaming access to binary PGM (grayscale) and PPM (color) files, with
+// 8 bits per channel. OpenCV can only decode whole images, but these formats
+// are just a header and raw rows, so they can be read and written a few rows
+// at a time. Big mosaics can be converted to and from them with most image
+// tools.
+//
+// Color rows come out (and go in) as BGR, the same as cv::imread and
+// cv::imwrite.
+
+class PnmReader : public RowSource {
+public:
+  PnmReader() = default;
+  ~PnmReader() override;
+
+  PnmReader(const PnmReader &) = delete;
+  PnmReader &operator=(const PnmReader &) = delete;
+
+  // Returns false if the file can't be opened or isn't a PNM we understand.
+  bool Open(const std::string &path);
+
+  cv::Size size() const override { return size_; }
+  int type() const override { return type_; }
+  bool ReadRows(int count, cv::Mat *rows) override;
+  bool Rewind() override;
+
+private:
+  FILE *file_ = nullptr;
+  cv::Size size_;
+  int type_ = CV_8UC3;
+  // Where the pixel data starts, and how many rows we've read so far.
+  long data_offset_ = 0;
+  int next_row_ = 0;
+};
+
+class PnmWriter : public RowSink {
+public:
+  PnmWriter() = default;
+  // Closes the file if Close() hasn't been called already.
+  ~PnmWriter() override;
+
+  PnmWriter(const PnmWriter &) = delete;
+  PnmWriter &operator=(const PnmWriter &) = delete;
+
+  // Writes the header for an image of the given size and type, which must be
+  // CV_8UC1 (PGM) or CV_8UC3 (PPM).
+  bool Open(const std::string &path, cv::Size size, int type);
+
+  bool WriteRows(const cv::Mat &rows) override;
+
+  // Returns false if anything went wrong along the way, including not having
+  // written exactly as many rows as promised.
+  bool Close();
+
+private:
+  FILE *file_ = nullptr;
+  cv::Size size_;
+  int type_ = CV_8UC3;
+  int rows_written_ = 0;
+  bool ok_ = true;
+};
+
+#endif // PNM_STREAM_
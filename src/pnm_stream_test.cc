@@ -0,0 +1,64 @@
+#include "pnm_stream.h"
+
+#include <stdlib.h>
+
+#include <string>
+
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+std::string TempPath(const std::string &name) {
+  const char *root = getenv("TEST_TMPDIR");
+  return std::string(root ? root : "/tmp") + "/" + name;
+}
+
+} // namespace
+
+TEST(PnmStream, RoundTripsInStrips) {
+  for (const int type : {CV_8UC1, CV_8UC3}) {
+    cv::Mat image(37, 23, type);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+    const std::string path =
+        TempPath(type == CV_8UC1 ? "strips.pgm" : "strips.ppm");
+
+    PnmWriter writer;
+    ASSERT_TRUE(writer.Open(path, image.size(), type));
+    for (int row = 0; row < image.rows; row += 10)
+      ASSERT_TRUE(writer.WriteRows(
+          image.rowRange(row, std::min(row + 10, image.rows))));
+    ASSERT_TRUE(writer.Close());
+
+    PnmReader reader;
+    ASSERT_TRUE(reader.Open(path));
+    EXPECT_EQ(image.size(), reader.size());
+    EXPECT_EQ(type, reader.type());
+    // Twice, to check that rewinding works.
+    for (int pass = 0; pass < 2; pass++) {
+      cv::Mat read, rows;
+      while (reader.ReadRows(8, &rows))
+        read.push_back(rows);
+      ASSERT_EQ(image.size(), read.size());
+      EXPECT_EQ(0, cv::norm(image, read, cv::NORM_INF));
+      ASSERT_TRUE(reader.Rewind());
+    }
+  }
+}
+
+TEST(PnmStream, WriterNoticesMissingRows) {
+  cv::Mat image(10, 10, CV_8UC3, cv::Scalar::all(7));
+  PnmWriter writer;
+  ASSERT_TRUE(writer.Open(TempPath("short.ppm"), cv::Size(10, 20), CV_8UC3));
+  ASSERT_TRUE(writer.WriteRows(image));
+  EXPECT_FALSE(writer.Close());
+}
+
+TEST(PnmStream, RejectsOtherFormats) {
+  const std::string path = TempPath("not_pnm.ppm");
+  FILE *file = fopen(path.c_str(), "wb");
+  fputs("P3\n2 2\n255\n0 0 0 0 0 0 0 0 0 0 0 0\n", file);
+  fclose(file);
+  PnmReader reader;
+  EXPECT_FALSE(reader.Open(path));
+}
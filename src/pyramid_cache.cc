@@ -0,0 +1,298 @@
+#include "pyramid_cache.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <tuple>
+
+namespace {
+
+// Bumped whenever the format or what goes into it changes. 02: images are
+// stored in OpenCV's BGR order, where the editor used to convert to RGB first.
+constexpr char kMagic[8] = {'U', 'S', 'P', 'Y', 'R', 'M', '0', '2'};
+constexpr size_t kAlignment = 64;
+// How much of each end of the source file goes into the fingerprint.
+constexpr size_t kFingerprintChunk = 64 << 10;
+constexpr char kExtension[] = ".pyramid";
+
+struct Header {
+  char magic[8];
+  uint64_t key_size;
+  int64_t key_mtime_ns;
+  uint64_t key_fingerprint;
+  int32_t type;
+  int32_t rows;
+  int32_t cols;
+  int32_t min_scale;
+  int32_t max_scale;
+  int32_t num_levels;
+};
+
+// Where one Mat lives within the file.
+struct Section {
+  size_t offset;
+  int rows;
+  int cols;
+};
+
+// Relevel indexes the levels by scale, so every scale in range needs one.
+bool ValidScales(int min_scale, int max_scale, int num_levels) {
+  return 0 <= min_scale && min_scale <= max_scale && max_scale < num_levels;
+}
+
+size_t AlignUp(size_t offset) {
+  return (offset + kAlignment - 1) / kAlignment * kAlignment;
+}
+
+// The image, then min and max for each level in turn. Level sizes follow from
+// the image size, so they don't need storing.
+std::vector<Section> Layout(int type, int rows, int cols, int num_levels,
+                            size_t *total_bytes) {
+  const size_t pixel_bytes = CV_ELEM_SIZE(type);
+  std::vector<Section> sections;
+  size_t offset = AlignUp(sizeof(Header));
+  auto add = [&](int section_rows, int section_cols) {
+    sections.push_back(Section{offset, section_rows, section_cols});
+    offset = AlignUp(offset + pixel_bytes * section_rows * section_cols);
+  };
+  add(rows, cols);
+  for (int level = 0; level < num_levels; level++) {
+    rows = (rows + 1) / 2;
+    cols = (cols + 1) / 2;
+    add(rows, cols);
+    add(rows, cols);
+  }
+  *total_bytes = offset;
+  return sections;
+}
+
+uint64_t Fnv1a(const void *data, size_t size, uint64_t hash) {
+  const uchar *bytes = static_cast<const uchar *>(data);
+  for (size_t i = 0; i < size; i++)
+    hash = (hash ^ bytes[i]) * 1099511628211ull;
+  return hash;
+}
+
+constexpr uint64_t kFnvOffset = 14695981039346656037ull;
+
+bool WriteMat(FILE *file, size_t offset, const cv::Mat &mat) {
+  // Zero padding up to the section start.
+  static const char kZeros[kAlignment] = {};
+  const long position = ftell(file);
+  if (position < 0 || static_cast<size_t>(position) > offset ||
+      fwrite(kZeros, 1, offset - position, file) != offset - position)
+    return false;
+  const size_t row_bytes = mat.cols * mat.elemSize();
+  for (int row = 0; row < mat.rows; row++) {
+    if (fwrite(mat.ptr(row), 1, row_bytes, file) != row_bytes)
+      return false;
+  }
+  return true;
+}
+
+} // namespace
+
+bool PyramidCacheKey::ForFile(const std::string &path, PyramidCacheKey *key) {
+  struct stat info;
+  if (stat(path.c_str(), &info) != 0)
+    return false;
+  key->size = info.st_size;
+  key->mtime_ns =
+      static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+      info.st_mtim.tv_nsec;
+
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr)
+    return false;
+  std::vector<char> chunk(kFingerprintChunk);
+  uint64_t hash = kFnvOffset;
+  size_t read = fread(chunk.data(), 1, chunk.size(), file);
+  hash = Fnv1a(chunk.data(), read, hash);
+  if (key->size > 2 * kFingerprintChunk &&
+      fseek(file, -static_cast<long>(kFingerprintChunk), SEEK_END) == 0) {
+    read = fread(chunk.data(), 1, chunk.size(), file);
+    hash = Fnv1a(chunk.data(), read, hash);
+  }
+  fclose(file);
+  key->fingerprint = hash;
+  return true;
+}
+
+std::string PyramidCachePath(const std::string &cache_dir,
+                             const std::string &source_path) {
+  char absolute[PATH_MAX];
+  const std::string canonical =
+      realpath(source_path.c_str(), absolute) ? absolute : source_path;
+  char name[32];
+  snprintf(name, sizeof(name), "%016llx%s",
+           static_cast<unsigned long long>(
+               Fnv1a(canonical.data(), canonical.size(), kFnvOffset)),
+           kExtension);
+  return cache_dir + "/" + name;
+}
+
+bool WritePyramidCache(const std::string &path, const PyramidCacheKey &key,
+                       const PyramidData &data) {
+  const int num_levels = static_cast<int>(data.min_levels.size());
+  const int depth = data.image.depth();
+  if (data.image.empty() ||
+      (depth != CV_8U && depth != CV_16U && depth != CV_32F) ||
+      data.max_levels.size() != data.min_levels.size() ||
+      !ValidScales(data.min_scale, data.max_scale, num_levels))
+    return false;
+  size_t total_bytes;
+  const std::vector<Section> sections = Layout(
+      data.image.type(), data.image.rows, data.image.cols, num_levels,
+      &total_bytes);
+
+  Header header;
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.key_size = key.size;
+  header.key_mtime_ns = key.mtime_ns;
+  header.key_fingerprint = key.fingerprint;
+  header.type = data.image.type();
+  header.rows = data.image.rows;
+  header.cols = data.image.cols;
+  header.min_scale = data.min_scale;
+  header.max_scale = data.max_scale;
+  header.num_levels = num_levels;
+
+  const std::string temp_path = path + ".tmp" + std::to_string(getpid());
+  FILE *file = fopen(temp_path.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            WriteMat(file, sections[0].offset, data.image);
+  for (int level = 0; ok && level < num_levels; level++) {
+    const Section &min_section = sections[1 + 2 * level];
+    const Section &max_section = sections[2 + 2 * level];
+    const cv::Mat &min_level = data.min_levels[level];
+    const cv::Mat &max_level = data.max_levels[level];
+    ok = min_level.type() == header.type &&
+         max_level.type() == header.type &&
+         min_level.size() == cv::Size(min_section.cols, min_section.rows) &&
+         max_level.size() == min_level.size() &&
+         WriteMat(file, min_section.offset, min_level) &&
+         WriteMat(file, max_section.offset, max_level);
+  }
+  // Pad out the last section, so the file is exactly the size we'll expect.
+  ok = ok && WriteMat(file, total_bytes, cv::Mat());
+  ok = fclose(file) == 0 && ok;
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool MapPyramidCache(const std::string &path, const PyramidCacheKey &key,
+                     PyramidData *data) {
+  const int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 ||
+      static_cast<size_t>(info.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  const size_t file_bytes = info.st_size;
+  void *mapped = mmap(nullptr, file_bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (mapped == MAP_FAILED)
+    return false;
+  std::shared_ptr<const void> storage(
+      mapped, [file_bytes](const void *p) {
+        munmap(const_cast<void *>(p), file_bytes);
+      });
+
+  Header header;
+  std::memcpy(&header, mapped, sizeof(header));
+  const PyramidCacheKey stored{header.key_size, header.key_mtime_ns,
+                               header.key_fingerprint};
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      !(stored == key) ||
+      (CV_MAT_DEPTH(header.type) != CV_8U &&
+       CV_MAT_DEPTH(header.type) != CV_16U &&
+       CV_MAT_DEPTH(header.type) != CV_32F) ||
+      header.rows <= 0 || header.cols <= 0 || header.num_levels < 0 ||
+      header.num_levels > 64 ||
+      !ValidScales(header.min_scale, header.max_scale, header.num_levels))
+    return false;
+  size_t total_bytes;
+  const std::vector<Section> sections = Layout(
+      header.type, header.rows, header.cols, header.num_levels, &total_bytes);
+  if (total_bytes != file_bytes)
+    return false;
+
+  // Nothing ever writes through these (and the mapping is read-only, so
+  // anything that tried would crash rather than corrupt the cache).
+  uchar *base = static_cast<uchar *>(mapped);
+  auto mat_at = [&](const Section &section) {
+    return cv::Mat(section.rows, section.cols, header.type,
+                   base + section.offset);
+  };
+  data->image = mat_at(sections[0]);
+  data->min_levels.clear();
+  data->max_levels.clear();
+  for (int level = 0; level < header.num_levels; level++) {
+    data->min_levels.push_back(mat_at(sections[1 + 2 * level]));
+    data->max_levels.push_back(mat_at(sections[2 + 2 * level]));
+  }
+  data->min_scale = header.min_scale;
+  data->max_scale = header.max_scale;
+  data->storage = std::move(storage);
+  // Marks it as recently used. If that fails (a read-only cache, say), the
+  // file just gets trimmed sooner than it might have.
+  utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+  return true;
+}
+
+int TrimPyramidCache(const std::string &cache_dir, uint64_t max_bytes) {
+  DIR *dir = opendir(cache_dir.c_str());
+  if (dir == nullptr)
+    return 0;
+  // (mtime, size, path) of each cache file. Temporary files are left alone:
+  // they're either about to be renamed into place, or will be overwritten by
+  // the next write from a process with the same pid.
+  std::vector<std::tuple<int64_t, uint64_t, std::string>> files;
+  uint64_t total_bytes = 0;
+  const size_t extension_length = sizeof(kExtension) - 1;
+  while (const dirent *entry = readdir(dir)) {
+    const std::string name = entry->d_name;
+    if (name.size() <= extension_length ||
+        name.compare(name.size() - extension_length, extension_length,
+                     kExtension) != 0)
+      continue;
+    const std::string path = cache_dir + "/" + name;
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode))
+      continue;
+    files.emplace_back(static_cast<int64_t>(info.st_mtim.tv_sec) * 1000000000 +
+                           info.st_mtim.tv_nsec,
+                       info.st_size, path);
+    total_bytes += info.st_size;
+  }
+  closedir(dir);
+
+  std::sort(files.begin(), files.end());
+  int deleted = 0;
+  for (const auto &file : files) {
+    if (total_bytes <= max_bytes)
+      break;
+    if (unlink(std::get<2>(file).c_str()) == 0) {
+      total_bytes -= std::get<1>(file);
+      deleted++;
+    }
+  }
+  return deleted;
+}
@@ -0,0 +1,76 @@
+#ifndef PYRAMID_CACHE_
+#define PYRAMID_CACHE_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// On-disk cache of pre-processed pyramids, so that re-opening an image can skip
+// both decoding it and building its pyramid.
+//
+// The file format is just a header followed by the raw pixel rows of the image
+// and each level, each section aligned to a cache line. That makes the file
+// usable in place: loading it maps it into memory and points cv::Mat headers
+// straight at it, with no copying and no parsing beyond the header. The price
+// is size on disk: a bit under three times the decoded image.
+//
+// The format is native-endian and specific to this program; it's a cache, not
+// an interchange format. Files from other versions are simply rejected.
+
+// Identifies the version of a source file that a cache file was built from.
+struct PyramidCacheKey {
+  uint64_t size = 0;
+  int64_t mtime_ns = 0;
+  // Hash of the first and last chunks of the file, to catch files that were
+  // replaced without their size or mtime changing (e.g. copied with cp -p).
+  uint64_t fingerprint = 0;
+
+  // Returns false if the file can't be read.
+  static bool ForFile(const std::string &path, PyramidCacheKey *key);
+
+  bool operator==(const PyramidCacheKey &other) const {
+    return size == other.size && mtime_ns == other.mtime_ns &&
+           fingerprint == other.fingerprint;
+  }
+};
+
+// Where the cache file for the given source file goes, within cache_dir. The
+// name is derived from the source's absolute path, so each source file has at
+// most one cache file, which gets overwritten as the source changes.
+std::string PyramidCachePath(const std::string &cache_dir,
+                             const std::string &source_path);
+
+// Everything MinMaxPyramid needs to skip PreProcess.
+struct PyramidData {
+  cv::Mat image;
+  std::vector<cv::Mat> min_levels;
+  std::vector<cv::Mat> max_levels;
+  int min_scale = 0;
+  int max_scale = 0;
+  // When loaded by MapPyramidCache, the mapped file that all of the Mats above
+  // point into. It's unmapped when the last copy of this goes away, so
+  // whoever holds the Mats needs to hold this too.
+  std::shared_ptr<const void> storage;
+};
+
+// Writes the data to `path`, via a temporary file and a rename, so that readers
+// never see a half-written cache file. Images may be CV_8U, CV_16U or CV_32F.
+bool WritePyramidCache(const std::string &path, const PyramidCacheKey &key,
+                       const PyramidData &data);
+
+// Maps a file written by WritePyramidCache. Returns false if it doesn't exist,
+// is malformed, or was built from a different version of the source (i.e. its
+// key doesn't match). A hit bumps the file's mtime, which is what
+// TrimPyramidCache goes by.
+bool MapPyramidCache(const std::string &path, const PyramidCacheKey &key,
+                     PyramidData *data);
+
+// Keeps the cache files in cache_dir within max_bytes, deleting the least
+// recently used (i.e. written or mapped) first. Returns how many it deleted.
+// Files that are still mapped stay usable until they're unmapped.
+int TrimPyramidCache(const std::string &cache_dir, uint64_t max_bytes);
+
+#endif // PYRAMID_CACHE_
@@ -0,0 +1,183 @@
+#include "pyramid_cache.h"
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <utility>
+
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+std::string TempPath(const std::string &name) {
+  const char *root = getenv("TEST_TMPDIR");
+  return std::string(root ? root : "/tmp") + "/" + name;
+}
+
+void WriteFile(const std::string &path, const std::string &contents) {
+  FILE *file = fopen(path.c_str(), "wb");
+  fwrite(contents.data(), 1, contents.size(), file);
+  fclose(file);
+}
+
+PyramidData SmallPyramid(int type = CV_8UC1) {
+  PyramidData data;
+  data.image = cv::Mat(5, 3, type);
+  cv::randu(data.image, cv::Scalar::all(0), cv::Scalar::all(256));
+  for (cv::Size size : {cv::Size(2, 3), cv::Size(1, 2), cv::Size(1, 1)}) {
+    data.min_levels.push_back(cv::Mat(size, type, cv::Scalar::all(1)));
+    data.max_levels.push_back(cv::Mat(size, type, cv::Scalar::all(2)));
+  }
+  data.min_scale = 0;
+  data.max_scale = 2;
+  return data;
+}
+
+} // namespace
+
+TEST(PyramidCacheKey, ChangesWithContents) {
+  const std::string path = TempPath("key_source");
+  WriteFile(path, "some image");
+  PyramidCacheKey before;
+  ASSERT_TRUE(PyramidCacheKey::ForFile(path, &before));
+  EXPECT_EQ(10u, before.size);
+
+  // Same size, and possibly the same mtime if the clock is coarse.
+  WriteFile(path, "some other");
+  PyramidCacheKey after;
+  ASSERT_TRUE(PyramidCacheKey::ForFile(path, &after));
+  EXPECT_FALSE(before == after);
+
+  EXPECT_FALSE(PyramidCacheKey::ForFile(TempPath("missing"), &after));
+}
+
+TEST(PyramidCachePath, DependsOnlyOnTheSource) {
+  EXPECT_EQ(PyramidCachePath("/cache", "/photos/a.tif"),
+            PyramidCachePath("/cache", "/photos/a.tif"));
+  EXPECT_NE(PyramidCachePath("/cache", "/photos/a.tif"),
+            PyramidCachePath("/cache", "/photos/b.tif"));
+  EXPECT_EQ(0u, PyramidCachePath("/cache", "/photos/a.tif").find("/cache/"));
+}
+
+TEST(PyramidCache, MapsWhatWasWritten) {
+  const std::string path = TempPath("small.pyramid");
+  const PyramidData written = SmallPyramid();
+  const PyramidCacheKey key{1, 2, 3};
+  ASSERT_TRUE(WritePyramidCache(path, key, written));
+
+  PyramidData mapped;
+  ASSERT_TRUE(MapPyramidCache(path, key, &mapped));
+  EXPECT_NE(nullptr, mapped.storage);
+  EXPECT_EQ(0, cv::norm(written.image, mapped.image, cv::NORM_INF));
+  ASSERT_EQ(3u, mapped.min_levels.size());
+  ASSERT_EQ(3u, mapped.max_levels.size());
+  for (int level = 0; level < 3; level++) {
+    EXPECT_EQ(0, cv::norm(written.min_levels[level], mapped.min_levels[level],
+                          cv::NORM_INF));
+    EXPECT_EQ(0, cv::norm(written.max_levels[level], mapped.max_levels[level],
+                          cv::NORM_INF));
+  }
+  EXPECT_EQ(0, mapped.min_scale);
+  EXPECT_EQ(2, mapped.max_scale);
+}
+
+TEST(PyramidCache, KeepsDeeperPixels) {
+  const std::string path = TempPath("deep.pyramid");
+  const PyramidCacheKey key{1, 2, 3};
+  for (int type : {CV_16UC3, CV_32FC1}) {
+    const PyramidData written = SmallPyramid(type);
+    ASSERT_TRUE(WritePyramidCache(path, key, written));
+    PyramidData mapped;
+    ASSERT_TRUE(MapPyramidCache(path, key, &mapped));
+    EXPECT_EQ(type, mapped.image.type());
+    EXPECT_EQ(0, cv::norm(written.image, mapped.image, cv::NORM_INF));
+    ASSERT_EQ(3u, mapped.max_levels.size());
+    EXPECT_EQ(type, mapped.max_levels[2].type());
+    EXPECT_EQ(0, cv::norm(written.max_levels[2], mapped.max_levels[2],
+                          cv::NORM_INF));
+  }
+}
+
+TEST(PyramidCache, RejectsMismatchedOrDamagedFiles) {
+  const std::string path = TempPath("damaged.pyramid");
+  const PyramidCacheKey key{1, 2, 3};
+  ASSERT_TRUE(WritePyramidCache(path, key, SmallPyramid()));
+
+  PyramidData mapped;
+  EXPECT_FALSE(MapPyramidCache(path, PyramidCacheKey{1, 2, 4}, &mapped));
+  ASSERT_EQ(0, truncate(path.c_str(), 100));
+  EXPECT_FALSE(MapPyramidCache(path, key, &mapped));
+  EXPECT_FALSE(MapPyramidCache(TempPath("missing.pyramid"), key, &mapped));
+
+  // Levels that don't match the image size are refused at write time.
+  PyramidData wrong = SmallPyramid();
+  wrong.min_levels[0] = cv::Mat(1, 1, CV_8UC1);
+  EXPECT_FALSE(WritePyramidCache(path, key, wrong));
+  // So are scales without a level for each of them.
+  wrong = SmallPyramid();
+  wrong.max_scale = 3;
+  EXPECT_FALSE(WritePyramidCache(path, key, wrong));
+}
+
+TEST(PyramidCache, RejectsCorruptedScales) {
+  const std::string path = TempPath("corrupted.pyramid");
+  const PyramidCacheKey key{1, 2, 3};
+  // The header ends with min_scale, max_scale and num_levels, after the
+  // magic, the key, and the type, rows and cols.
+  const long min_scale_offset = 8 + 3 * 8 + 3 * 4;
+  for (const std::pair<int, int> &scales :
+       {std::make_pair(-1, 2), std::make_pair(2, 1), std::make_pair(0, 3)}) {
+    ASSERT_TRUE(WritePyramidCache(path, key, SmallPyramid()));
+    FILE *file = fopen(path.c_str(), "r+b");
+    ASSERT_NE(nullptr, file);
+    const int32_t values[2] = {scales.first, scales.second};
+    fseek(file, min_scale_offset, SEEK_SET);
+    fwrite(values, sizeof(values), 1, file);
+    fclose(file);
+
+    PyramidData mapped;
+    EXPECT_FALSE(MapPyramidCache(path, key, &mapped))
+        << scales.first << ".." << scales.second;
+  }
+}
+
+TEST(PyramidCache, TrimsLeastRecentlyUsedFirst) {
+  const std::string dir = TempPath("trim");
+  mkdir(dir.c_str(), 0700);
+  const PyramidCacheKey key{1, 2, 3};
+  const PyramidData written = SmallPyramid();
+  const std::string paths[3] = {dir + "/a.pyramid", dir + "/b.pyramid",
+                                dir + "/c.pyramid"};
+  // Written a, b, c, but as if a minute apart, so that the order doesn't
+  // depend on how fine the filesystem's timestamps are.
+  for (int i = 0; i < 3; i++) {
+    ASSERT_TRUE(WritePyramidCache(paths[i], key, written));
+    const timespec times[2] = {{1000 + 60 * i, 0}, {1000 + 60 * i, 0}};
+    ASSERT_EQ(0, utimensat(AT_FDCWD, paths[i].c_str(), times, 0));
+  }
+  // Anything else in there is none of its business.
+  WriteFile(dir + "/other", std::string(1 << 20, 'x'));
+  struct stat info;
+  ASSERT_EQ(0, stat(paths[0].c_str(), &info));
+  const uint64_t file_bytes = info.st_size;
+
+  EXPECT_EQ(0, TrimPyramidCache(dir, 3 * file_bytes));
+  // Using a makes b the oldest.
+  PyramidData mapped;
+  ASSERT_TRUE(MapPyramidCache(paths[0], key, &mapped));
+  EXPECT_EQ(1, TrimPyramidCache(dir, 2 * file_bytes + 1));
+  EXPECT_NE(0, access(paths[1].c_str(), F_OK));
+  EXPECT_EQ(0, access(paths[0].c_str(), F_OK));
+  EXPECT_EQ(0, access(paths[2].c_str(), F_OK));
+  // Deleted from under the mapping, which carries on regardless.
+  EXPECT_EQ(2, TrimPyramidCache(dir, 0));
+  EXPECT_EQ(0, cv::norm(written.image, mapped.image, cv::NORM_INF));
+  EXPECT_EQ(0, access((dir + "/other").c_str(), F_OK));
+  EXPECT_EQ(0, TrimPyramidCache(TempPath("missing_dir"), 0));
+}
@@ -0,0 +1,482 @@
+#include "pyramid_server.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "opencv4/opencv2/opencv.hpp"
+#include "output_format.h"
+
+namespace {
+
+std::vector<std::string> SplitTabs(const std::string &line) {
+  std::vector<std::string> fields;
+  size_t begin = 0;
+  while (true) {
+    const size_t tab = line.find('\t', begin);
+    fields.push_back(line.substr(begin, tab - begin));
+    if (tab == std::string::npos)
+      return fields;
+    begin = tab + 1;
+  }
+}
+
+// Fills in *address for the socket at `path`, which has to fit in it.
+bool SocketAddress(const std::string &path, sockaddr_un *address,
+                   std::string *error) {
+  *address = sockaddr_un();
+  address->sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(address->sun_path)) {
+    *error = "bad socket path: " + path;
+    return false;
+  }
+  std::memcpy(address->sun_path, path.c_str(), path.size() + 1);
+  return true;
+}
+
+// A socket connected to the one at `path`, or -1.
+int Connect(const std::string &path, std::string *error) {
+  sockaddr_un address;
+  if (!SocketAddress(path, &address, error))
+    return -1;
+  const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    *error = std::string("socket: ") + std::strerror(errno);
+    return -1;
+  }
+  if (connect(fd, reinterpret_cast<const sockaddr *>(&address),
+              sizeof(address)) != 0) {
+    *error = "can't connect to " + path + ": " + std::strerror(errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Sends all of `data`. Never raises SIGPIPE: a client that's gone away just
+// makes this return false.
+bool SendAll(int fd, const std::string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    const ssize_t n =
+        send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    sent += n;
+  }
+  return true;
+}
+
+// Reads lines off a socket, a buffer at a time.
+class LineReader {
+public:
+  explicit LineReader(int fd) : fd_(fd) {}
+
+  // Returns false once the other end hangs up, or goes quiet for longer than
+  // the socket's receive timeout (a last line without a newline still
+  // counts).
+  bool Next(std::string *line) {
+    while (true) {
+      const size_t newline = buffer_.find('\n');
+      if (newline != std::string::npos) {
+        *line = buffer_.substr(0, newline);
+        buffer_.erase(0, newline + 1);
+        return true;
+      }
+      char chunk[4096];
+      const ssize_t n = read(fd_, chunk, sizeof(chunk));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0) {
+        if (buffer_.empty())
+          return false;
+        line->swap(buffer_);
+        buffer_.clear();
+        return true;
+      }
+      buffer_.append(chunk, n);
+    }
+  }
+
+private:
+  const int fd_;
+  std::string buffer_;
+};
+
+size_t MatBytes(const cv::Mat &mat) { return mat.total() * mat.elemSize(); }
+
+// ".jpg" for "dir/a.jpg"; empty if there's no extension.
+std::string Extension(const std::string &path) {
+  const size_t dot = path.rfind('.');
+  const size_t slash = path.rfind('/');
+  if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+    return "";
+  return path.substr(dot);
+}
+
+// Identifies an encoded output: which version of which file, at what scale,
+// in what format.
+std::string OutputKey(const std::string &input, const PyramidCacheKey &key,
+                      int scale, const std::string &extension) {
+  return input + '\0' + std::to_string(key.size) + ' ' +
+         std::to_string(key.mtime_ns) + ' ' + std::to_string(key.fingerprint) +
+         ' ' + std::to_string(scale) + ' ' + extension;
+}
+
+bool WriteFile(const std::string &path, const std::vector<uchar> &data) {
+  FILE *file = fopen(path.c_str(), "wb");
+  if (file == nullptr)
+    return false;
+  const bool written = fwrite(data.data(), 1, data.size(), file) == data.size();
+  return fclose(file) == 0 && written;
+}
+
+} // namespace
+
+bool ServerRequest::Parse(const std::string &line, ServerRequest *request,
+                          std::string *error) {
+  const std::vector<std::string> fields = SplitTabs(line);
+  if (fields.size() < 3 || fields.size() % 2 != 1) {
+    *error = "expected <input> then pairs of <scale> <output>, tab-separated";
+    return false;
+  }
+  request->input = fields[0];
+  request->outputs.clear();
+  for (size_t i = 1; i < fields.size(); i += 2) {
+    ScaleRule rule;
+    if (!ScaleRule::Parse(fields[i], &rule)) {
+      *error = "bad scale: " + fields[i];
+      return false;
+    }
+    request->outputs.emplace_back(rule, fields[i + 1]);
+  }
+  auto absolute = [error](const std::string &path) {
+    if (!path.empty() && path[0] == '/')
+      return true;
+    *error = "path isn't absolute: " + path;
+    return false;
+  };
+  if (!absolute(request->input))
+    return false;
+  for (const std::pair<ScaleRule, std::string> &output : request->outputs) {
+    if (!absolute(output.second))
+      return false;
+    // Checked up front, since imwrite would rather throw than say.
+    if (!cv::haveImageWriter(output.second)) {
+      *error = "no encoder for " + output.second;
+      return false;
+    }
+  }
+  return true;
+}
+
+PyramidServer::PyramidServer(const Options &options)
+    : options_(options), cache_(options.cache_bytes),
+      outputs_(options.output_cache_bytes),
+      connections_(std::max(1, options.max_waiting_connections)) {}
+
+PyramidServer::~PyramidServer() {
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(options_.socket_path.c_str());
+  }
+}
+
+std::string PyramidServer::Handle(const std::string &line) {
+  const auto start = std::chrono::steady_clock::now();
+  requests_++;
+  std::string error;
+  ServerRequest request;
+  Entry entry;
+  bool warm = false;
+  if (!ServerRequest::Parse(line, &request, &error) ||
+      !GetPyramid(request.input, &entry, &warm, &error)) {
+    failed_requests_++;
+    return "error " + error;
+  }
+  if (warm)
+    warm_requests_++;
+
+  const MinMaxPyramid &pyramid = *entry.pyramid;
+  cv::Mat output;
+  for (const std::pair<ScaleRule, std::string> &target : request.outputs) {
+    const int scale = target.first.Resolve(pyramid);
+    const std::string extension = Extension(target.second);
+    const std::string key =
+        OutputKey(request.input, entry.key, scale, extension);
+    std::shared_ptr<const std::vector<uchar>> encoded;
+    if (outputs_.Get(key, &encoded)) {
+      reused_outputs_++;
+    } else {
+      pyramid.Relevel(scale, &output);
+      auto bytes = std::make_shared<std::vector<uchar>>();
+      if (!cv::imencode(extension, ConvertForFormat(output, target.second),
+                        *bytes)) {
+        failed_requests_++;
+        return "error couldn't encode " + target.second;
+      }
+      outputs_.Put(key, bytes, bytes->size());
+      encoded = bytes;
+    }
+    if (!WriteFile(target.second, *encoded)) {
+      failed_requests_++;
+      return "error couldn't write " + target.second;
+    }
+  }
+
+  const double ms = std::chrono::duration<double, std::milli>(
+                        std::chrono::steady_clock::now() - start)
+                        .count();
+  char reply[64];
+  snprintf(reply, sizeof(reply), "ok %s %.1f", warm ? "warm" : "cold", ms);
+  return reply;
+}
+
+bool PyramidServer::GetPyramid(const std::string &path, Entry *entry,
+                               bool *warm, std::string *error) {
+  // Cheap next to decoding: a stat and a couple of small reads.
+  PyramidCacheKey key;
+  if (!PyramidCacheKey::ForFile(path, &key)) {
+    *error = "couldn't read " + path;
+    return false;
+  }
+  *warm = cache_.Get(path, entry) && entry->key == key;
+  if (*warm)
+    return true;
+
+  // Whoever gets here first does the loading; anyone else asking for the
+  // same file meanwhile waits for it.
+  std::promise<Entry> promise;
+  std::shared_future<Entry> loaded;
+  bool loader = false;
+  {
+    std::lock_guard<std::mutex> lock(loading_mutex_);
+    auto it = loading_.find(path);
+    if (it != loading_.end()) {
+      loaded = it->second;
+    } else {
+      loaded = promise.get_future().share();
+      loading_[path] = loaded;
+      loader = true;
+    }
+  }
+  if (loader) {
+    // Settles the load however it ends, even if something in it throws, so
+    // that nobody waiting on it is left hanging and the next request for the
+    // file gets to try again.
+    struct Settle {
+      PyramidServer *server;
+      const std::string &path;
+      std::promise<Entry> *promise;
+      Entry fresh;
+
+      ~Settle() {
+        {
+          std::lock_guard<std::mutex> lock(server->loading_mutex_);
+          server->loading_.erase(path);
+        }
+        if (!fresh.pyramid && fresh.error.empty())
+          fresh.error = "couldn't load " + path;
+        promise->set_value(fresh);
+      }
+    } settle{this, path, &promise, Entry()};
+    settle.fresh = Load(path, key);
+    if (settle.fresh.pyramid)
+      cache_.Put(path, settle.fresh, settle.fresh.bytes);
+  }
+  *entry = loaded.get();
+  if (!entry->pyramid) {
+    *error = entry->error;
+    return false;
+  }
+  return true;
+}
+
+PyramidServer::Entry PyramidServer::Load(const std::string &path,
+                                         const PyramidCacheKey &key) {
+  loads_++;
+  Entry entry;
+  entry.key = key;
+  // As for `batch`: 16-bit and float images stay as they are.
+  const cv::Mat image =
+      cv::imread(path, cv::IMREAD_ANYDEPTH | cv::IMREAD_COLOR);
+  if (image.empty()) {
+    entry.error = "couldn't decode " + path;
+    return entry;
+  }
+  // PreProcess would assert on anything else.
+  if (!MinMaxPyramid::SupportsDepth(image.depth())) {
+    entry.error = "unsupported pixel depth in " + path;
+    return entry;
+  }
+  MinMaxPyramid::Options options;
+  options.threads = options_.pyramid_threads;
+  // For the size of the levels; the timings are free.
+  options.collect_stats = true;
+  auto pyramid = std::make_shared<MinMaxPyramid>(options);
+  pyramid->PreProcess(image);
+  entry.bytes = MatBytes(image) + pyramid->GetStats().held_bytes;
+  entry.pyramid = pyramid;
+  return entry;
+}
+
+bool PyramidServer::Listen(std::string *error) {
+  sockaddr_un address;
+  if (!SocketAddress(options_.socket_path, &address, error))
+    return false;
+  // A socket file nobody answers on is left over from a server that died;
+  // one that does answer belongs to a server that's still running.
+  std::string connect_error;
+  const int existing = Connect(options_.socket_path, &connect_error);
+  if (existing >= 0) {
+    close(existing);
+    *error = "a server is already listening on " + options_.socket_path;
+    return false;
+  }
+  unlink(options_.socket_path.c_str());
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    *error = std::string("socket: ") + std::strerror(errno);
+    return false;
+  }
+  // Requests read and write files as whoever runs the server, so only they
+  // get to make them. The socket has to be created 0600 rather than chmod'ed
+  // after, or anyone could connect in between and be served later. umask is
+  // per process, but nothing else should be creating files this early.
+  const mode_t old_umask = umask(0177);
+  const bool bound =
+      bind(listen_fd_, reinterpret_cast<const sockaddr *>(&address),
+           sizeof(address)) == 0;
+  umask(old_umask);
+  if (!bound || listen(listen_fd_, SOMAXCONN) != 0) {
+    *error = "can't listen on " + options_.socket_path + ": " +
+             std::strerror(errno);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  return true;
+}
+
+void PyramidServer::Serve() {
+  CV_Assert(listen_fd_ >= 0);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < std::max(1, options_.worker_threads); i++) {
+    workers.emplace_back([this] {
+      int fd;
+      while (connections_.Pop(&fd))
+        ServeConnection(fd);
+    });
+  }
+  while (!stopping_) {
+    const int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      // Stop() shuts the socket down, which lands here too.
+      break;
+    }
+    // Idle clients get cut off, so that they can't hold on to a worker.
+    timeval timeout;
+    timeout.tv_sec = options_.idle_timeout_ms / 1000;
+    timeout.tv_usec = options_.idle_timeout_ms % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (!connections_.TryPush(fd)) {
+      SendAll(fd, "error server busy\n");
+      close(fd);
+    }
+  }
+  connections_.Close();
+  for (std::thread &worker : workers)
+    worker.join();
+}
+
+void PyramidServer::Stop() {
+  stopping_ = true;
+  if (listen_fd_ >= 0)
+    shutdown(listen_fd_, SHUT_RDWR);
+  // Connections still waiting for a worker get dropped by the workers' next
+  // read; those being served finish their current request first.
+  std::lock_guard<std::mutex> lock(open_mutex_);
+  for (int fd : open_)
+    shutdown(fd, SHUT_RD);
+}
+
+void PyramidServer::ServeConnection(int fd) {
+  {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    if (stopping_)
+      shutdown(fd, SHUT_RD);
+    open_.insert(fd);
+  }
+  LineReader reader(fd);
+  std::string line;
+  while (reader.Next(&line)) {
+    if (!SendAll(fd, Handle(line) + "\n"))
+      break;
+  }
+  {
+    std::lock_guard<std::mutex> lock(open_mutex_);
+    open_.erase(fd);
+  }
+  close(fd);
+}
+
+PyramidServer::Stats PyramidServer::GetStats() const {
+  Stats stats;
+  stats.requests = requests_;
+  stats.warm_requests = warm_requests_;
+  stats.failed_requests = failed_requests_;
+  stats.loads = loads_;
+  stats.reused_outputs = reused_outputs_;
+  stats.cached_images = cache_.size();
+  stats.cached_bytes = cache_.bytes();
+  return stats;
+}
+
+bool SendServerRequests(const std::string &socket_path,
+                        const std::vector<std::string> &requests,
+                        std::vector<std::string> *replies,
+                        std::string *error) {
+  const int fd = Connect(socket_path, error);
+  if (fd < 0)
+    return false;
+  // One at a time: a round trip over a local socket costs next to nothing
+  // beside a request, and neither end's buffers can fill up waiting on the
+  // other.
+  LineReader reader(fd);
+  replies->clear();
+  for (const std::string &request : requests) {
+    std::string reply;
+    if (!SendAll(fd, request + "\n") || !reader.Next(&reply))
+      break;
+    replies->push_back(reply);
+  }
+  close(fd);
+  if (replies->size() < requests.size()) {
+    *error = "server hung up after " + std::to_string(replies->size()) +
+             " of " + std::to_string(requests.size()) + " replies";
+    return false;
+  }
+  return true;
+}
+
+std::string DefaultServerSocketPath() {
+  const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (runtime_dir != nullptr && runtime_dir[0] != '\0')
+    return std::string(runtime_dir) + "/undersee.sock";
+  return "/tmp/undersee-" + std::to_string(getuid()) + ".sock";
+}
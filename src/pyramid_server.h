@@ -0,0 +1,172 @@
+#ifndef PYRAMID_SERVER_
+#define PYRAMID_SERVER_
+
+#include <atomic>
+#include <cstddef>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "batch_pipeline.h"
+#include "bounded_queue.h"
+#include "lru_cache.h"
+#include "min_max_pyramid.h"
+#include "pyramid_cache.h"
+
+// A long-running process that relevels images on request, keeping each image
+// and its pyramid in memory in between. Callers that relevel the same images
+// again and again, at different scales, then only pay for decoding and
+// PreProcess the first time; after that, a request costs a Relevel and an
+// encode.
+//
+// Requests come over a Unix domain socket, one per line, and each gets a one
+// line reply, in order. A connection can carry any number of them. A request
+// is tab-separated:
+//
+//   <input> TAB <scale> TAB <output> [TAB <scale> TAB <output> ...]
+//
+// with scales as for `batch --scale` (N, max-N, auto or auto:F), and absolute
+// paths, since the server has a working directory of its own. The reply is
+//
+//   ok <warm|cold> <milliseconds>
+//
+// where warm means the image was already in memory, or else
+//
+//   error <message>
+//
+// Encoded outputs are kept too, for a while, so asking for the same image at
+// the same scale again only costs writing the file.
+//
+// Connections are handed out to a pool of worker threads, so requests on
+// different connections run concurrently. Requests for an image that's still
+// being loaded wait for that load rather than starting their own. Clients
+// are expected to send their requests and hang up: idle connections are
+// closed after a while.
+
+// One parsed request line.
+struct ServerRequest {
+  std::string input;
+  // Each scale to relevel at, and where to write the result.
+  std::vector<std::pair<ScaleRule, std::string>> outputs;
+
+  // Returns false, saying why in *error, if the line isn't a valid request.
+  static bool Parse(const std::string &line, ServerRequest *request,
+                    std::string *error);
+};
+
+class PyramidServer {
+public:
+  struct Options {
+    std::string socket_path;
+    // Connections served at once.
+    int worker_threads = 1;
+    // Memory for cached images and their pyramids, together. The least
+    // recently used images are dropped to stay under it; an image too big to
+    // fit at all is still served, just never kept.
+    size_t cache_bytes = size_t{2} << 30;
+    // Memory for encoded outputs, on top of that.
+    size_t output_cache_bytes = size_t{256} << 20;
+    // Threads each image's PreProcess may use.
+    int pyramid_threads = 1;
+    // A connection holds a worker for as long as it's open, so one that sends
+    // nothing for this long is closed, to let other clients in.
+    int idle_timeout_ms = 10000;
+    // Accepted connections allowed to wait for a worker. Past that, new ones
+    // are told the server is busy and closed, rather than holding up accept.
+    int max_waiting_connections = 64;
+  };
+
+  struct Stats {
+    size_t requests = 0;
+    // Requests whose image was already in memory.
+    size_t warm_requests = 0;
+    size_t failed_requests = 0;
+    // Images decoded and pre-processed.
+    size_t loads = 0;
+    // Outputs written straight from the cache of encoded ones.
+    size_t reused_outputs = 0;
+    size_t cached_images = 0;
+    size_t cached_bytes = 0;
+  };
+
+  explicit PyramidServer(const Options &options);
+  ~PyramidServer();
+
+  // Carries out one request line, returning the reply (without a newline).
+  // Thread-safe. This is what requests from the socket go to, but it works
+  // just as well without one.
+  std::string Handle(const std::string &line);
+
+  // Creates the socket, replacing a stale one left at the path by a server
+  // that's gone. Returns false, saying why in *error, if that can't be done
+  // or another server is still listening there.
+  bool Listen(std::string *error);
+  // Accepts connections until Stop(), serving them on the worker threads.
+  // Returns once every connection is finished with.
+  void Serve();
+  // Makes Serve() return: stops accepting, and lets each open connection
+  // finish the request it's on. Safe to call from any thread.
+  void Stop();
+
+  Stats GetStats() const;
+
+private:
+  // A decoded image's pyramid, and which version of the file it came from.
+  // The pyramid is null, with error saying why, if the file couldn't be used.
+  struct Entry {
+    PyramidCacheKey key;
+    std::shared_ptr<const MinMaxPyramid> pyramid;
+    size_t bytes = 0;
+    std::string error;
+  };
+
+  // The pyramid for `path`, from the cache if it's there and the file hasn't
+  // changed since, otherwise loaded (or waited for, if another request is
+  // already loading it). Sets *warm if it came from the cache.
+  bool GetPyramid(const std::string &path, Entry *entry, bool *warm,
+                  std::string *error);
+  Entry Load(const std::string &path, const PyramidCacheKey &key);
+  // Answers requests on one connection until the client hangs up.
+  void ServeConnection(int fd);
+
+  const Options options_;
+
+  LruCache<std::string, Entry> cache_;
+  // Encoded outputs, by OutputKey().
+  LruCache<std::string, std::shared_ptr<const std::vector<uchar>>> outputs_;
+  // Files being loaded right now, by path.
+  std::mutex loading_mutex_;
+  std::map<std::string, std::shared_future<Entry>> loading_;
+
+  std::atomic<size_t> requests_{0};
+  std::atomic<size_t> warm_requests_{0};
+  std::atomic<size_t> failed_requests_{0};
+  std::atomic<size_t> loads_{0};
+  std::atomic<size_t> reused_outputs_{0};
+
+  int listen_fd_ = -1;
+  std::atomic<bool> stopping_{false};
+  // Accepted connections waiting for a worker.
+  BoundedQueue<int> connections_;
+  // Connections a worker is serving, so that Stop() can cut them short.
+  std::mutex open_mutex_;
+  std::set<int> open_;
+};
+
+// The client side: sends each request line over one connection to the server
+// at socket_path, and collects the replies, in order. Returns false, saying
+// why in *error, if the server can't be reached or hangs up early.
+bool SendServerRequests(const std::string &socket_path,
+                        const std::vector<std::string> &requests,
+                        std::vector<std::string> *replies, std::string *error);
+
+// Where the server listens unless told otherwise: undersee.sock in
+// $XDG_RUNTIME_DIR, or /tmp/undersee-<uid>.sock without one.
+std::string DefaultServerSocketPath();
+
+#endif // PYRAMID_SERVER_
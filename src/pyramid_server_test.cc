@@ -0,0 +1,294 @@
+#include "pyramid_server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+// Somewhere to put files; Bazel gives each test its own.
+std::string TempDir(const std::string &name) {
+  const char *root = getenv("TEST_TMPDIR");
+  const std::string dir = std::string(root ? root : "/tmp") + "/" + name;
+  mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+// PPM, so that what we read back is exactly what we wrote.
+cv::Mat WriteNoise(const std::string &path, cv::Size size) {
+  cv::Mat image(size, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  EXPECT_TRUE(cv::imwrite(path, image));
+  return image;
+}
+
+cv::Mat Releveled(const cv::Mat &image, const std::string &scale) {
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(image);
+  ScaleRule rule;
+  EXPECT_TRUE(ScaleRule::Parse(scale, &rule));
+  return pyramid.Relevel(rule.Resolve(pyramid));
+}
+
+double MaxDifference(const cv::Mat &a, const cv::Mat &b) {
+  return cv::norm(a, b, cv::NORM_INF);
+}
+
+} // namespace
+
+TEST(ServerRequest, Parses) {
+  ServerRequest request;
+  std::string error;
+  ASSERT_TRUE(ServerRequest::Parse("/in.ppm\t5\t/a.ppm\tmax-1\t/b.ppm",
+                                   &request, &error))
+      << error;
+  EXPECT_EQ("/in.ppm", request.input);
+  ASSERT_EQ(2u, request.outputs.size());
+  EXPECT_EQ(5, request.outputs[0].first.value);
+  EXPECT_EQ("/a.ppm", request.outputs[0].second);
+  EXPECT_TRUE(request.outputs[1].first.from_max);
+  EXPECT_EQ("/b.ppm", request.outputs[1].second);
+
+  // Paths with spaces are fine; that's why the separator is a tab.
+  ASSERT_TRUE(ServerRequest::Parse("/my in.ppm\tauto\t/my out.ppm", &request,
+                                   &error));
+  EXPECT_TRUE(request.outputs[0].first.automatic);
+
+  EXPECT_FALSE(ServerRequest::Parse("", &request, &error));
+  EXPECT_FALSE(ServerRequest::Parse("/in.ppm\t5", &request, &error));
+  EXPECT_FALSE(ServerRequest::Parse("/in.ppm\tfive\t/a.ppm", &request, &error));
+  EXPECT_FALSE(ServerRequest::Parse("in.ppm\t5\t/a.ppm", &request, &error));
+  EXPECT_FALSE(ServerRequest::Parse("/in.ppm\t5\ta.ppm", &request, &error));
+  EXPECT_FALSE(ServerRequest::Parse("/in.ppm\t5\t/a.ppm\t6", &request, &error));
+}
+
+TEST(PyramidServer, RelevelsLikeThePyramidAndKeepsItWarm) {
+  const std::string dir = TempDir("server_warm");
+  const cv::Mat image = WriteNoise(dir + "/in.ppm", cv::Size(90, 70));
+  PyramidServer server(PyramidServer::Options{});
+
+  const std::string request =
+      dir + "/in.ppm\t5\t" + dir + "/a.ppm\tmax-1\t" + dir + "/b.ppm";
+  EXPECT_EQ(0u, server.Handle(request).find("ok cold "));
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/a.ppm"),
+                             Releveled(image, "5")));
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/b.ppm"),
+                             Releveled(image, "max-1")));
+
+  EXPECT_EQ(0u, server.Handle(dir + "/in.ppm\t4\t" + dir + "/a.ppm")
+                    .find("ok warm "));
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/a.ppm"),
+                             Releveled(image, "4")));
+
+  const PyramidServer::Stats stats = server.GetStats();
+  EXPECT_EQ(2u, stats.requests);
+  EXPECT_EQ(1u, stats.warm_requests);
+  EXPECT_EQ(1u, stats.loads);
+  EXPECT_EQ(1u, stats.cached_images);
+  EXPECT_GT(stats.cached_bytes, image.total() * image.elemSize());
+}
+
+TEST(PyramidServer, ReusesEncodedOutputs) {
+  const std::string dir = TempDir("server_reuse");
+  const cv::Mat image = WriteNoise(dir + "/in.ppm", cv::Size(60, 40));
+  PyramidServer server(PyramidServer::Options{});
+  const std::string request = dir + "/in.ppm\t3\t" + dir + "/out.ppm";
+  EXPECT_EQ(0u, server.Handle(request).find("ok cold "));
+  remove((dir + "/out.ppm").c_str());
+  // Same image, same scale, same format: written from the cache.
+  EXPECT_EQ(0u, server.Handle(request).find("ok warm "));
+  EXPECT_EQ(1u, server.GetStats().reused_outputs);
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/out.ppm"),
+                             Releveled(image, "3")));
+
+  // A different scale, or a changed file, is encoded afresh.
+  EXPECT_EQ(0u, server.Handle(dir + "/in.ppm\t2\t" + dir + "/out.ppm")
+                    .find("ok warm "));
+  const cv::Mat changed = WriteNoise(dir + "/in.ppm", cv::Size(60, 50));
+  EXPECT_EQ(0u, server.Handle(request).find("ok cold "));
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/out.ppm"),
+                             Releveled(changed, "3")));
+  EXPECT_EQ(1u, server.GetStats().reused_outputs);
+}
+
+TEST(PyramidServer, ReloadsChangedFiles) {
+  const std::string dir = TempDir("server_changed");
+  WriteNoise(dir + "/in.ppm", cv::Size(40, 30));
+  PyramidServer server(PyramidServer::Options{});
+  const std::string request = dir + "/in.ppm\t3\t" + dir + "/out.ppm";
+  EXPECT_EQ(0u, server.Handle(request).find("ok cold "));
+
+  const cv::Mat changed = WriteNoise(dir + "/in.ppm", cv::Size(50, 30));
+  EXPECT_EQ(0u, server.Handle(request).find("ok cold "));
+  EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/out.ppm"),
+                             Releveled(changed, "3")));
+  EXPECT_EQ(2u, server.GetStats().loads);
+}
+
+TEST(PyramidServer, ReportsErrors) {
+  const std::string dir = TempDir("server_errors");
+  PyramidServer server(PyramidServer::Options{});
+  EXPECT_EQ(0u, server.Handle("nonsense").find("error "));
+  EXPECT_EQ(0u,
+            server.Handle(dir + "/in.ppm\t99999999999\t" + dir + "/out.ppm")
+                .find("error "));
+  EXPECT_EQ(0u, server.Handle(dir + "/missing.ppm\t3\t" + dir + "/out.ppm")
+                    .find("error "));
+  // There, but not an image.
+  FILE *file = fopen((dir + "/garbage.ppm").c_str(), "w");
+  ASSERT_NE(nullptr, file);
+  fputs("not an image", file);
+  fclose(file);
+  EXPECT_EQ(0u, server.Handle(dir + "/garbage.ppm\t3\t" + dir + "/out.ppm")
+                    .find("error "));
+  EXPECT_EQ(4u, server.GetStats().failed_requests);
+}
+
+TEST(PyramidServer, RejectsUnsupportedDepthsAndCarriesOn) {
+  const std::string dir = TempDir("server_depth");
+  // Decodes fine, but isn't a depth PreProcess takes.
+  cv::Mat doubles(30, 40, CV_64FC3);
+  cv::randu(doubles, cv::Scalar::all(0), cv::Scalar::all(1));
+  ASSERT_TRUE(cv::imwrite(dir + "/in.tiff", doubles));
+  PyramidServer server(PyramidServer::Options{});
+  const std::string request = dir + "/in.tiff\t3\t" + dir + "/out.ppm";
+  const std::string reply = server.Handle(request);
+  EXPECT_EQ(0u, reply.find("error ")) << reply;
+  EXPECT_NE(std::string::npos, reply.find("depth")) << reply;
+  // Asking again gets the same answer, rather than waiting on the failed
+  // load forever.
+  EXPECT_EQ(0u, server.Handle(request).find("error "));
+  EXPECT_EQ(2u, server.GetStats().loads);
+  EXPECT_EQ(0u, server.GetStats().cached_images);
+}
+
+TEST(PyramidServer, CacheStaysWithinBudget) {
+  const std::string dir = TempDir("server_budget");
+  PyramidServer::Options options;
+  // Room for about two of these at a time.
+  options.cache_bytes = 2 * 100 * 100 * 3 * 2;
+  PyramidServer server(options);
+  for (int i = 0; i < 5; i++) {
+    const std::string input = dir + "/in" + std::to_string(i) + ".ppm";
+    WriteNoise(input, cv::Size(100, 100));
+    EXPECT_EQ(0u, server.Handle(input + "\t3\t" + dir + "/out.ppm")
+                      .find("ok cold "));
+    EXPECT_LE(server.GetStats().cached_bytes, options.cache_bytes);
+  }
+  EXPECT_EQ(2u, server.GetStats().cached_images);
+  // The most recent image is still there; the first one isn't.
+  EXPECT_EQ(0u,
+            server.Handle(dir + "/in4.ppm\t3\t" + dir + "/out.ppm")
+                .find("ok warm "));
+  EXPECT_EQ(0u,
+            server.Handle(dir + "/in0.ppm\t3\t" + dir + "/out.ppm")
+                .find("ok cold "));
+}
+
+TEST(PyramidServer, ServesConcurrentClientsOverSocket) {
+  const std::string dir = TempDir("server_socket");
+  const cv::Mat image = WriteNoise(dir + "/in.ppm", cv::Size(300, 200));
+  PyramidServer::Options options;
+  options.socket_path = dir + "/server.sock";
+  options.worker_threads = 4;
+  PyramidServer server(options);
+  std::string error;
+  ASSERT_TRUE(server.Listen(&error)) << error;
+  // Nobody else gets to connect, from the moment the socket exists.
+  struct stat info;
+  ASSERT_EQ(0, stat(options.socket_path.c_str(), &info));
+  EXPECT_EQ(0600u, info.st_mode & 0777);
+  // A second server on the same socket would steal the first one's clients.
+  PyramidServer rival(options);
+  EXPECT_FALSE(rival.Listen(&error));
+  std::thread serving([&server] { server.Serve(); });
+
+  // Every client asks for the same image at once, each at a few scales over
+  // one connection. It should only be loaded the once.
+  std::vector<std::thread> clients;
+  std::vector<std::vector<std::string>> replies(4);
+  for (int c = 0; c < 4; c++) {
+    clients.emplace_back([&, c] {
+      std::vector<std::string> requests;
+      for (int scale = 3; scale <= 5; scale++) {
+        requests.push_back(dir + "/in.ppm\t" + std::to_string(scale) + "\t" +
+                           dir + "/out" + std::to_string(c) + "_" +
+                           std::to_string(scale) + ".ppm");
+      }
+      std::string client_error;
+      EXPECT_TRUE(SendServerRequests(options.socket_path, requests,
+                                     &replies[c], &client_error))
+          << client_error;
+    });
+  }
+  for (std::thread &client : clients)
+    client.join();
+  server.Stop();
+  serving.join();
+
+  for (int c = 0; c < 4; c++) {
+    ASSERT_EQ(3u, replies[c].size());
+    for (int scale = 3; scale <= 5; scale++) {
+      EXPECT_EQ(0u, replies[c][scale - 3].find("ok ")) << replies[c][scale - 3];
+      EXPECT_EQ(0, MaxDifference(cv::imread(dir + "/out" + std::to_string(c) +
+                                            "_" + std::to_string(scale) +
+                                            ".ppm"),
+                                 Releveled(image, std::to_string(scale))));
+    }
+  }
+  EXPECT_EQ(1u, server.GetStats().loads);
+  EXPECT_EQ(12u, server.GetStats().requests);
+
+  // Stopped, so there's nobody to answer.
+  std::vector<std::string> late_replies;
+  EXPECT_FALSE(SendServerRequests(options.socket_path,
+                                  {dir + "/in.ppm\t3\t" + dir + "/late.ppm"},
+                                  &late_replies, &error));
+}
+
+TEST(PyramidServer, IdleConnectionsDontHoldUpOthers) {
+  const std::string dir = TempDir("server_idle");
+  WriteNoise(dir + "/in.ppm", cv::Size(40, 30));
+  PyramidServer::Options options;
+  options.socket_path = dir + "/server.sock";
+  options.worker_threads = 1;
+  options.idle_timeout_ms = 200;
+  PyramidServer server(options);
+  std::string error;
+  ASSERT_TRUE(server.Listen(&error)) << error;
+  std::thread serving([&server] { server.Serve(); });
+
+  // Connects, takes the only worker, and says nothing.
+  const int idle = socket(AF_UNIX, SOCK_STREAM, 0);
+  sockaddr_un address = sockaddr_un();
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, options.socket_path.c_str(),
+          sizeof(address.sun_path) - 1);
+  ASSERT_EQ(0, connect(idle, reinterpret_cast<const sockaddr *>(&address),
+                       sizeof(address)));
+
+  std::vector<std::string> replies;
+  ASSERT_TRUE(SendServerRequests(options.socket_path,
+                                 {dir + "/in.ppm\t3\t" + dir + "/out.ppm"},
+                                 &replies, &error))
+      << error;
+  EXPECT_EQ(0u, replies[0].find("ok "));
+  // The idle connection was closed on it.
+  char byte;
+  EXPECT_EQ(0, read(idle, &byte, 1));
+  close(idle);
+
+  server.Stop();
+  serving.join();
+}
@@ -0,0 +1,789 @@
+#include "relevel_kernel.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// Fixed-point interpolation weights have this many fractional bits. Same as
+// INTER_RESIZE_COEF_BITS in OpenCV.
+constexpr int kCoefBits = 11;
+constexpr int kCoefScale = 1 << kCoefBits;
+
+// What each pixel type interpolates with, and the range it normalizes to.
+// 8-bit images use the same 16-bit fixed point as OpenCV, so that they agree
+// with cv::resize. Anything deeper goes through float, which has precision to
+// spare for 16-bit values.
+template <typename T> struct PixelTraits;
+
+template <> struct PixelTraits<uchar> {
+  using Interpolated = int16_t;
+  static float Max() { return 255.f; }
+};
+
+template <> struct PixelTraits<uint16_t> {
+  using Interpolated = float;
+  static float Max() { return 65535.f; }
+  // A zero range is treated as half a step, as in 8 bits.
+  static float MinRange() { return 0.5f; }
+};
+
+// Float images are normalized to [0, 1].
+template <> struct PixelTraits<float> {
+  using Interpolated = float;
+  static float Max() { return 1.f; }
+  static float MinRange() { return std::numeric_limits<float>::min(); }
+};
+
+#if defined(__SSE2__)
+// A vector of floats, for the deeper pixel types: eight lanes with AVX2, four
+// with plain SSE2. 16-bit pixels are widened on the way in, and rounded and
+// saturated on the way out, the same as saturate_cast would.
+#if defined(__AVX2__)
+using Floats = __m256;
+constexpr int kFloatLanes = 8;
+
+inline Floats SplatFloats(float value) { return _mm256_set1_ps(value); }
+inline Floats AddFloats(Floats a, Floats b) { return _mm256_add_ps(a, b); }
+inline Floats SubFloats(Floats a, Floats b) { return _mm256_sub_ps(a, b); }
+inline Floats MulFloats(Floats a, Floats b) { return _mm256_mul_ps(a, b); }
+inline Floats DivFloats(Floats a, Floats b) { return _mm256_div_ps(a, b); }
+inline Floats MinFloats(Floats a, Floats b) { return _mm256_min_ps(a, b); }
+inline Floats MaxFloats(Floats a, Floats b) { return _mm256_max_ps(a, b); }
+
+inline Floats LoadFloats(const float *p) { return _mm256_loadu_ps(p); }
+
+inline Floats LoadFloats(const uint16_t *p) {
+  return _mm256_cvtepi32_ps(
+      _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+inline void StoreFloats(Floats v, float *p) { _mm256_storeu_ps(p, v); }
+
+inline void StoreFloats(Floats v, uint16_t *p) {
+  v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                    _mm256_set1_ps(65535.f));
+  const __m256i rounded = _mm256_cvtps_epi32(v);
+  _mm_storeu_si128((__m128i *)p,
+                   _mm_packus_epi32(_mm256_castsi256_si128(rounded),
+                                    _mm256_extracti128_si256(rounded, 1)));
+}
+#else
+using Floats = __m128;
+constexpr int kFloatLanes = 4;
+
+inline Floats SplatFloats(float value) { return _mm_set1_ps(value); }
+inline Floats AddFloats(Floats a, Floats b) { return _mm_add_ps(a, b); }
+inline Floats SubFloats(Floats a, Floats b) { return _mm_sub_ps(a, b); }
+inline Floats MulFloats(Floats a, Floats b) { return _mm_mul_ps(a, b); }
+inline Floats DivFloats(Floats a, Floats b) { return _mm_div_ps(a, b); }
+inline Floats MinFloats(Floats a, Floats b) { return _mm_min_ps(a, b); }
+inline Floats MaxFloats(Floats a, Floats b) { return _mm_max_ps(a, b); }
+
+inline Floats LoadFloats(const float *p) { return _mm_loadu_ps(p); }
+
+inline Floats LoadFloats(const uint16_t *p) {
+  const __m128i v = _mm_loadl_epi64((const __m128i *)p);
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v, _mm_setzero_si128()));
+}
+
+inline void StoreFloats(Floats v, float *p) { _mm_storeu_ps(p, v); }
+
+// SSE2 has no unsigned 32-to-16-bit pack, so the values are shifted into
+// signed range for the pack and flipped back afterwards.
+inline void StoreFloats(Floats v, uint16_t *p) {
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(65535.f));
+  __m128i rounded =
+      _mm_sub_epi32(_mm_cvtps_epi32(v), _mm_set1_epi32(32768));
+  rounded = _mm_packs_epi32(rounded, rounded);
+  rounded = _mm_xor_si128(rounded, _mm_set1_epi16(-32768));
+  _mm_storel_epi64((__m128i *)p, rounded);
+}
+#endif
+#endif
+
+// How one axis of the output samples from the (smaller) source: output
+// position i blends source positions offset0[i] and offset1[i], with weights
+// out of kCoefScale.
+struct AxisTable {
+  std::vector<int> offset0;
+  std::vector<int> offset1;
+  std::vector<short> weight0;
+  std::vector<short> weight1;
+};
+
+// Mirrors the coordinate math in cv::resize, quirks included: OpenCV clamps
+// the fractional position at the ends of a row, but not at the top and bottom
+// of the image (where both source rows end up being the same row anyway).
+//
+// Only output positions [first, first + count) go in the table, with entry 0
+// being position `first`; by default, that's all of them.
+AxisTable BuildAxisTable(int src_len, int dst_len, bool clamp_fraction,
+                         int first = 0, int count = -1) {
+  if (count < 0)
+    count = dst_len - first;
+  AxisTable table;
+  table.offset0.resize(count);
+  table.offset1.resize(count);
+  table.weight0.resize(count);
+  table.weight1.resize(count);
+
+  const double scale = 1. / (static_cast<double>(dst_len) / src_len);
+  for (int j = 0; j < count; j++) {
+    const int i = first + j;
+    float fraction = static_cast<float>((i + 0.5) * scale - 0.5);
+    int pos = static_cast<int>(std::floor(fraction));
+    fraction -= pos;
+    if (clamp_fraction && pos < 0) {
+      pos = 0;
+      fraction = 0;
+    }
+    if (clamp_fraction && pos >= src_len - 1) {
+      pos = src_len - 1;
+      fraction = 0;
+    }
+    table.offset0[j] = std::min(std::max(pos, 0), src_len - 1);
+    table.offset1[j] = std::min(std::max(pos + 1, 0), src_len - 1);
+    table.weight0[j] = cv::saturate_cast<short>((1.f - fraction) * kCoefScale);
+    table.weight1[j] = cv::saturate_cast<short>(fraction * kCoefScale);
+  }
+  return table;
+}
+
+// Horizontal half of the interpolation, for one source row. The result is
+// scaled by kCoefScale / 16, which keeps it within an int16.
+void InterpolateRow(const uchar *src, const AxisTable &x_table, int cn,
+                    int16_t *out) {
+  const int cols = static_cast<int>(x_table.offset0.size());
+  for (int col = 0; col < cols; col++) {
+    const uchar *s0 = src + x_table.offset0[col] * cn;
+    const uchar *s1 = src + x_table.offset1[col] * cn;
+    const int w0 = x_table.weight0[col];
+    const int w1 = x_table.weight1[col];
+    for (int k = 0; k < cn; k++)
+      *out++ = static_cast<int16_t>((s0[k] * w0 + s1[k] * w1) >> 4);
+  }
+}
+
+// As above for deeper pixels, in float and without the scaling.
+template <typename T>
+void InterpolateRow(const T *src, const AxisTable &x_table, int cn,
+                    float *out) {
+  const int cols = static_cast<int>(x_table.offset0.size());
+  for (int col = 0; col < cols; col++) {
+    const T *s0 = src + x_table.offset0[col] * cn;
+    const T *s1 = src + x_table.offset1[col] * cn;
+    const float w0 = x_table.weight0[col] * (1.f / kCoefScale);
+    const float w1 = x_table.weight1[col] * (1.f / kCoefScale);
+    for (int k = 0; k < cn; k++)
+      *out++ = s0[k] * w0 + s1[k] * w1;
+  }
+}
+
+// Horizontally interpolated rows of a pyramid level. Each level row feeds
+// several consecutive output rows, so we keep the last two around rather than
+// recomputing them for every output row.
+template <typename T> class InterpolatedRows {
+public:
+  using Interpolated = typename PixelTraits<T>::Interpolated;
+
+  InterpolatedRows(const cv::Mat &level, const AxisTable &x_table, int cn)
+      : level_(level), x_table_(x_table), cn_(cn) {
+    for (std::vector<Interpolated> &row : rows_)
+      row.resize(x_table.offset0.size() * cn);
+  }
+
+  void Fetch(int row0, int row1, const Interpolated **out0,
+             const Interpolated **out1) {
+    int slot0 = Find(row0);
+    if (slot0 < 0)
+      slot0 = Fill(Find(row1) == 0 ? 1 : 0, row0);
+    int slot1 = Find(row1);
+    if (slot1 < 0)
+      slot1 = Fill(slot0 == 0 ? 1 : 0, row1);
+    *out0 = rows_[slot0].data();
+    *out1 = rows_[slot1].data();
+  }
+
+private:
+  int Find(int row) const {
+    if (row_index_[0] == row)
+      return 0;
+    if (row_index_[1] == row)
+      return 1;
+    return -1;
+  }
+
+  int Fill(int slot, int row) {
+    InterpolateRow(level_.ptr<T>(row), x_table_, cn_, rows_[slot].data());
+    row_index_[slot] = row;
+    return slot;
+  }
+
+  const cv::Mat &level_;
+  const AxisTable &x_table_;
+  const int cn_;
+  std::vector<Interpolated> rows_[2];
+  int row_index_[2] = {-1, -1};
+};
+
+// Vertical half of the interpolation: out = h0 * w0 + h1 * w1, rounded back
+// down to 8 bits. This is the same arithmetic as OpenCV's vectorized path,
+// which is why everything is shifted around to fit 16-bit lanes.
+void BlendRows(const int16_t *h0, const int16_t *h1, short w0, short w1, int n,
+               uchar *out) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i vw0 = _mm_set1_epi16(w0);
+  const __m128i vw1 = _mm_set1_epi16(w1);
+  const __m128i two = _mm_set1_epi16(2);
+  for (; i + 16 <= n; i += 16) {
+    __m128i lo = _mm_add_epi16(
+        _mm_mulhi_epi16(_mm_loadu_si128((const __m128i *)(h0 + i)), vw0),
+        _mm_mulhi_epi16(_mm_loadu_si128((const __m128i *)(h1 + i)), vw1));
+    __m128i hi = _mm_add_epi16(
+        _mm_mulhi_epi16(_mm_loadu_si128((const __m128i *)(h0 + i + 8)), vw0),
+        _mm_mulhi_epi16(_mm_loadu_si128((const __m128i *)(h1 + i + 8)), vw1));
+    lo = _mm_srai_epi16(_mm_add_epi16(lo, two), 2);
+    hi = _mm_srai_epi16(_mm_add_epi16(hi, two), 2);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < n; i++) {
+    const int value = (((h0[i] * w0) >> 16) + ((h1[i] * w1) >> 16) + 2) >> 2;
+    out[i] = cv::saturate_cast<uchar>(value);
+  }
+}
+
+// Deeper pixels blend in float. Like the other float kernels below, the tail
+// of the row goes through the vector code via a padded copy, so that a pixel
+// comes out the same wherever its row ends (the compiler is free to fuse the
+// scalar loop's multiply and add, and the vector code's, differently).
+template <typename T>
+void BlendRows(const float *h0, const float *h1, short w0, short w1, int n,
+               T *out) {
+  const float f0 = w0 * (1.f / kCoefScale);
+  const float f1 = w1 * (1.f / kCoefScale);
+  int i = 0;
+#if defined(__SSE2__)
+  const Floats v0 = SplatFloats(f0);
+  const Floats v1 = SplatFloats(f1);
+  auto blend = [&](const float *a, const float *b, T *o) {
+    StoreFloats(AddFloats(MulFloats(LoadFloats(a), v0),
+                          MulFloats(LoadFloats(b), v1)),
+                o);
+  };
+  for (; i + kFloatLanes <= n; i += kFloatLanes)
+    blend(h0 + i, h1 + i, out + i);
+  if (i < n) {
+    float tail[2][kFloatLanes] = {};
+    T tail_out[kFloatLanes];
+    std::copy(h0 + i, h0 + n, tail[0]);
+    std::copy(h1 + i, h1 + n, tail[1]);
+    blend(tail[0], tail[1], tail_out);
+    std::copy(tail_out, tail_out + (n - i), out + i);
+    i = n;
+  }
+#endif
+  for (; i < n; i++)
+    out[i] = cv::saturate_cast<T>(h0[i] * f0 + h1[i] * f1);
+}
+
+// out = (a * (256 - weight) + b * weight) / 256, rounded. Everything fits in
+// unsigned 16-bit lanes: the sum is at most 255 * 256 + 128.
+void BlendLevelRows(const uchar *a, const uchar *b, int weight, int n,
+                    uchar *out) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i wa = _mm_set1_epi16(static_cast<short>(256 - weight));
+  const __m128i wb = _mm_set1_epi16(static_cast<short>(weight));
+  const __m128i half = _mm_set1_epi16(128);
+  auto blend8 = [&](__m128i va, __m128i vb) {
+    const __m128i sum = _mm_add_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(va, wa), _mm_mullo_epi16(vb, wb)), half);
+    return _mm_srli_epi16(sum, 8);
+  };
+  for (; i + 16 <= n; i += 16) {
+    const __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+    const __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+    const __m128i lo = blend8(_mm_unpacklo_epi8(va, zero),
+                              _mm_unpacklo_epi8(vb, zero));
+    const __m128i hi = blend8(_mm_unpackhi_epi8(va, zero),
+                              _mm_unpackhi_epi8(vb, zero));
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  for (; i < n; i++) {
+    const int sum = a[i] * (256 - weight) + b[i] * weight + 128;
+    out[i] = static_cast<uchar>(sum >> 8);
+  }
+}
+
+template <typename T>
+void BlendLevelRows(const T *a, const T *b, int weight, int n, T *out) {
+  const float wa = (256 - weight) / 256.f;
+  const float wb = weight / 256.f;
+  int i = 0;
+#if defined(__SSE2__)
+  const Floats va = SplatFloats(wa);
+  const Floats vb = SplatFloats(wb);
+  auto blend = [&](const T *a_lanes, const T *b_lanes, T *o) {
+    StoreFloats(AddFloats(MulFloats(LoadFloats(a_lanes), va),
+                          MulFloats(LoadFloats(b_lanes), vb)),
+                o);
+  };
+  for (; i + kFloatLanes <= n; i += kFloatLanes)
+    blend(a + i, b + i, out + i);
+  if (i < n) {
+    T tail[2][kFloatLanes] = {};
+    T tail_out[kFloatLanes];
+    std::copy(a + i, a + n, tail[0]);
+    std::copy(b + i, b + n, tail[1]);
+    blend(tail[0], tail[1], tail_out);
+    std::copy(tail_out, tail_out + (n - i), out + i);
+    i = n;
+  }
+#endif
+  for (; i < n; i++)
+    out[i] = cv::saturate_cast<T>(a[i] * wa + b[i] * wb);
+}
+
+// out = (p - min) * 255 / (max - min), rounded and saturated. A zero range is
+// treated as 0.5, so that anything above min saturates to 255.
+void NormalizeRow(const uchar *p, const uchar *min, const uchar *max, int n,
+                  uchar *out) {
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128 half = _mm_set1_ps(0.5f);
+  const __m128 two = _mm_set1_ps(2.f);
+  const __m128 scale = _mm_set1_ps(255.f);
+  // Four lanes at a time: widen to float, multiply by the reciprocal of the
+  // range (estimate plus one Newton-Raphson step, which is plenty for 8-bit
+  // output), and round to nearest.
+  auto normalize4 = [&](__m128i zeroed, __m128i range) {
+    const __m128 range_f = _mm_max_ps(_mm_cvtepi32_ps(range), half);
+    __m128 inverse = _mm_rcp_ps(range_f);
+    inverse = _mm_mul_ps(inverse,
+                         _mm_sub_ps(two, _mm_mul_ps(range_f, inverse)));
+    return _mm_cvtps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(zeroed),
+                                      _mm_mul_ps(inverse, scale)));
+  };
+  auto normalize16 = [&](const uchar *p16, const uchar *min16,
+                         const uchar *max16, uchar *out16) {
+    const __m128i pv = _mm_loadu_si128((const __m128i *)p16);
+    const __m128i minv = _mm_loadu_si128((const __m128i *)min16);
+    const __m128i maxv = _mm_loadu_si128((const __m128i *)max16);
+    const __m128i zeroed = _mm_subs_epu8(pv, minv);
+    const __m128i range = _mm_subs_epu8(maxv, minv);
+
+    const __m128i zeroed_lo = _mm_unpacklo_epi8(zeroed, zero);
+    const __m128i zeroed_hi = _mm_unpackhi_epi8(zeroed, zero);
+    const __m128i range_lo = _mm_unpacklo_epi8(range, zero);
+    const __m128i range_hi = _mm_unpackhi_epi8(range, zero);
+
+    const __m128i r0 = normalize4(_mm_unpacklo_epi16(zeroed_lo, zero),
+                                  _mm_unpacklo_epi16(range_lo, zero));
+    const __m128i r1 = normalize4(_mm_unpackhi_epi16(zeroed_lo, zero),
+                                  _mm_unpackhi_epi16(range_lo, zero));
+    const __m128i r2 = normalize4(_mm_unpacklo_epi16(zeroed_hi, zero),
+                                  _mm_unpacklo_epi16(range_hi, zero));
+    const __m128i r3 = normalize4(_mm_unpackhi_epi16(zeroed_hi, zero),
+                                  _mm_unpackhi_epi16(range_hi, zero));
+    _mm_storeu_si128(
+        (__m128i *)out16,
+        _mm_packus_epi16(_mm_packs_epi32(r0, r1), _mm_packs_epi32(r2, r3)));
+  };
+  for (; i + 16 <= n; i += 16)
+    normalize16(p + i, min + i, max + i, out + i);
+  // The estimated reciprocal can round differently from a real division, so
+  // the tail goes through the same code via a padded copy. Otherwise a pixel's
+  // value would depend on where its row happens to end, and a region of an
+  // image wouldn't match the same pixels of the whole.
+  if (i < n) {
+    uchar tail[3][16] = {};
+    uchar tail_out[16];
+    std::copy(p + i, p + n, tail[0]);
+    std::copy(min + i, min + n, tail[1]);
+    std::copy(max + i, max + n, tail[2]);
+    normalize16(tail[0], tail[1], tail[2], tail_out);
+    std::copy(tail_out, tail_out + (n - i), out + i);
+    i = n;
+  }
+#endif
+  for (; i < n; i++) {
+    const int zeroed = std::max(p[i] - min[i], 0);
+    const int range = std::max(max[i] - min[i], 0);
+    const float range_f = range > 0 ? static_cast<float>(range) : 0.5f;
+    out[i] = cv::saturate_cast<uchar>(zeroed * (255.f / range_f));
+  }
+}
+
+// The same for deeper pixels, against their own full range. Float doesn't
+// saturate by itself, so the top is clamped explicitly.
+//
+// The vector code divides properly rather than estimating the reciprocal,
+// and orders its min and max operands so that NaNs come through the same as
+// with std::min and std::max; it matches the scalar loop exactly.
+template <typename T>
+void NormalizeRow(const T *p, const T *min, const T *max, int n, T *out) {
+  const float top = PixelTraits<T>::Max();
+  const float min_range = PixelTraits<T>::MinRange();
+  int i = 0;
+#if defined(__SSE2__)
+  const Floats zero = SplatFloats(0.f);
+  const Floats top_v = SplatFloats(top);
+  const Floats min_range_v = SplatFloats(min_range);
+  auto normalize = [&](const T *p_lanes, const T *min_lanes,
+                       const T *max_lanes, T *o) {
+    const Floats min_v = LoadFloats(min_lanes);
+    const Floats zeroed =
+        MaxFloats(zero, SubFloats(LoadFloats(p_lanes), min_v));
+    const Floats range =
+        MaxFloats(min_range_v, SubFloats(LoadFloats(max_lanes), min_v));
+    StoreFloats(MinFloats(top_v, MulFloats(zeroed, DivFloats(top_v, range))),
+                o);
+  };
+  for (; i + kFloatLanes <= n; i += kFloatLanes)
+    normalize(p + i, min + i, max + i, out + i);
+  if (i < n) {
+    T tail[3][kFloatLanes] = {};
+    T tail_out[kFloatLanes];
+    std::copy(p + i, p + n, tail[0]);
+    std::copy(min + i, min + n, tail[1]);
+    std::copy(max + i, max + n, tail[2]);
+    normalize(tail[0], tail[1], tail[2], tail_out);
+    std::copy(tail_out, tail_out + (n - i), out + i);
+    i = n;
+  }
+#endif
+  for (; i < n; i++) {
+    const float zeroed = std::max(static_cast<float>(p[i]) - min[i], 0.f);
+    const float range =
+        std::max(static_cast<float>(max[i]) - min[i], min_range);
+    out[i] = cv::saturate_cast<T>(std::min(zeroed * (top / range), top));
+  }
+}
+
+// 255 / range in 16.16 fixed point, split into 16-bit halves so that the
+// multiply fits in 16-bit lanes. With 16 fractional bits, the error in
+// zeroed * 255 / range is under 255 / 2^17, far too small to move the result
+// to a different integer except where the exact answer is within a hair of
+// x.5. A zero range gets the same entry as 1: either way, zero maps to zero
+// and anything else saturates.
+struct ReciprocalTable {
+  ReciprocalTable() {
+    for (int range = 0; range < 256; range++) {
+      // Rounded to nearest: twice the quotient, plus one, halved.
+      const uint32_t divisor = std::max(range, 1);
+      const uint32_t reciprocal = ((255u << 17) / divisor + 1) / 2;
+      high[range] = static_cast<uint16_t>(reciprocal >> 16);
+      low[range] = static_cast<uint16_t>(reciprocal & 0xffff);
+    }
+  }
+
+  uint16_t high[256];
+  uint16_t low[256];
+};
+
+const ReciprocalTable &Reciprocals() {
+  static const ReciprocalTable table;
+  return table;
+}
+
+// NormalizeRow's arithmetic, but in fixed point:
+//     out = min((zeroed * reciprocal + 2^15) >> 16, 255)
+// where the product is assembled from 16-bit halves:
+//     zeroed * high + (zeroed * low) >> 16 + rounding bit
+// None of the partial sums overflows 16 bits: zeroed * high is at most
+// 255 * 255, and the other two terms add less than 256.
+void NormalizeRowFixedPoint(const uchar *p, const uchar *min, const uchar *max,
+                            int n, uchar *out) {
+  const ReciprocalTable &table = Reciprocals();
+  int i = 0;
+#if defined(__SSE2__)
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i limit = _mm_set1_epi16(255);
+  // SSE2 has no gather, so the table lookups are scalar; everything else is
+  // eight lanes at a time.
+  alignas(16) uint16_t high[16];
+  alignas(16) uint16_t low[16];
+  auto normalize8 = [&](__m128i zeroed, const uint16_t *high8,
+                        const uint16_t *low8) {
+    const __m128i h = _mm_load_si128((const __m128i *)high8);
+    const __m128i l = _mm_load_si128((const __m128i *)low8);
+    __m128i result = _mm_mullo_epi16(zeroed, h);
+    result = _mm_add_epi16(result, _mm_mulhi_epu16(zeroed, l));
+    result = _mm_add_epi16(
+        result, _mm_srli_epi16(_mm_mullo_epi16(zeroed, l), 15));
+    // min(result, 255), in unsigned 16-bit lanes, which SSE2 has no
+    // instruction for.
+    return _mm_sub_epi16(result, _mm_subs_epu16(result, limit));
+  };
+  for (; i + 16 <= n; i += 16) {
+    const __m128i pv = _mm_loadu_si128((const __m128i *)(p + i));
+    const __m128i minv = _mm_loadu_si128((const __m128i *)(min + i));
+    const __m128i maxv = _mm_loadu_si128((const __m128i *)(max + i));
+    const __m128i zeroed = _mm_subs_epu8(pv, minv);
+    alignas(16) uchar range[16];
+    _mm_store_si128((__m128i *)range, _mm_subs_epu8(maxv, minv));
+    for (int k = 0; k < 16; k++) {
+      high[k] = table.high[range[k]];
+      low[k] = table.low[range[k]];
+    }
+    const __m128i lo = normalize8(_mm_unpacklo_epi8(zeroed, zero), high, low);
+    const __m128i hi =
+        normalize8(_mm_unpackhi_epi8(zeroed, zero), high + 8, low + 8);
+    _mm_storeu_si128((__m128i *)(out + i), _mm_packus_epi16(lo, hi));
+  }
+#endif
+  // Same arithmetic as above, so results don't depend on where a row ends.
+  for (; i < n; i++) {
+    const int zeroed = std::max(p[i] - min[i], 0);
+    const int range = std::max(max[i] - min[i], 0);
+    const uint32_t reciprocal =
+        (static_cast<uint32_t>(table.high[range]) << 16) | table.low[range];
+    const uint32_t value = (zeroed * reciprocal + (1u << 15)) >> 16;
+    out[i] = static_cast<uchar>(std::min<uint32_t>(value, 255));
+  }
+}
+
+// Shared implementation of the RelevelFused family, for pixels of type T.
+// `region` holds the pixels at `origin` in an image of size full_size. If
+// min_level1 is set, the upsampled rows of the two levels are blended before
+// normalizing.
+template <typename T>
+void RelevelRowsOf(const cv::Mat &region, cv::Point origin,
+                   cv::Size full_size, const cv::Mat &min_level0,
+                   const cv::Mat &max_level0, const cv::Mat *min_level1,
+                   const cv::Mat *max_level1, int weight, cv::Mat *output) {
+  CV_Assert(min_level0.type() == region.type() &&
+            max_level0.type() == region.type() &&
+            min_level0.size() == max_level0.size() && !min_level0.empty());
+  CV_Assert(origin.x >= 0 && origin.x + region.cols <= full_size.width &&
+            origin.y >= 0 && origin.y + region.rows <= full_size.height);
+  const int cn = region.channels();
+  const int row_len = region.cols * cn;
+  output->create(region.rows, region.cols, region.type());
+
+  // Walks one level down the region, producing upsampled min and max rows.
+  // Only a row's worth of those ever exists at once.
+  struct LevelRows {
+    LevelRows(const cv::Mat &min_level, const cv::Mat &max_level,
+              cv::Size full_size, cv::Rect region, int cn)
+        : x_table(BuildAxisTable(min_level.cols, full_size.width, true,
+                                 region.x, region.width)),
+          y_table(BuildAxisTable(min_level.rows, full_size.height, false,
+                                 region.y, region.height)),
+          min_rows(min_level, x_table, cn), max_rows(max_level, x_table, cn),
+          min_row(region.width * cn), max_row(region.width * cn) {}
+
+    void Fill(int row) {
+      const int y0 = y_table.offset0[row];
+      const int y1 = y_table.offset1[row];
+      const short w0 = y_table.weight0[row];
+      const short w1 = y_table.weight1[row];
+      const int n = static_cast<int>(min_row.size());
+
+      const typename PixelTraits<T>::Interpolated *h0, *h1;
+      min_rows.Fetch(y0, y1, &h0, &h1);
+      BlendRows(h0, h1, w0, w1, n, min_row.data());
+      max_rows.Fetch(y0, y1, &h0, &h1);
+      BlendRows(h0, h1, w0, w1, n, max_row.data());
+    }
+
+    const AxisTable x_table;
+    const AxisTable y_table;
+    InterpolatedRows<T> min_rows;
+    InterpolatedRows<T> max_rows;
+    std::vector<T> min_row;
+    std::vector<T> max_row;
+  };
+
+  const cv::Rect rect(origin, region.size());
+  LevelRows level0(min_level0, max_level0, full_size, rect, cn);
+  std::unique_ptr<LevelRows> level1;
+  if (min_level1 != nullptr) {
+    CV_Assert(min_level1->type() == region.type() &&
+              max_level1->type() == region.type() &&
+              min_level1->size() == max_level1->size() &&
+              !min_level1->empty());
+    level1.reset(
+        new LevelRows(*min_level1, *max_level1, full_size, rect, cn));
+  }
+
+  for (int row = 0; row < region.rows; row++) {
+    level0.Fill(row);
+    if (level1) {
+      level1->Fill(row);
+      BlendLevelRows(level0.min_row.data(), level1->min_row.data(), weight,
+                     row_len, level0.min_row.data());
+      BlendLevelRows(level0.max_row.data(), level1->max_row.data(), weight,
+                     row_len, level0.max_row.data());
+    }
+    NormalizeRow(region.ptr<T>(row), level0.min_row.data(),
+                 level0.max_row.data(), row_len, output->ptr<T>(row));
+  }
+}
+
+void RelevelRows(const cv::Mat &region, cv::Point origin, cv::Size full_size,
+                 const cv::Mat &min_level0, const cv::Mat &max_level0,
+                 const cv::Mat *min_level1, const cv::Mat *max_level1,
+                 int weight, cv::Mat *output) {
+  switch (region.depth()) {
+  case CV_16U:
+    return RelevelRowsOf<uint16_t>(region, origin, full_size, min_level0,
+                                   max_level0, min_level1, max_level1, weight,
+                                   output);
+  case CV_32F:
+    return RelevelRowsOf<float>(region, origin, full_size, min_level0,
+                                max_level0, min_level1, max_level1, weight,
+                                output);
+  default:
+    CV_Assert(region.depth() == CV_8U);
+    return RelevelRowsOf<uchar>(region, origin, full_size, min_level0,
+                                max_level0, min_level1, max_level1, weight,
+                                output);
+  }
+}
+
+template <typename T>
+cv::Mat UpsampleLinearOf(const cv::Mat src, cv::Size size) {
+  const int cn = src.channels();
+  cv::Mat output(size, src.type());
+
+  const AxisTable x_table = BuildAxisTable(src.cols, size.width, true);
+  const AxisTable y_table = BuildAxisTable(src.rows, size.height, false);
+  InterpolatedRows<T> rows(src, x_table, cn);
+  for (int row = 0; row < size.height; row++) {
+    const typename PixelTraits<T>::Interpolated *h0, *h1;
+    rows.Fetch(y_table.offset0[row], y_table.offset1[row], &h0, &h1);
+    BlendRows(h0, h1, y_table.weight0[row], y_table.weight1[row],
+              size.width * cn, output.ptr<T>(row));
+  }
+  return output;
+}
+
+template <typename T>
+cv::Mat BlendImagesOf(const cv::Mat a, const cv::Mat b, int weight) {
+  cv::Mat output(a.size(), a.type());
+  const int row_len = a.cols * a.channels();
+  for (int row = 0; row < a.rows; row++) {
+    BlendLevelRows(a.ptr<T>(row), b.ptr<T>(row), weight, row_len,
+                   output.ptr<T>(row));
+  }
+  return output;
+}
+
+template <typename T>
+void NormalizeOf(const cv::Mat &image, const cv::Mat &min, const cv::Mat &max,
+                 cv::Mat *output) {
+  const int row_len = image.cols * image.channels();
+  for (int row = 0; row < image.rows; row++) {
+    NormalizeRow(image.ptr<T>(row), min.ptr<T>(row), max.ptr<T>(row),
+                 row_len, output->ptr<T>(row));
+  }
+}
+
+} // namespace
+
+cv::Mat UpsampleLinear(const cv::Mat src, cv::Size size) {
+  CV_Assert(!src.empty());
+  switch (src.depth()) {
+  case CV_16U:
+    return UpsampleLinearOf<uint16_t>(src, size);
+  case CV_32F:
+    return UpsampleLinearOf<float>(src, size);
+  default:
+    CV_Assert(src.depth() == CV_8U);
+    return UpsampleLinearOf<uchar>(src, size);
+  }
+}
+
+void RelevelFused(const cv::Mat image, const cv::Mat min_level,
+                  const cv::Mat max_level, cv::Mat *output) {
+  RelevelRows(image, cv::Point(0, 0), image.size(), min_level, max_level,
+              nullptr, nullptr, 0, output);
+}
+
+void RelevelFusedStrip(const cv::Mat strip, int first_row, cv::Size full_size,
+                       const cv::Mat min_level, const cv::Mat max_level,
+                       cv::Mat *output) {
+  CV_Assert(strip.cols == full_size.width);
+  RelevelRows(strip, cv::Point(0, first_row), full_size, min_level, max_level,
+              nullptr, nullptr, 0, output);
+}
+
+void RelevelFusedBlend(const cv::Mat image, const cv::Mat min_level0,
+                       const cv::Mat max_level0, const cv::Mat min_level1,
+                       const cv::Mat max_level1, int weight, cv::Mat *output) {
+  CV_Assert(weight >= 0 && weight <= 256);
+  RelevelRows(image, cv::Point(0, 0), image.size(), min_level0, max_level0,
+              &min_level1, &max_level1, weight, output);
+}
+
+void RelevelFusedRegion(const cv::Mat image, cv::Rect roi,
+                        const cv::Mat min_level0, const cv::Mat max_level0,
+                        const cv::Mat min_level1, const cv::Mat max_level1,
+                        int weight, cv::Mat *output) {
+  CV_Assert(weight >= 0 && weight <= 256 &&
+            (roi & cv::Rect(0, 0, image.cols, image.rows)) == roi);
+  const bool blend = !min_level1.empty();
+  RelevelRows(image(roi), roi.tl(), image.size(), min_level0, max_level0,
+              blend ? &min_level1 : nullptr, blend ? &max_level1 : nullptr,
+              weight, output);
+}
+
+void Normalize(const cv::Mat image, const cv::Mat min, const cv::Mat max,
+               cv::Mat *output) {
+  CV_Assert(min.type() == image.type() && max.type() == image.type() &&
+            min.size() == image.size() && max.size() == image.size());
+  output->create(image.size(), image.type());
+  switch (image.depth()) {
+  case CV_16U:
+    return NormalizeOf<uint16_t>(image, min, max, output);
+  case CV_32F:
+    return NormalizeOf<float>(image, min, max, output);
+  default:
+    CV_Assert(image.depth() == CV_8U);
+    return NormalizeOf<uchar>(image, min, max, output);
+  }
+}
+
+void NormalizeFixedPoint(const cv::Mat image, const cv::Mat min,
+                         const cv::Mat max, cv::Mat *output) {
+  CV_Assert(image.depth() == CV_8U && min.type() == image.type() &&
+            max.type() == image.type() && min.size() == image.size() &&
+            max.size() == image.size());
+  output->create(image.size(), image.type());
+  const int row_len = image.cols * image.channels();
+  for (int row = 0; row < image.rows; row++) {
+    NormalizeRowFixedPoint(image.ptr(row), min.ptr(row), max.ptr(row),
+                           row_len, output->ptr(row));
+  }
+}
+
+cv::Mat BlendImages(const cv::Mat a, const cv::Mat b, int weight) {
+  CV_Assert(a.type() == b.type() && a.size() == b.size() && weight >= 0 &&
+            weight <= 256);
+  switch (a.depth()) {
+  case CV_16U:
+    return BlendImagesOf<uint16_t>(a, b, weight);
+  case CV_32F:
+    return BlendImagesOf<float>(a, b, weight);
+  default:
+    CV_Assert(a.depth() == CV_8U);
+    return BlendImagesOf<uchar>(a, b, weight);
+  }
+}
@@ -0,0 +1,85 @@
+#ifndef RELEVEL_KERNEL_
+#define RELEVEL_KERNEL_
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// Low-level kernels behind MinMaxPyramid::Relevel. Everything here works on
+// CV_8U, CV_16U and CV_32F images with any channel count, as long as all the
+// inputs to a call agree. Results span each depth's full range: up to 255,
+// 65535, or 1.0 for float.
+//
+// 8-bit images use fixed-point arithmetic throughout; the deeper ones
+// interpolate and normalize in float.
+
+// Bilinear upsample of src to the given size. For 8 bits, this uses the same
+// fixed-point arithmetic as OpenCV's vectorized INTER_LINEAR path, but unlike
+// cv::resize it doesn't change depending on which SIMD (or IPP) path OpenCV
+// was built with. That matters because RelevelFused interpolates inline with
+// exactly this arithmetic, and the two need to agree.
+cv::Mat UpsampleLinear(const cv::Mat src, cv::Size size);
+
+// Computes the releveled image in a single pass over rows:
+//     min = UpsampleLinear(min_level, image.size())
+//     max = UpsampleLinear(max_level, image.size())
+//     output = (image - min) * 255 / (max - min)
+// (with 65535 or 1.0 in place of 255 for deeper images) without ever
+// materializing the full-size min/max images, or anything else full-size
+// besides the output.
+//
+// Where max == min, the range is treated as infinitesimally small: pixels at
+// (or below) min go to 0, anything above goes to the top of the range.
+void RelevelFused(const cv::Mat image, const cv::Mat min_level,
+                  const cv::Mat max_level, cv::Mat *output);
+
+// RelevelFused for a horizontal strip of a bigger image: `strip` holds rows
+// [first_row, first_row + strip.rows) of an image of size full_size, and
+// *output gets the same rows of what RelevelFused would produce for the whole
+// image. Each output row depends only on its own input row (plus the levels),
+// so strips need no overlap, and stitching them back together gives exactly
+// the full result.
+void RelevelFusedStrip(const cv::Mat strip, int first_row, cv::Size full_size,
+                       const cv::Mat min_level, const cv::Mat max_level,
+                       cv::Mat *output);
+
+// output = (image - min) * 255 / (max - min) (or 65535, or 1.0), for
+// full-size min and max, with the same arithmetic and zero-range rule as
+// RelevelFused. For min and max that come from somewhere other than pyramid
+// levels, e.g. SlidingMinMax.
+void Normalize(const cv::Mat image, const cv::Mat min, const cv::Mat max,
+               cv::Mat *output);
+
+// For CV_8U only:
+// output = (image - min) * 255 / (max - min), for full-size min and max, with
+// the same zero-range rule as RelevelFused. This is the normalization step on
+// its own, done in 16-bit fixed point: there are only 256 possible ranges, so
+// each division becomes a lookup of 255 / range (to 16 fractional bits) and a
+// multiply. Agrees with the CV_32F version to within 1, and only differs at
+// all where the exact result is within rounding of x.5.
+void NormalizeFixedPoint(const cv::Mat image, const cv::Mat min,
+                         const cv::Mat max, cv::Mat *output);
+
+// Blends two same-sized images: (a * (256 - weight) + b * weight) / 256,
+// rounded. `weight` is out of 256.
+cv::Mat BlendImages(const cv::Mat a, const cv::Mat b, int weight);
+
+// RelevelFused, but with the min and max interpolated between two levels:
+//     min = BlendImages(UpsampleLinear(min_level0, image.size()),
+//                       UpsampleLinear(min_level1, image.size()), weight)
+// and likewise for max. This is how fractional scales work; the blend happens
+// row by row as part of the same pass, so it costs little more than a single
+// level.
+void RelevelFusedBlend(const cv::Mat image, const cv::Mat min_level0,
+                       const cv::Mat max_level0, const cv::Mat min_level1,
+                       const cv::Mat max_level1, int weight, cv::Mat *output);
+
+// RelevelFusedBlend (or RelevelFused, if min_level1 and max_level1 are empty)
+// for just the part of `image` inside `roi`, which must lie within it.
+// *output gets roi.size(), and matches that part of the full result exactly:
+// the levels are sampled just as they would be for the whole image, only
+// nowhere outside the roi. Cost scales with the roi, not the image.
+void RelevelFusedRegion(const cv::Mat image, cv::Rect roi,
+                        const cv::Mat min_level0, const cv::Mat max_level0,
+                        const cv::Mat min_level1, const cv::Mat max_level1,
+                        int weight, cv::Mat *output);
+
+#endif // RELEVEL_KERNEL_
@@ -0,0 +1,184 @@
+#include "relevel_kernel.h"
+
+#include "opencv4/opencv2/opencv.hpp"
+#include "gtest/gtest.h"
+
+TEST(RelevelKernel, UpsampleLinearIsCloseToResize) {
+  // cv::resize's exact output depends on how OpenCV was built, so only expect
+  // agreement to within rounding.
+  cv::Mat small(5, 7, CV_8UC3);
+  cv::randu(small, cv::Scalar::all(0), cv::Scalar::all(256));
+  for (cv::Size size : {cv::Size(7, 5), cv::Size(14, 10), cv::Size(100, 37)}) {
+    cv::Mat expected;
+    cv::resize(small, expected, size, 0, 0, cv::INTER_LINEAR);
+    EXPECT_LE(cv::norm(UpsampleLinear(small, size), expected, cv::NORM_INF),
+              1);
+  }
+}
+
+TEST(RelevelKernel, FusedMatchesUpsampledLayers) {
+  cv::Mat image(45, 67, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat min_level(6, 9, CV_8UC3), max_level(6, 9, CV_8UC3);
+  cv::randu(min_level, cv::Scalar::all(0), cv::Scalar::all(128));
+  cv::randu(max_level, cv::Scalar::all(128), cv::Scalar::all(256));
+
+  cv::Mat output;
+  RelevelFused(image, min_level, max_level, &output);
+
+  const cv::Mat min = UpsampleLinear(min_level, image.size());
+  const cv::Mat max = UpsampleLinear(max_level, image.size());
+  for (int row = 0; row < image.rows; row++) {
+    for (int col = 0; col < image.cols * 3; col++) {
+      const int p = image.ptr(row)[col];
+      const int lo = min.ptr(row)[col];
+      const int hi = max.ptr(row)[col];
+      const int expected = cv::saturate_cast<uchar>(
+          std::max(p - lo, 0) * 255.f / static_cast<float>(hi - lo));
+      ASSERT_NEAR(expected, output.ptr(row)[col], 1)
+          << "at " << row << ", " << col;
+    }
+  }
+}
+
+TEST(RelevelKernel, DeeperFusedMatchesUpsampledLayers) {
+  for (int depth : {CV_16U, CV_32F}) {
+    SCOPED_TRACE(testing::Message() << "depth " << depth);
+    const double top = depth == CV_16U ? 65535 : 1;
+    cv::Mat image(45, 67, CV_MAKETYPE(depth, 3));
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(top));
+    cv::Mat min_level(6, 9, image.type()), max_level(6, 9, image.type());
+    cv::randu(min_level, cv::Scalar::all(0), cv::Scalar::all(top / 2));
+    cv::randu(max_level, cv::Scalar::all(top / 2), cv::Scalar::all(top));
+
+    cv::Mat output;
+    RelevelFused(image, min_level, max_level, &output);
+    ASSERT_EQ(image.type(), output.type());
+
+    cv::Mat p, min, max, result;
+    image.convertTo(p, CV_64F);
+    UpsampleLinear(min_level, image.size()).convertTo(min, CV_64F);
+    UpsampleLinear(max_level, image.size()).convertTo(max, CV_64F);
+    output.convertTo(result, CV_64F);
+    for (int row = 0; row < image.rows; row++) {
+      for (int col = 0; col < image.cols * 3; col++) {
+        const double lo = min.ptr<double>(row)[col];
+        const double hi = max.ptr<double>(row)[col];
+        const double expected = std::min(
+            std::max(p.ptr<double>(row)[col] - lo, 0.) * top / (hi - lo), top);
+        // Within a step of 16 bits either way.
+        ASSERT_NEAR(expected, result.ptr<double>(row)[col], top / 65535)
+            << "at " << row << ", " << col;
+      }
+    }
+  }
+}
+
+TEST(RelevelKernel, BlendedMatchesBlendedLayers) {
+  cv::Mat image(45, 67, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  cv::Mat min0(12, 17, CV_8UC3), max0(12, 17, CV_8UC3);
+  cv::Mat min1(6, 9, CV_8UC3), max1(6, 9, CV_8UC3);
+  cv::randu(min0, cv::Scalar::all(0), cv::Scalar::all(128));
+  cv::randu(max0, cv::Scalar::all(128), cv::Scalar::all(256));
+  cv::randu(min1, cv::Scalar::all(0), cv::Scalar::all(128));
+  cv::randu(max1, cv::Scalar::all(128), cv::Scalar::all(256));
+
+  for (int weight : {0, 1, 100, 255, 256}) {
+    cv::Mat blended;
+    RelevelFusedBlend(image, min0, max0, min1, max1, weight, &blended);
+
+    // Same thing, the long way round.
+    const cv::Mat min =
+        BlendImages(UpsampleLinear(min0, image.size()),
+                    UpsampleLinear(min1, image.size()), weight);
+    const cv::Mat max =
+        BlendImages(UpsampleLinear(max0, image.size()),
+                    UpsampleLinear(max1, image.size()), weight);
+    cv::Mat expected;
+    // Upsampling an image to its own size is the identity, so this normalizes
+    // against exactly `min` and `max`.
+    RelevelFused(image, min, max, &expected);
+    EXPECT_EQ(0, cv::norm(expected, blended, cv::NORM_INF))
+        << "weight " << weight;
+  }
+}
+
+TEST(RelevelKernel, RegionMatchesFullResult) {
+  // Deeper pixels too: their kernels work a vector at a time as well, and a
+  // region's rows end somewhere else than the full image's.
+  for (int depth : {CV_8U, CV_16U, CV_32F}) {
+    SCOPED_TRACE(testing::Message() << "depth " << depth);
+    const double top = depth == CV_8U ? 256 : depth == CV_16U ? 65535 : 1;
+    const int type = CV_MAKETYPE(depth, 3);
+    cv::Mat image(45, 67, type);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(top));
+    cv::Mat min0(12, 17, type), max0(12, 17, type);
+    cv::Mat min1(6, 9, type), max1(6, 9, type);
+    cv::randu(min0, cv::Scalar::all(0), cv::Scalar::all(top / 2));
+    cv::randu(max0, cv::Scalar::all(top / 2), cv::Scalar::all(top));
+    cv::randu(min1, cv::Scalar::all(0), cv::Scalar::all(top / 2));
+    cv::randu(max1, cv::Scalar::all(top / 2), cv::Scalar::all(top));
+
+    cv::Mat full, blended;
+    RelevelFused(image, min0, max0, &full);
+    RelevelFusedBlend(image, min0, max0, min1, max1, 100, &blended);
+    // Corners, edges, odd sizes and single pixels.
+    for (cv::Rect roi : {cv::Rect(0, 0, 67, 45), cv::Rect(0, 0, 10, 7),
+                         cv::Rect(57, 38, 10, 7), cv::Rect(13, 5, 31, 22),
+                         cv::Rect(66, 44, 1, 1), cv::Rect(3, 0, 1, 45)}) {
+      cv::Mat region;
+      RelevelFusedRegion(image, roi, min0, max0, cv::Mat(), cv::Mat(), 0,
+                         &region);
+      EXPECT_EQ(0, cv::norm(full(roi), region, cv::NORM_INF)) << roi;
+      RelevelFusedRegion(image, roi, min0, max0, min1, max1, 100, &region);
+      EXPECT_EQ(0, cv::norm(blended(roi), region, cv::NORM_INF)) << roi;
+    }
+  }
+}
+
+TEST(RelevelKernel, FixedPointNormalizeMatchesFloat) {
+  // Every combination of pixel and max, against a few mins (including ones
+  // above the pixel). The rows are long enough to use the SIMD path, and odd
+  // enough to have a tail too.
+  cv::Mat image(256, 257, CV_8UC1), max(256, 257, CV_8UC1);
+  for (int row = 0; row < 256; row++) {
+    for (int col = 0; col < 257; col++) {
+      image.at<uchar>(row, col) = static_cast<uchar>(row);
+      max.at<uchar>(row, col) = static_cast<uchar>(col % 256);
+    }
+  }
+  for (int min_value : {0, 1, 77, 255}) {
+    const cv::Mat min(image.size(), CV_8UC1, cv::Scalar::all(min_value));
+    cv::Mat output;
+    NormalizeFixedPoint(image, min, max, &output);
+
+    int mismatches = 0;
+    for (int row = 0; row < image.rows; row++) {
+      for (int col = 0; col < image.cols; col++) {
+        const int zeroed = std::max(image.at<uchar>(row, col) - min_value, 0);
+        const int range = std::max(max.at<uchar>(row, col) - min_value, 0);
+        const float range_f = range > 0 ? static_cast<float>(range) : 0.5f;
+        const int expected =
+            cv::saturate_cast<uchar>(zeroed * (255.f / range_f));
+        const int actual = output.at<uchar>(row, col);
+        ASSERT_NEAR(expected, actual, 1) << zeroed << " / " << range;
+        mismatches += expected != actual;
+      }
+    }
+    // Off by one only on (near-)ties, which are rare.
+    EXPECT_LT(mismatches, image.total() / 100) << "min " << min_value;
+  }
+}
+
+TEST(RelevelKernel, BlendImagesRounds) {
+  const cv::Mat a(1, 40, CV_8UC1, cv::Scalar::all(10));
+  const cv::Mat b(1, 40, CV_8UC1, cv::Scalar::all(21));
+  EXPECT_EQ(10, BlendImages(a, b, 0).at<uchar>(0, 33));
+  EXPECT_EQ(21, BlendImages(a, b, 256).at<uchar>(0, 33));
+  // 10 + 11 * 128 / 256 = 15.5, rounded up; check both the SIMD and scalar
+  // parts of the row.
+  const cv::Mat half = BlendImages(a, b, 128);
+  EXPECT_EQ(16, half.at<uchar>(0, 0));
+  EXPECT_EQ(16, half.at<uchar>(0, 39));
+}
@@ -0,0 +1,32 @@
+#ifndef ROW_STREAM_
+#define ROW_STREAM_
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// Interfaces for images that are read or written a band of rows at a time,
+// for images too big to hold in memory all at once.
+
+class RowSource {
+public:
+  virtual ~RowSource() = default;
+
+  virtual cv::Size size() const = 0;
+  // OpenCV type of the rows, e.g. CV_8UC3.
+  virtual int type() const = 0;
+
+  // Reads the next `count` rows into *rows, or however many are left if that's
+  // fewer. Returns false on error, or if there's nothing left.
+  virtual bool ReadRows(int count, cv::Mat *rows) = 0;
+  // Goes back to the first row, for another pass over the image.
+  virtual bool Rewind() = 0;
+};
+
+class RowSink {
+public:
+  virtual ~RowSink() = default;
+
+  // Appends rows to the image. Returns false on error.
+  virtual bool WriteRows(const cv::Mat &rows) = 0;
+};
+
+#endif // ROW_STREAM_
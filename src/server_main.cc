@@ -0,0 +1,124 @@
+#include <signal.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "pyramid_server.h"
+
+// Relevels images on request, keeping them in memory between requests; see
+// pyramid_server.h for the protocol, and `client` for talking to it. Like
+// `batch`, this is headless.
+
+namespace {
+
+const char kUsage[] =
+    "Usage: server [flags]\n"
+    "\n"
+    "Serves relevel requests over a Unix domain socket until interrupted,\n"
+    "keeping recently used images and their pyramids in memory so that\n"
+    "repeat requests skip decoding and pre-processing.\n"
+    "\n"
+    "  --socket=PATH  Where to listen (default: undersee.sock in\n"
+    "                 $XDG_RUNTIME_DIR, or /tmp/undersee-<uid>.sock).\n"
+    "  --threads=N    Connections served at once (default: one per core).\n"
+    "  --cache_mb=N   Memory for cached images and pyramids (default: 2048).\n"
+    "  --output_cache_mb=N\n"
+    "                 Memory for encoded outputs, so that repeat requests\n"
+    "                 only have to write the file (default: 256).\n"
+    "  --idle_timeout=S\n"
+    "                 Close connections that send nothing for S seconds, so\n"
+    "                 that they don't hold up other clients (default: 10).\n"
+    "  --pyramid_threads=N\n"
+    "                 Threads pre-processing each newly loaded image\n"
+    "                 (default: 1).\n";
+
+bool ParsePositive(const std::string &text, int *value) {
+  char *end;
+  const long parsed = std::strtol(text.c_str(), &end, 10);
+  if (text.empty() || *end != '\0' || parsed <= 0)
+    return false;
+  *value = static_cast<int>(parsed);
+  return true;
+}
+
+// If `arg` is --<name>=<value>, sets *value and returns true.
+bool MatchFlag(const std::string &arg, const std::string &name,
+               std::string *value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  PyramidServer::Options options;
+  options.socket_path = DefaultServerSocketPath();
+  options.worker_threads =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    std::string value;
+    bool ok;
+    int cache_mb;
+    if (MatchFlag(arg, "socket", &value)) {
+      options.socket_path = value;
+      ok = !value.empty();
+    } else if (MatchFlag(arg, "threads", &value)) {
+      ok = ParsePositive(value, &options.worker_threads);
+    } else if (MatchFlag(arg, "cache_mb", &value)) {
+      ok = ParsePositive(value, &cache_mb);
+      options.cache_bytes = static_cast<size_t>(cache_mb) << 20;
+    } else if (MatchFlag(arg, "output_cache_mb", &value)) {
+      ok = ParsePositive(value, &cache_mb);
+      options.output_cache_bytes = static_cast<size_t>(cache_mb) << 20;
+    } else if (MatchFlag(arg, "idle_timeout", &value)) {
+      int seconds;
+      ok = ParsePositive(value, &seconds) && seconds <= 24 * 60 * 60;
+      options.idle_timeout_ms = seconds * 1000;
+    } else if (MatchFlag(arg, "pyramid_threads", &value)) {
+      ok = ParsePositive(value, &options.pyramid_threads);
+    } else {
+      ok = false;
+    }
+    if (!ok) {
+      std::cerr << "Bad flag: " << arg << "\n\n" << kUsage;
+      return 1;
+    }
+  }
+
+  // Block the signals that end the server before any threads exist, so that
+  // they all inherit the mask and the signals only ever reach sigwait below.
+  sigset_t stop_signals;
+  sigemptyset(&stop_signals);
+  sigaddset(&stop_signals, SIGINT);
+  sigaddset(&stop_signals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+  PyramidServer server(options);
+  std::string error;
+  if (!server.Listen(&error)) {
+    std::cerr << error << "\n";
+    return 1;
+  }
+  std::thread stopper([&server, &stop_signals] {
+    int signal;
+    sigwait(&stop_signals, &signal);
+    server.Stop();
+  });
+  std::cerr << "Serving on " << options.socket_path << "\n";
+  server.Serve();
+  stopper.join();
+
+  const PyramidServer::Stats stats = server.GetStats();
+  std::cerr << "Served " << stats.requests << " requests ("
+            << stats.warm_requests << " warm, " << stats.failed_requests
+            << " failed, " << stats.reused_outputs
+            << " outputs reused); loaded " << stats.loads << " images\n";
+  return 0;
+}
@@ -0,0 +1,36 @@
+#include "shared_image.h"
+
+namespace {
+
+// QImage cleanup function: drops the reference the QImage was holding.
+void ReleaseMat(void *mat) { delete static_cast<cv::Mat *>(mat); }
+
+} // namespace
+
+SharedImage::SharedImage(const cv::Mat &mat) : mat_(mat) {
+  if (mat.empty())
+    return;
+  CV_Assert(mat.channels() == 3 || mat.channels() == 1);
+  if (mat.depth() == CV_16U)
+    mat.convertTo(mat_, CV_8U, 1.0 / 257);
+  else if (mat.depth() == CV_32F)
+    mat.convertTo(mat_, CV_8U, 255);
+  CV_Assert(mat_.depth() == CV_8U);
+
+  cv::Mat pixels = mat_;
+  QImage::Format format = QImage::Format_Grayscale8;
+  if (pixels.channels() == 3) {
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+    format = QImage::Format_BGR888;
+#else
+    // Older Qt only does RGB order, so this is the one case that has to copy.
+    // The editor only ever shows display-sized previews, so it's not much.
+    cv::cvtColor(mat_, pixels, cv::COLOR_BGR2RGB);
+    format = QImage::Format_RGB888;
+#endif
+  }
+  const uchar *data = pixels.data;
+  image_ = QImage(data, pixels.cols, pixels.rows,
+                  static_cast<int>(pixels.step), format, ReleaseMat,
+                  new cv::Mat(pixels));
+}
@@ -0,0 +1,38 @@
+#ifndef SHARED_IMAGE_
+#define SHARED_IMAGE_
+
+#include <QtGui/QImage>
+
+#include "opencv4/opencv2/opencv.hpp"
+
+// One image, usable as both a cv::Mat and a QImage without copying it.
+//
+// Both types can wrap someone else's pixels, and both are ref-counted, but
+// neither counts the other's references. Wrapping a Mat's data in a plain
+// QImage therefore leaves the QImage dangling if the Mat goes away first.
+// Here, the QImage holds a reference to the Mat's buffer of its own, which it
+// drops when the last copy of the QImage goes away. So either side can be
+// copied around and outlive the other.
+//
+// The QImage is read-only: anything that tries to modify it gets a detached
+// copy, rather than writing over pixels that OpenCV may be sharing elsewhere
+// (or that live in a read-only mapped cache file).
+class SharedImage {
+public:
+  SharedImage() = default;
+  // Takes a reference to the pixels, not a copy. They must be either BGR
+  // (OpenCV's usual order) or grayscale. 16-bit and float pixels (the latter
+  // in 0-1) are the exception: QImage can't show them as they are, so they get
+  // converted to an 8-bit copy, and mat() returns that.
+  explicit SharedImage(const cv::Mat &mat);
+
+  bool empty() const { return mat_.empty(); }
+  const cv::Mat &mat() const { return mat_; }
+  const QImage &image() const { return image_; }
+
+private:
+  cv::Mat mat_;
+  QImage image_;
+};
+
+#endif // SHARED_IMAGE_
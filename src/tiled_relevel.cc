@@ -0,0 +1,206 @@
+#include "tiled_relevel.h"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "min_max_pyramid.h"
+#include "relevel_kernel.h"
+
+namespace {
+
+// Rounds up, the same way each pyramid level does.
+int LevelLength(int length, int scale) {
+  for (int i = 0; i <= scale; i++)
+    length = (length + 1) / 2;
+  return length;
+}
+
+// Builds the one pyramid level that `scale` needs, from the image's rows a
+// band at a time. Rows are reduced in pairs as soon as both are in, at each
+// step down to the level, so a band can start and end on any row: all that's
+// kept between bands is the odd row out, if any, of each step.
+class LevelBuilder {
+public:
+  LevelBuilder(int scale, cv::Mat *min_level, cv::Mat *max_level)
+      : scale_(scale), min_level_(min_level), max_level_(max_level),
+        carry_min_(scale + 1), carry_max_(scale + 1) {}
+
+  // Takes the image's next rows.
+  void Add(const cv::Mat &rows) { Push(0, rows, rows); }
+
+  // Reduces what's left over once the whole image is in. A step with an odd
+  // number of rows ends with one reduced on its own, just as
+  // DownsampleMinMax rounds up.
+  void Finish() {
+    for (int step = 0; step <= scale_; step++) {
+      if (carry_min_[step].empty())
+        continue;
+      const cv::Mat min_row = carry_min_[step];
+      const cv::Mat max_row = carry_max_[step];
+      carry_min_[step].release();
+      carry_max_[step].release();
+      Reduce(step, min_row, max_row);
+    }
+    CV_Assert(level_row_ == min_level_->rows);
+  }
+
+private:
+  // Takes rows that step `step` reduces: the image's for step 0, otherwise
+  // the previous step's output.
+  void Push(int step, cv::Mat min_rows, cv::Mat max_rows) {
+    if (step > scale_) {
+      const int end = level_row_ + min_rows.rows;
+      min_rows.copyTo(min_level_->rowRange(level_row_, end));
+      max_rows.copyTo(max_level_->rowRange(level_row_, end));
+      level_row_ = end;
+      return;
+    }
+    // Finish the pair the last band left half done.
+    if (!carry_min_[step].empty()) {
+      cv::Mat min_pair(2, min_rows.cols, min_rows.type());
+      cv::Mat max_pair(2, max_rows.cols, max_rows.type());
+      carry_min_[step].copyTo(min_pair.row(0));
+      min_rows.row(0).copyTo(min_pair.row(1));
+      carry_max_[step].copyTo(max_pair.row(0));
+      max_rows.row(0).copyTo(max_pair.row(1));
+      carry_min_[step].release();
+      carry_max_[step].release();
+      Reduce(step, min_pair, max_pair);
+      min_rows = min_rows.rowRange(1, min_rows.rows);
+      max_rows = max_rows.rowRange(1, max_rows.rows);
+    }
+    // Hold back an odd row, in case there's another to pair it with.
+    if (min_rows.rows % 2 == 1) {
+      const int last = min_rows.rows - 1;
+      carry_min_[step] = min_rows.row(last).clone();
+      carry_max_[step] = max_rows.row(last).clone();
+      min_rows = min_rows.rowRange(0, last);
+      max_rows = max_rows.rowRange(0, last);
+    }
+    if (min_rows.rows > 0)
+      Reduce(step, min_rows, max_rows);
+  }
+
+  void Reduce(int step, const cv::Mat &min_rows, const cv::Mat &max_rows) {
+    cv::Mat next_min, next_max;
+    DownsampleMinMax(min_rows, max_rows, &next_min, &next_max);
+    Push(step + 1, next_min, next_max);
+  }
+
+  const int scale_;
+  cv::Mat *min_level_;
+  cv::Mat *max_level_;
+  int level_row_ = 0;
+  // The odd row out waiting for its pair, if any, at each step.
+  std::vector<cv::Mat> carry_min_;
+  std::vector<cv::Mat> carry_max_;
+};
+
+// Streams the image through unchanged, for out-of-range scales.
+bool CopyThrough(RowSource *source, int strip_rows, RowSink *sink,
+                 std::string *error) {
+  cv::Mat strip;
+  for (int row = 0; row < source->size().height; row += strip.rows) {
+    if (!source->ReadRows(strip_rows, &strip)) {
+      *error = "couldn't read rows from " + std::to_string(row);
+      return false;
+    }
+    if (!sink->WriteRows(strip)) {
+      *error = "couldn't write rows from " + std::to_string(row);
+      return false;
+    }
+  }
+  return true;
+}
+
+} // namespace
+
+bool PlanTiledRelevel(cv::Size size, int type, int scale,
+                      size_t memory_budget, TiledRelevelPlan *plan,
+                      std::string *error) {
+  // Out-of-range scales just copy the image, which needs no level at all; but
+  // planning for the nearest real scale keeps the numbers sane.
+  int min_scale, max_scale;
+  MinMaxPyramid::ScaleRange(size, &min_scale, &max_scale);
+  scale = std::min(std::max(scale, 0), max_scale);
+
+  const size_t pixel_bytes = CV_ELEM_SIZE(type);
+  const size_t row_bytes = size.width * pixel_bytes;
+  const size_t level_bytes = 2 * pixel_bytes * LevelLength(size.width, scale) *
+                             LevelLength(size.height, scale);
+
+  // Per row of strip: the input strip and its releveled copy. (Reducing a strip
+  // needs less: the strip, plus a third of it for what it reduces to, at each
+  // step together.)
+  const size_t strip_row_bytes = 2 * row_bytes;
+  // Plus a fixed amount per column for the kernel's interpolation tables, row
+  // buffers and the rows carried between strips while reducing; generously, a
+  // dozen rows' worth.
+  const size_t fixed_bytes = level_bytes + 12 * row_bytes;
+
+  const size_t min_bytes = fixed_bytes + strip_row_bytes;
+  if (memory_budget < min_bytes) {
+    *error = "needs a memory budget of at least " +
+             std::to_string((min_bytes + (1 << 20) - 1) >> 20) + "MB";
+    return false;
+  }
+  // As many rows as fit, but no more than the whole image.
+  const size_t fit_rows = (memory_budget - fixed_bytes) / strip_row_bytes;
+  plan->strip_rows =
+      static_cast<int>(std::min<size_t>(fit_rows, std::max(1, size.height)));
+  plan->peak_bytes = fixed_bytes + plan->strip_rows * strip_row_bytes;
+  return true;
+}
+
+bool TiledRelevel(RowSource *source, int scale, size_t memory_budget,
+                  RowSink *sink, std::string *error) {
+  const cv::Size size = source->size();
+  const int type = source->type();
+  if (CV_MAT_DEPTH(type) != CV_8U) {
+    *error = "only 8-bit images are supported";
+    return false;
+  }
+  TiledRelevelPlan plan;
+  if (!PlanTiledRelevel(size, type, scale, memory_budget, &plan, error))
+    return false;
+
+  int min_scale, max_scale;
+  MinMaxPyramid::ScaleRange(size, &min_scale, &max_scale);
+  if (scale < min_scale || scale > max_scale)
+    return CopyThrough(source, plan.strip_rows, sink, error);
+
+  // Pass 1: build the level.
+  cv::Mat min_level(LevelLength(size.height, scale),
+                    LevelLength(size.width, scale), type);
+  cv::Mat max_level(min_level.size(), type);
+  LevelBuilder builder(scale, &min_level, &max_level);
+  cv::Mat strip;
+  for (int row = 0; row < size.height; row += strip.rows) {
+    if (!source->ReadRows(plan.strip_rows, &strip)) {
+      *error = "couldn't read rows from " + std::to_string(row);
+      return false;
+    }
+    builder.Add(strip);
+  }
+  builder.Finish();
+
+  // Pass 2: relevel against it.
+  if (!source->Rewind()) {
+    *error = "couldn't rewind the input";
+    return false;
+  }
+  cv::Mat output;
+  for (int row = 0; row < size.height; row += strip.rows) {
+    if (!source->ReadRows(plan.strip_rows, &strip)) {
+      *error = "couldn't read rows from " + std::to_string(row);
+      return false;
+    }
+    RelevelFusedStrip(strip, row, size, min_level, max_level, &output);
+    if (!sink->WriteRows(output)) {
+      *error = "couldn't write rows from " + std::to_string(row);
+      return false;
+    }
+  }
+  return true;
+}
@@ -0,0 +1,52 @@
+#ifndef TILED_RELEVEL_
+#define TILED_RELEVEL_
+
+#include <cstddef>
+#include <string>
+
+#include "opencv4/opencv2/opencv.hpp"
+#include "row_stream.h"
+
+// Relevels images too big to hold in memory, such as stitched mosaics, by
+// streaming them through in horizontal strips. The output is exactly what
+//     MinMaxPyramid pyramid;
+//     pyramid.PreProcess(image);
+//     pyramid.Relevel(scale);
+// would give, but peak memory stays within a given budget.
+//
+// This takes two passes over the source:
+//   1. Build the one pyramid level that `scale` needs. Each pixel of it is the
+//      min/max over a 2^(scale+1) square block of the image, but that's
+//      reached by halving scale+1 times, and each halving only pairs up rows.
+//      So strips can be any height: each pair is reduced as soon as both rows
+//      are in, and at most one row per halving waits on the next strip.
+//   2. Relevel the image strip by strip against that level. Each output row
+//      only depends on its own input row and the (in-memory) level, so the
+//      strips need no overlap.
+//
+// The level costs 2 * pixels / 4^(scale+1) bytes per channel, and grows with
+// the whole image; everything else, strips included, grows only with its
+// width, at any scale. For a 100k x 40k RGB mosaic the level is 23MB at scale
+// 4, and the smallest workable budget is a few MB on top of that.
+struct TiledRelevelPlan {
+  // Rows read per strip.
+  int strip_rows = 0;
+  // Expected peak memory, for reporting.
+  size_t peak_bytes = 0;
+};
+
+// Works out how to relevel an image of the given size and type at the given
+// scale within memory_budget bytes. Returns false, with *error saying how much
+// memory it would take, if that isn't possible.
+bool PlanTiledRelevel(cv::Size size, int type, int scale,
+                      size_t memory_budget, TiledRelevelPlan *plan,
+                      std::string *error);
+
+// Relevels everything in source into sink. Scales outside the range that
+// MinMaxPyramid allows for this image size copy the image through unchanged,
+// the same as Relevel. Returns false, with *error set, if the budget is too
+// small or reading or writing fails.
+bool TiledRelevel(RowSource *source, int scale, size_t memory_budget,
+                  RowSink *sink, std::string *error);
+
+#endif // TILED_RELEVEL_
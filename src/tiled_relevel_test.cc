@@ -0,0 +1,138 @@
+#include "tiled_relevel.h"
+
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "min_max_pyramid.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+// Serves rows out of an in-memory image, keeping track of the biggest read.
+class MatRowSource : public RowSource {
+public:
+  explicit MatRowSource(const cv::Mat &image) : image_(image) {}
+
+  cv::Size size() const override { return image_.size(); }
+  int type() const override { return image_.type(); }
+
+  bool ReadRows(int count, cv::Mat *rows) override {
+    count = std::min(count, image_.rows - next_row_);
+    if (count <= 0)
+      return false;
+    image_.rowRange(next_row_, next_row_ + count).copyTo(*rows);
+    next_row_ += count;
+    largest_read_ = std::max(largest_read_, count);
+    return true;
+  }
+
+  bool Rewind() override {
+    next_row_ = 0;
+    return true;
+  }
+
+  int largest_read() const { return largest_read_; }
+
+private:
+  const cv::Mat image_;
+  int next_row_ = 0;
+  int largest_read_ = 0;
+};
+
+class MatRowSink : public RowSink {
+public:
+  bool WriteRows(const cv::Mat &rows) override {
+    image.push_back(rows);
+    return true;
+  }
+
+  cv::Mat image;
+};
+
+} // namespace
+
+TEST(TiledRelevel, MatchesInMemoryRelevel) {
+  for (const cv::Size size : {cv::Size(200, 150), cv::Size(97, 131)}) {
+    for (const int type : {CV_8UC1, CV_8UC3}) {
+      cv::Mat image(size, type);
+      cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+      MinMaxPyramid pyramid;
+      pyramid.PreProcess(image);
+
+      // Out-of-range scales on both sides copy the image through.
+      for (int scale = pyramid.MinScale() - 1;
+           scale <= pyramid.MaxScale() + 1; scale++) {
+        SCOPED_TRACE("size " + std::to_string(size.width) + "x" +
+                     std::to_string(size.height) + ", " +
+                     std::to_string(CV_MAT_CN(type)) + " channels, scale " +
+                     std::to_string(scale));
+        // Just over the minimum, so that the image goes through in several
+        // strips.
+        TiledRelevelPlan plan;
+        std::string error;
+        PlanTiledRelevel(size, type, scale, 0, &plan, &error);
+        ASSERT_THAT(error, ::testing::HasSubstr("at least"));
+        TiledRelevelPlan minimal;
+        size_t budget = 1 << 10;
+        while (!PlanTiledRelevel(size, type, scale, budget, &minimal, &error))
+          budget += 1 << 10;
+
+        MatRowSource source(image);
+        MatRowSink sink;
+        ASSERT_TRUE(TiledRelevel(&source, scale, budget, &sink, &error))
+            << error;
+        EXPECT_LE(source.largest_read(), minimal.strip_rows);
+        ASSERT_EQ(image.size(), sink.image.size());
+        EXPECT_EQ(0, cv::norm(pyramid.Relevel(scale), sink.image,
+                              cv::NORM_INF));
+      }
+    }
+  }
+}
+
+TEST(TiledRelevel, StaysWithinBudget) {
+  const cv::Size size(4000, 3000);
+  TiledRelevelPlan plan;
+  std::string error;
+  const size_t budget = 16 << 20;
+  ASSERT_TRUE(PlanTiledRelevel(size, CV_8UC3, 4, budget, &plan, &error));
+  EXPECT_LE(plan.peak_bytes, budget);
+  // Far less than the whole image.
+  EXPECT_LT(plan.strip_rows, size.height / 4);
+
+  EXPECT_FALSE(PlanTiledRelevel(size, CV_8UC3, 4, 128 << 10, &plan, &error));
+  EXPECT_THAT(error, ::testing::HasSubstr("at least"));
+}
+
+TEST(TiledRelevel, CoarseScalesNeedNoMoreMemory) {
+  // Tall and narrow, at a coarse scale: each level pixel covers 2^14 rows,
+  // far more than the budget could hold at once.
+  const cv::Size size(64, 20000);
+  cv::Mat image(size, CV_8UC3);
+  cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(256));
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(image);
+  const int scale = pyramid.MaxScale() - 1;
+  const size_t block_bytes = (size_t{1} << (scale + 1)) * size.width * 3;
+  const size_t budget = 64 << 10;
+  ASSERT_LT(budget * 16, block_bytes);
+
+  TiledRelevelPlan plan;
+  std::string error;
+  ASSERT_TRUE(PlanTiledRelevel(size, CV_8UC3, scale, budget, &plan, &error))
+      << error;
+  EXPECT_LE(plan.peak_bytes, budget);
+  // The minimum doesn't depend on the scale.
+  TiledRelevelPlan fine;
+  ASSERT_TRUE(PlanTiledRelevel(size, CV_8UC3, pyramid.MinScale(), budget,
+                               &fine, &error))
+      << error;
+
+  MatRowSource source(image);
+  MatRowSink sink;
+  ASSERT_TRUE(TiledRelevel(&source, scale, budget, &sink, &error)) << error;
+  EXPECT_LE(source.largest_read(), plan.strip_rows);
+  EXPECT_LT(plan.strip_rows, size.height / 16);
+  EXPECT_EQ(0, cv::norm(pyramid.Relevel(scale), sink.image, cv::NORM_INF));
+}
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv4/opencv2/opencv.hpp"
+#include "video_pipeline.h"
+
+// Relevels every frame of a video at one scale. Like `batch`, this is headless.
+
+namespace {
+
+const char kUsage[] =
+    "Usage: video [flags] <input_video> <output_video>\n"
+    "\n"
+    "  --scale=N, --scale=max-N, --scale=auto[:F]\n"
+    "                 Pyramid scale to relevel at, as for `batch`. Required.\n"
+    "                 An automatic scale is picked from the first frame.\n"
+    "  --smoothing=F  How much of the previous frames' local min/max each\n"
+    "                 frame keeps, from 0 (none) to just under 1; higher is\n"
+    "                 steadier but slower to follow the scene (default: 0.8).\n"
+    "  --threads=N    Threads releveling frames, on top of one each for\n"
+    "                 decoding and encoding (default: one per core, minus\n"
+    "                 those two).\n"
+    "  --codec=XXXX   FourCC of the output codec (default: mp4v).\n";
+
+// If `arg` is --<name>=<value>, sets *value and returns true.
+bool MatchFlag(const std::string &arg, const std::string &name,
+               std::string *value) {
+  const std::string prefix = "--" + name + "=";
+  if (arg.compare(0, prefix.size(), prefix) != 0)
+    return false;
+  *value = arg.substr(prefix.size());
+  return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  VideoPipeline::Options options;
+  options.smoothing = 0.8f;
+  options.worker_threads =
+      std::max(1, static_cast<int>(std::thread::hardware_concurrency()) - 2);
+  bool have_scale = false;
+  std::string codec = "mp4v";
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; i++) {
+    const std::string arg = argv[i];
+    std::string value;
+    bool ok = true;
+    if (MatchFlag(arg, "scale", &value)) {
+      ok = have_scale = ScaleRule::Parse(value, &options.scale);
+    } else if (MatchFlag(arg, "smoothing", &value)) {
+      char *end;
+      options.smoothing = std::strtof(value.c_str(), &end);
+      ok = !value.empty() && *end == '\0' && options.smoothing >= 0 &&
+           options.smoothing < 1;
+    } else if (MatchFlag(arg, "threads", &value)) {
+      char *end;
+      options.worker_threads = std::strtol(value.c_str(), &end, 10);
+      ok = !value.empty() && *end == '\0' && options.worker_threads > 0;
+    } else if (MatchFlag(arg, "codec", &value)) {
+      codec = value;
+      ok = codec.size() == 4;
+    } else if (arg.compare(0, 2, "--") == 0) {
+      ok = false;
+    } else {
+      positional.push_back(arg);
+    }
+    if (!ok) {
+      std::cerr << "Bad flag: " << arg << "\n\n" << kUsage;
+      return 1;
+    }
+  }
+  if (positional.size() != 2 || !have_scale) {
+    std::cerr << kUsage;
+    return 1;
+  }
+
+  cv::VideoCapture capture(positional[0]);
+  if (!capture.isOpened()) {
+    std::cerr << "Couldn't open " << positional[0] << "\n";
+    return 1;
+  }
+  double fps = capture.get(cv::CAP_PROP_FPS);
+  // Some containers don't say; better a guess than no output.
+  if (!(fps > 0))
+    fps = 30;
+  const cv::Size size(static_cast<int>(capture.get(cv::CAP_PROP_FRAME_WIDTH)),
+                      static_cast<int>(capture.get(cv::CAP_PROP_FRAME_HEIGHT)));
+  cv::VideoWriter writer(
+      positional[1],
+      cv::VideoWriter::fourcc(codec[0], codec[1], codec[2], codec[3]), fps,
+      size);
+  if (!writer.isOpened()) {
+    std::cerr << "Couldn't write " << positional[1] << " with codec " << codec
+              << "\n";
+    return 1;
+  }
+
+  VideoPipeline pipeline(options);
+  const VideoPipeline::Result result = pipeline.Run(
+      [&capture](cv::Mat *frame) { return capture.read(*frame); },
+      [&writer](const cv::Mat &frame) {
+        writer.write(frame);
+        return true;
+      });
+  writer.release();
+  if (!result.error.empty())
+    std::cerr << positional[0] << ": " << result.error << "\n";
+
+  const double processed_fps = result.frames / std::max(result.seconds, 1e-9);
+  std::cerr << "Processed " << result.frames << " frames in " << result.seconds
+            << "s: " << processed_fps << " fps ("
+            << (processed_fps >= fps ? "faster" : "slower")
+            << " than real time)\n";
+  return result.error.empty() ? 0 : 1;
+}
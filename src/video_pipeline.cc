@@ -0,0 +1,161 @@
+#include "video_pipeline.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <utility>
+
+#include "min_max_pyramid.h"
+#include "relevel_kernel.h"
+
+// One frame on its way through the pipeline.
+struct VideoPipeline::Frame {
+  int64_t index = 0;
+  cv::Mat image;
+  cv::Mat output;
+};
+
+VideoPipeline::VideoPipeline(const Options &options) : options_(options) {}
+
+VideoPipeline::~VideoPipeline() = default;
+
+VideoPipeline::Result VideoPipeline::Run(const FrameSource &source,
+                                         const FrameSink &sink) {
+  const int workers = std::max(options_.worker_threads, 1);
+  to_workers_.clear();
+  from_workers_.clear();
+  for (int i = 0; i < workers; i++) {
+    to_workers_.emplace_back(new BoundedQueue<Frame>(options_.queue_depth));
+    from_workers_.emplace_back(new BoundedQueue<Frame>(options_.queue_depth));
+  }
+  failed_ = false;
+  frames_written_ = 0;
+  error_.clear();
+  next_to_smooth_ = 0;
+  average_min_.release();
+  average_max_.release();
+
+  const auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> threads;
+  threads.emplace_back([this, &source] { Decode(source); });
+  for (int i = 0; i < workers; i++)
+    threads.emplace_back([this, i] { Work(i); });
+  threads.emplace_back([this, &sink] { Encode(sink); });
+  for (std::thread &thread : threads)
+    thread.join();
+
+  Result result;
+  result.seconds = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start)
+                       .count();
+  result.frames = frames_written_;
+  result.error = error_;
+  return result;
+}
+
+void VideoPipeline::Decode(const FrameSource &source) {
+  const int workers = static_cast<int>(to_workers_.size());
+  for (int64_t index = 0; !failed_; index++) {
+    Frame frame;
+    frame.index = index;
+    if (!source(&frame.image) || frame.image.empty())
+      break;
+    if (index == 0) {
+      if (frame.image.depth() != CV_8U) {
+        Fail("only 8-bit video is supported");
+        break;
+      }
+      // The workers read these, but only after popping a frame, which
+      // happens after this.
+      frame_size_ = frame.image.size();
+      if (options_.scale.automatic) {
+        // Once for the whole video, from the first frame, so that the
+        // mapping doesn't jump around from one frame to the next.
+        MinMaxPyramid pyramid;
+        pyramid.PreProcess(frame.image);
+        scale_ = options_.scale.Resolve(pyramid);
+      } else {
+        int min_scale, max_scale;
+        MinMaxPyramid::ScaleRange(frame_size_, &min_scale, &max_scale);
+        scale_ = options_.scale.Resolve(min_scale, max_scale);
+      }
+    } else if (frame.image.size() != frame_size_) {
+      Fail("frame " + std::to_string(index) + " changed size");
+      break;
+    }
+    to_workers_[index % workers]->Push(std::move(frame));
+  }
+  for (auto &queue : to_workers_)
+    queue->Close();
+}
+
+void VideoPipeline::Work(int worker) {
+  Frame frame;
+  while (to_workers_[worker]->Pop(&frame)) {
+    // Straight down to the one level we need. Fresh Mats each time, since
+    // DownsampleMinMax can't work in place.
+    cv::Mat min_level, max_level;
+    DownsampleMinMax(frame.image, frame.image, &min_level, &max_level);
+    for (int level = 0; level < scale_; level++) {
+      cv::Mat next_min, next_max;
+      DownsampleMinMax(min_level, max_level, &next_min, &next_max);
+      min_level = next_min;
+      max_level = next_max;
+    }
+    if (options_.smoothing > 0)
+      Smooth(frame.index, &min_level, &max_level);
+
+    RelevelFused(frame.image, min_level, max_level, &frame.output);
+    frame.image.release();
+    from_workers_[worker]->Push(std::move(frame));
+  }
+  from_workers_[worker]->Close();
+}
+
+void VideoPipeline::Smooth(int64_t index, cv::Mat *min_level,
+                           cv::Mat *max_level) {
+  std::unique_lock<std::mutex> lock(smooth_mutex_);
+  smooth_turn_.wait(lock, [&] { return next_to_smooth_ == index; });
+  if (average_min_.empty()) {
+    // The first frame has nothing to blend with.
+    min_level->convertTo(average_min_, CV_32F);
+    max_level->convertTo(average_max_, CV_32F);
+  } else {
+    // Blending min with min and max with max keeps min <= max, since each
+    // frame's own levels satisfy it.
+    const double keep = options_.smoothing;
+    cv::Mat frame_min, frame_max;
+    min_level->convertTo(frame_min, CV_32F);
+    max_level->convertTo(frame_max, CV_32F);
+    cv::addWeighted(average_min_, keep, frame_min, 1 - keep, 0, average_min_);
+    cv::addWeighted(average_max_, keep, frame_max, 1 - keep, 0, average_max_);
+    average_min_.convertTo(*min_level, CV_8U);
+    average_max_.convertTo(*max_level, CV_8U);
+  }
+  next_to_smooth_++;
+  lock.unlock();
+  smooth_turn_.notify_all();
+}
+
+void VideoPipeline::Encode(const FrameSink &sink) {
+  const int workers = static_cast<int>(from_workers_.size());
+  Frame frame;
+  for (int64_t index = 0; from_workers_[index % workers]->Pop(&frame);
+       index++) {
+    // Keep draining after a failure, so that the workers don't get stuck.
+    if (failed_)
+      continue;
+    if (!sink(frame.output)) {
+      Fail("couldn't write frame " + std::to_string(index));
+      continue;
+    }
+    frames_written_++;
+  }
+}
+
+void VideoPipeline::Fail(const std::string &error) {
+  std::lock_guard<std::mutex> lock(error_mutex_);
+  if (error_.empty())
+    error_ = error;
+  failed_ = true;
+}
@@ -0,0 +1,102 @@
+#ifndef VIDEO_PIPELINE_
+#define VIDEO_PIPELINE_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "batch_pipeline.h"
+#include "bounded_queue.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+// Relevels a stream of video frames at a fixed scale, keeping them in order:
+//
+//   decode -+-> worker 0 -+
+//           +-> worker 1 -+-> encode
+//           +-> ...      -+
+//
+// Decoding and encoding are inherently sequential, so each gets one thread
+// (codecs generally have threads of their own anyway). Frames are dealt out to
+// the workers round-robin, each with its own short queues in and out, so the
+// encoder gets them back in order just by visiting the workers in turn.
+//
+// Video doesn't need a whole pyramid per frame: at a fixed scale, only the one
+// level Relevel uses matters. Each worker reduces its frame down to that level
+// and relevels against it, which is as cheap as it gets.
+//
+// Consecutive frames can have visibly different local min/max, which makes the
+// output flicker. With temporal smoothing on, each frame's level is blended
+// with the running average of the frames before it. That's the one step that
+// has to happen in frame order, but at the coarse levels it's a tiny image, so
+// workers just take turns at it.
+class VideoPipeline {
+public:
+  struct Options {
+    ScaleRule scale;
+    // How much of the running average each frame's min/max level keeps, from
+    // 0 (no smoothing) up to (but not including) 1. E.g. at 0.8, a change in
+    // the scene takes about 5 frames to fully show up in the mapping.
+    float smoothing = 0;
+    int worker_threads = 1;
+    // Frames allowed to wait in front of, and behind, each worker.
+    size_t queue_depth = 2;
+  };
+
+  // Fills in the next frame, returning false at the end of the stream. Frames
+  // must all be the same size and type (8-bit).
+  using FrameSource = std::function<bool(cv::Mat *frame)>;
+  // Returns false if the frame couldn't be written, which ends the run.
+  using FrameSink = std::function<bool(const cv::Mat &frame)>;
+
+  struct Result {
+    int64_t frames = 0;
+    double seconds = 0;
+    // Empty on success.
+    std::string error;
+  };
+
+  explicit VideoPipeline(const Options &options);
+  ~VideoPipeline();
+
+  // Processes every frame from `source` into `sink`, blocking until done.
+  // `source` is only called from one thread, as is `sink`.
+  Result Run(const FrameSource &source, const FrameSink &sink);
+
+private:
+  struct Frame;
+
+  void Decode(const FrameSource &source);
+  void Work(int worker);
+  void Encode(const FrameSink &sink);
+  // Blends the frame's levels into the running average, in frame order.
+  void Smooth(int64_t index, cv::Mat *min_level, cv::Mat *max_level);
+  void Fail(const std::string &error);
+
+  const Options options_;
+
+  // Everything below exists only for the duration of Run().
+  std::vector<std::unique_ptr<BoundedQueue<Frame>>> to_workers_;
+  std::vector<std::unique_ptr<BoundedQueue<Frame>>> from_workers_;
+  // Set by the decode thread before the first frame goes out.
+  cv::Size frame_size_;
+  int scale_ = 0;
+  std::atomic<bool> failed_{false};
+  std::atomic<int64_t> frames_written_{0};
+  std::mutex error_mutex_;
+  std::string error_;
+
+  // Running averages of the min and max levels, as CV_32F so that small
+  // changes don't get lost to rounding. Guarded by smooth_mutex_.
+  std::mutex smooth_mutex_;
+  std::condition_variable smooth_turn_;
+  int64_t next_to_smooth_ = 0;
+  cv::Mat average_min_;
+  cv::Mat average_max_;
+};
+
+#endif // VIDEO_PIPELINE_
@@ -0,0 +1,150 @@
+#include "video_pipeline.h"
+
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "min_max_pyramid.h"
+#include "opencv4/opencv2/opencv.hpp"
+
+namespace {
+
+std::vector<cv::Mat> NoiseFrames(int count) {
+  std::vector<cv::Mat> frames;
+  for (int i = 0; i < count; i++) {
+    cv::Mat frame(48, 64, CV_8UC3);
+    cv::randu(frame, cv::Scalar::all(0), cv::Scalar::all(256));
+    frames.push_back(frame);
+  }
+  return frames;
+}
+
+// Runs the frames through a pipeline, returning what comes out.
+std::vector<cv::Mat> RunFrames(const VideoPipeline::Options &options,
+                               const std::vector<cv::Mat> &frames,
+                               VideoPipeline::Result *result) {
+  size_t next = 0;
+  std::vector<cv::Mat> outputs;
+  VideoPipeline pipeline(options);
+  *result = pipeline.Run(
+      [&](cv::Mat *frame) {
+        if (next == frames.size())
+          return false;
+        *frame = frames[next++];
+        return true;
+      },
+      [&](const cv::Mat &frame) {
+        outputs.push_back(frame);
+        return true;
+      });
+  return outputs;
+}
+
+// What Relevel gives for the frame on its own.
+cv::Mat Unsmoothed(const cv::Mat &frame, const ScaleRule &rule) {
+  MinMaxPyramid pyramid;
+  pyramid.PreProcess(frame);
+  return pyramid.Relevel(rule.Resolve(pyramid));
+}
+
+double MaxDifference(const cv::Mat &a, const cv::Mat &b) {
+  return cv::norm(a, b, cv::NORM_INF);
+}
+
+// Summed over every element, for telling "a bit different" from "very".
+double TotalDifference(const cv::Mat &a, const cv::Mat &b) {
+  return cv::norm(a, b, cv::NORM_L1);
+}
+
+} // namespace
+
+TEST(VideoPipeline, MatchesPerFrameRelevelInOrder) {
+  const std::vector<cv::Mat> frames = NoiseFrames(11);
+  VideoPipeline::Options options;
+  options.scale = ScaleRule{true, 1};
+  options.worker_threads = 3;
+
+  VideoPipeline::Result result;
+  const std::vector<cv::Mat> outputs = RunFrames(options, frames, &result);
+  EXPECT_EQ("", result.error);
+  EXPECT_EQ(11, result.frames);
+  ASSERT_EQ(frames.size(), outputs.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    EXPECT_EQ(0, MaxDifference(Unsmoothed(frames[i], options.scale),
+                               outputs[i]))
+        << "frame " << i;
+  }
+}
+
+TEST(VideoPipeline, AutomaticScaleComesFromFirstFrame) {
+  // A smooth first frame wants a coarse scale, and noise a fine one; the
+  // noise has to make do with the first frame's.
+  cv::Mat ramp(48, 64, CV_8UC3);
+  for (int x = 0; x < ramp.cols; x++)
+    ramp.col(x).setTo(cv::Scalar::all(x * 4));
+  std::vector<cv::Mat> frames = NoiseFrames(4);
+  frames.insert(frames.begin(), ramp);
+  VideoPipeline::Options options;
+  options.scale.automatic = true;
+  options.worker_threads = 2;
+
+  MinMaxPyramid first;
+  first.PreProcess(ramp);
+  const ScaleRule fixed{false, first.EstimateScale()};
+  MinMaxPyramid noise;
+  noise.PreProcess(frames[1]);
+  ASSERT_NE(fixed.value, noise.EstimateScale());
+
+  VideoPipeline::Result result;
+  const std::vector<cv::Mat> outputs = RunFrames(options, frames, &result);
+  EXPECT_EQ("", result.error);
+  ASSERT_EQ(frames.size(), outputs.size());
+  for (size_t i = 0; i < frames.size(); i++) {
+    EXPECT_EQ(0, MaxDifference(Unsmoothed(frames[i], fixed), outputs[i]))
+        << "frame " << i;
+  }
+}
+
+TEST(VideoPipeline, SmoothingBlendsLevelsAcrossFrames) {
+  const std::vector<cv::Mat> scenes = NoiseFrames(2);
+  // A still scene, then a cut to another.
+  std::vector<cv::Mat> frames(6, scenes[0]);
+  frames.insert(frames.end(), 6, scenes[1]);
+
+  VideoPipeline::Options options;
+  options.scale = ScaleRule{true, 1};
+  options.worker_threads = 4;
+  options.smoothing = 0.8f;
+  VideoPipeline::Result result;
+  const std::vector<cv::Mat> outputs = RunFrames(options, frames, &result);
+  ASSERT_EQ(frames.size(), outputs.size());
+
+  // Nothing to smooth until the scene changes...
+  const cv::Mat first = Unsmoothed(scenes[0], options.scale);
+  for (int i = 0; i < 6; i++)
+    EXPECT_EQ(0, MaxDifference(first, outputs[i])) << "frame " << i;
+  // ...after which the mapping eases over rather than jumping.
+  const cv::Mat second = Unsmoothed(scenes[1], options.scale);
+  EXPECT_GT(TotalDifference(second, outputs[6]),
+            2 * TotalDifference(second, outputs[11]));
+}
+
+TEST(VideoPipeline, StopsWhenSinkFails) {
+  const std::vector<cv::Mat> frames = NoiseFrames(20);
+  size_t next = 0;
+  int written = 0;
+  VideoPipeline::Options options;
+  options.scale = ScaleRule{true, 1};
+  options.worker_threads = 2;
+  VideoPipeline pipeline(options);
+  const VideoPipeline::Result result = pipeline.Run(
+      [&](cv::Mat *frame) {
+        if (next == frames.size())
+          return false;
+        *frame = frames[next++];
+        return true;
+      },
+      [&](const cv::Mat &) { return ++written <= 3; });
+  EXPECT_EQ(3, result.frames);
+  EXPECT_THAT(result.error, ::testing::HasSubstr("frame 3"));
+}